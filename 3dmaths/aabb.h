@@ -2,6 +2,7 @@
 #define AABB_H
 
 #include "v3.h"
+#include "plane.h"
 #include "utils.h"
 
 namespace P3D
@@ -109,6 +110,28 @@ namespace P3D
             return true;
         }
 
+        //1 = Box fully in front of plane.
+        //-1 = Box fully behind plane.
+        //0 = Box straddles plane.
+        constexpr int PlaneSide(const Plane<T>& plane) const
+        {
+            const V3<T> n = plane.Normal();
+
+            //Corner furthest along the plane normal.
+            const V3<T> p(n.x >= 0 ? x2 : x1, n.y >= 0 ? y2 : y1, n.z >= 0 ? z2 : z1);
+
+            if(plane.DistanceToPoint(p) < 0)
+                return -1;
+
+            //Corner furthest against the plane normal.
+            const V3<T> q(n.x >= 0 ? x1 : x2, n.y >= 0 ? y1 : y2, n.z >= 0 ? z1 : z2);
+
+            if(plane.DistanceToPoint(q) >= 0)
+                return 1;
+
+            return 0;
+        }
+
     private:
 
         T x1;
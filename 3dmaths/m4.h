@@ -266,6 +266,28 @@ namespace P3D
             return V4<T>(x, y, z, w);
         }
 
+        //Transform a direction. No translation.
+        constexpr V4<T> mapVector(const V3<T>& vector) const
+        {
+            const T x = T(vector.x) * m[0][0] +
+                        T(vector.y) * m[1][0] +
+                        T(vector.z) * m[2][0];
+
+            const T y = T(vector.x) * m[0][1] +
+                        T(vector.y) * m[1][1] +
+                        T(vector.z) * m[2][1];
+
+            const T z = T(vector.x) * m[0][2] +
+                        T(vector.y) * m[1][2] +
+                        T(vector.z) * m[2][2];
+
+            const T w = T(vector.x) * m[0][3] +
+                        T(vector.y) * m[1][3] +
+                        T(vector.z) * m[2][3];
+
+            return V4<T>(x, y, z, w);
+        }
+
         constexpr void translate(const V3<T>& vector)
         {
             const T vx = vector.x;
@@ -81,6 +81,36 @@ namespace P3D
         return (val.toFPInt() + fpbits) >> fracbits;
     }
 
+    //Round to an int with 'bits' fractional bits.
+    template <unsigned int bits, class T>
+    constexpr inline int pToFixedInt(const T val)
+    {
+        return (int)std::floor((val * T(1 << bits)) + T(0.5));
+    }
+
+    template <unsigned int bits, unsigned int fracbits>
+    constexpr inline int pToFixedInt(const FP<fracbits> val)
+    {
+        static_assert(bits < fracbits);
+
+        return (val.toFPInt() + (1 << (fracbits - bits - 1))) >> (fracbits - bits);
+    }
+
+    //Integer divides rounding towards -inf and +inf. d must be > 0.
+    template <class T>
+    constexpr inline T pFloorDiv(const T n, const T d)
+    {
+        const T q = n / d;
+
+        return ((n % d) < 0) ? (q - 1) : q;
+    }
+
+    template <class T>
+    constexpr inline T pCeilDiv(const T n, const T d)
+    {
+        return -pFloorDiv(-n, d);
+    }
+
     template <class T>
     constexpr inline T pAbs(const T v)
     {
@@ -35,6 +35,9 @@ namespace P3D
         unsigned int triangle_count;
         unsigned int triangle_offset; //Bytes from BspModel*
 
+        unsigned int polygon_count;
+        unsigned int polygon_offset; //Bytes from BspModel*
+
         unsigned int node_count;
         unsigned int node_offset;
 
@@ -56,10 +59,34 @@ namespace P3D
         Plane<fp> edge_plane_1_2;
         Plane<fp> edge_plane_2_0;
 
+        //Object space step across the face for +1 texel in u and in v.
+        V3<fp> u_axis;
+        V3<fp> v_axis;
+
         int texture;
         pixel color;
     } BspModelTriangle;
 
+    inline constexpr unsigned int BSP_POLYGON_MAX_VERTS = 8;
+
+    //Coplanar triangles of one node and material merged into a convex polygon for drawing.
+    //Collision still uses the triangles.
+    typedef struct BspModelPolygon
+    {
+        Vertex3d verts[BSP_POLYGON_MAX_VERTS];
+        unsigned int vertex_count;
+        AABB<fp> poly_bb;
+
+        Plane<fp> normal_plane;
+
+        //Object space step across the face for +1 texel in u and in v.
+        V3<fp> u_axis;
+        V3<fp> v_axis;
+
+        int texture;
+        pixel color;
+    } BspModelPolygon;
+
     typedef struct TriIndexList
     {
         unsigned short offset;
@@ -69,11 +96,15 @@ namespace P3D
     typedef struct BspNodeTexture
     {
         unsigned int texture_pixels_offset; //Pixels
+        unsigned int alpha_skip_offset; //Pixels. Alpha textures only. TEX_SIZE * TEX_SIZE bytes.
         unsigned short width;
         unsigned short height;
         bool alpha;
     } BspNodeTexture;
 
+    //BspModel's sorts keep traversal flags in the top bits of a node index.
+    inline constexpr unsigned int BSP_MAX_NODES = 1 << 24;
+
     typedef struct BspModelNode
     {
         Plane<fp> plane;
@@ -84,5 +115,7 @@ namespace P3D
         unsigned int back_node;
         TriIndexList front_tris;
         TriIndexList back_tris;
+        TriIndexList front_polys;
+        TriIndexList back_polys;
     } BspModelNode;
 }
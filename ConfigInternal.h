@@ -15,12 +15,39 @@ namespace P3D
 
 
     inline constexpr int SUBDIVIDE_SPAN_SHIFT = constexpr_log2(SUBDIVIDE_SPAN_LEN);
+    inline constexpr int SUBDIVIDE_SPAN_MIN_SHIFT = constexpr_log2(SUBDIVIDE_SPAN_MIN_LEN);
+    inline constexpr int SUBDIVIDE_SPAN_MAX_SHIFT = constexpr_log2(SUBDIVIDE_SPAN_MAX_LEN);
+
+    //Polygon edges are stepped on screen coords with this many bits of sub-pixel precision. (28.4)
+    inline constexpr int SUBPIXEL_BITS = 4;
+    inline constexpr int SUBPIXEL_ONE = (1 << SUBPIXEL_BITS);
+    inline constexpr int SUBPIXEL_HALF = (SUBPIXEL_ONE >> 1);
 
     inline constexpr int FOG_SHIFT = constexpr_log2(FOG_LEVELS);
     inline constexpr int LIGHT_SHIFT = constexpr_log2(LIGHT_LEVELS);
     inline constexpr fp FOG_MAX = fp(1) - std::numeric_limits<fp>().epsilon();
     inline constexpr fp LIGHT_MAX = fp(1) - std::numeric_limits<fp>().epsilon();
 
+    //Largest screen space coord a guard band may produce. Half of fp max so differences don't overflow.
+    inline constexpr int GUARD_BAND_MAX_COORD = std::is_floating_point<fp>::value ? (1 << 24) : (int(std::numeric_limits<fp>::max()) / 2);
+
+    inline constexpr int HI_Z_TILE_SHIFT = 3;
+    inline constexpr int HI_Z_TILE_SIZE = (1 << HI_Z_TILE_SHIFT);
+
+    //Polygons, and their verts, a render mode sets up in its geometry phase before its raster phase draws them.
+    inline constexpr unsigned int SETUP_BUFFER_POLYGONS = 32;
+    inline constexpr unsigned int SETUP_BUFFER_VERTS = SETUP_BUFFER_POLYGONS * 4;
+
+    //Spans a render mode holds back before it draws them. A polygon that would run out of room draws them first.
+    inline constexpr unsigned int DEFERRED_SPAN_MAX = 4096;
+
+    //Depth epochs are this far apart. Depth drawn in one epoch never reaches the next.
+    inline constexpr fp DEPTH_EPOCH_SPAN = fp(256);
+
+    //Epochs between Z-buffer fills. The oldest biased depth must still fit in fp.
+    //A float fp has the range for more, but every bit of bias costs a bit of depth precision.
+    inline constexpr unsigned int DEPTH_EPOCH_COUNT = std::is_floating_point<fp>::value ? 127 : (int(std::numeric_limits<fp>::max() / DEPTH_EPOCH_SPAN) - 1);
+
 }
 
 #endif // CONFIGINTERNAL_H
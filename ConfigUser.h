@@ -3,11 +3,18 @@
 
 #include "3dmaths/f3dmath.h"
 #include "Pixel.h"
+#include "Depth.h"
 
 namespace P3D
 {
     #ifndef __arm__
         #define RENDER_STATS
+
+        //BspModel::SortParallel(). Sorts big trees across threads. Needs std::thread.
+        #define BSP_PARALLEL_SORT
+
+        //RenderDevice::SetSetupBatch(). Records the geometry phase for another device to rasterise, on another thread.
+        #define SETUP_BATCH
     #endif
 
     //Type of a texture and framebuffer pixel.
@@ -27,6 +34,12 @@ namespace P3D
 
     inline constexpr int CLIP_GUARD_BAND_SHIFT = 1;
 
+    //Widen the X/Y guard band as far as the viewport size allows without overflowing fp.
+    //Only triangles that would overflow and those crossing the near plane get clipped.
+    //Everything else is scissored to the viewport when rasterized.
+    #define GUARD_BAND_CLIPPING
+    inline constexpr int GUARD_BAND_MAX_SHIFT = 8;
+
 
     //#define USE_FLOAT
     #ifdef USE_FLOAT
@@ -35,9 +48,46 @@ namespace P3D
         typedef FP16 fp;
     #endif
 
-    typedef fp z_val;
+    //Store depth as 16 bit normalised values instead of fp. The Z-buffer takes half the memory.
+    //#define DEPTH_16
+    #ifdef DEPTH_16
+        typedef Depth16<fp> z_val;
+    #else
+        typedef fp z_val;
+    #endif
 
     inline constexpr int SUBDIVIDE_SPAN_LEN = 16;
+
+    //Pick the sub-span length per scanline instead of always using SUBDIVIDE_SPAN_LEN.
+    //The longest power of 2 between the min and max lengths whose affine error stays under SUBDIVIDE_MAX_ERROR pixels.
+    #define SUBDIVIDE_ADAPTIVE
+    inline constexpr int SUBDIVIDE_SPAN_MIN_LEN = 4;
+    inline constexpr int SUBDIVIDE_SPAN_MAX_LEN = 64;
+    inline constexpr fp SUBDIVIDE_MAX_ERROR = fp(0.5);
+
+    //Draw perspective textured polygons whose w is near constant down each screen column in columns.
+    //One reciprocal per column instead of per pixel or sub-span. Walls seen by a level camera are like this.
+    #define WALL_COLUMNS
+
+    //Draw perspective textured polygons whose w is near constant along each scanline affine, with one reciprocal per span.
+    //Floors and ceilings seen by a camera without roll are like this.
+    #define FLOOR_SPANS
+
+    //Tag depth values with the epoch they were drawn in, so ClearDepth to the far plane only steps a counter.
+    //The Z-buffer is really filled once every DEPTH_EPOCH_COUNT clears. Needs fp depth so not with DEPTH_16.
+    #ifndef DEPTH_16
+        #define DEPTH_EPOCH_CLEAR
+    #endif
+
+    //Keep the furthest depth of each 8x8 tile of the Z-buffer.
+    //Z tested spans skip the tiles they are wholly behind without reading the Z-buffer.
+    #define HI_Z
+
+    //Hold back the spans of Z buffered polygons and draw them at the end of a draw, grouped by texture.
+    //Each texture is then read for all its spans at once rather than between other textures' spans.
+    //DEFERRED_SPAN_MAX spans are held per render mode. Takes more RAM than the GBA can spare.
+    //#define DEFERRED_SPANS
+
     //inline constexpr fp SUBDIVIDE_Z_THREASHOLD = fp(5);
     inline constexpr fp SUBDIVIDE_Z_THREASHOLD = fp(2);
 
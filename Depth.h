@@ -0,0 +1,50 @@
+#ifndef DEPTH_H
+#define DEPTH_H
+
+#include <type_traits>
+
+namespace P3D
+{
+    //Depth stored as 16 bits normalised over 0..1. Built from the fp z the rasterizer steps.
+    //With FP16 the stored bits are the fraction bits of z so no precision is lost.
+    template<class TFp> class Depth16
+    {
+    public:
+
+        constexpr Depth16() : d(0) {}
+        constexpr Depth16(const Depth16& r) = default;
+
+        constexpr Depth16(const TFp z)
+        {
+            int v;
+
+            if constexpr (std::is_floating_point<TFp>::value)
+                v = (int)(z * max());
+            else
+                v = z.toFPInt();
+
+            //z stays in 0..1 so one compare is all the common case pays.
+            if((unsigned int)v > max())
+                v = (v < 0) ? 0 : max();
+
+            d = v;
+        }
+
+        constexpr Depth16& operator=(const Depth16& r) = default;
+
+        constexpr bool operator<(const Depth16& r) const    {return d < r.d;}
+        constexpr bool operator>(const Depth16& r) const    {return d > r.d;}
+        constexpr bool operator<=(const Depth16& r) const   {return d <= r.d;}
+        constexpr bool operator>=(const Depth16& r) const   {return d >= r.d;}
+        constexpr bool operator==(const Depth16& r) const   {return d == r.d;}
+        constexpr bool operator!=(const Depth16& r) const   {return d != r.d;}
+
+        constexpr unsigned int toUNorm() const {return d;}
+
+        static constexpr unsigned int max() {return 0xffff;}
+
+    private:
+        unsigned short d;
+    };
+}
+#endif // DEPTH_H
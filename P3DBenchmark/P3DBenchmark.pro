@@ -12,6 +12,7 @@ INCLUDEPATH += "C:\devkitPro\libgba\include"
 
 SOURCES += \
     source/main.iwram.cpp \
+    source/bspmodel.cpp \
     source/recip.cpp
 
 
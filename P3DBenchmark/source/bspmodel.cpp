@@ -0,0 +1 @@
+#include "../../bspmodel.cpp"
@@ -1,6 +1,7 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <cstring>
+#include <cassert>
 
 
 #ifdef __arm__
@@ -9,12 +10,16 @@
     #include <gba_timers.h>
 #else
     #include <QElapsedTimer>
+    #include <thread>
+    #include <vector>
+    #include <algorithm>
 #endif
 
 
 #include "../../RenderDevice.h"
 #include "../../RenderTarget.h"
 #include "../../PixelShaderGBA8.h"
+#include "../../bspmodel.h"
 
 #define DCNT_PAGE 0x0010
 
@@ -74,6 +79,700 @@ inline int16_t r16()
     return (int16_t)rng32() & 511;
 }
 
+void StartTimer()
+{
+#ifdef __arm__
+    REG_TM2CNT_H = 0;
+    REG_TM3CNT_H = 0;
+
+    REG_TM2CNT_L= 65535-65;     // 65 ticks = 1/1000 secs
+    REG_TM3CNT_L = 0;
+
+    // cascade into tm3
+    REG_TM3CNT_H = TM_CASCADE | TM_ENABLE;
+    REG_TM2CNT_H = TM_FREQ_256 | TM_ENABLE;       // we're using the 256 cycle timer
+#endif
+}
+
+typedef struct BenchmarkResult
+{
+    unsigned int render_flags;
+    unsigned int vertex_bytes;
+    unsigned int edge_bytes;
+    double ms;
+    double tri_cost; //Cycles per triangle on GBA. ns per triangle on host.
+} BenchmarkResult;
+
+#ifdef __arm__
+    const int runs = 1000;
+#else
+    const int runs = 1000000;
+#endif
+
+template<const unsigned int render_flags> BenchmarkResult RunBenchmark(P3D::RenderDevice* render_device)
+{
+    render_device->SetRenderFlags<render_flags, P3D::PixelShaderGBA8<render_flags>>();
+    render_device->SetFogLightMap(fogLightMap);
+    render_device->ClearDepth(1);
+
+    P3D::V2<P3D::fp> uv[3];
+    uv[0] = P3D::V2<P3D::fp>(0,0);
+    uv[1] = P3D::V2<P3D::fp>(64,0);
+    uv[2] = P3D::V2<P3D::fp>(64,64);
+
+    unsigned int vi[3] = {2,1,0};
+
+    P3D::fp lights[3] = {P3D::fp(0.25), P3D::fp(0.5), P3D::fp(0.75)};
+
+#ifndef __arm__
+    QElapsedTimer t;
+    t.start();
+#else
+    StartTimer();
+#endif
+
+    for(int i = 0; i < runs; i++)
+    {
+        P3D::V3<P3D::fp> v[3];
+        v[0] = P3D::V3<P3D::fp>(-100 + r8(),100+ r8(),0+ r8());
+        v[1] = P3D::V3<P3D::fp>(100+ r8(),100+ r8(),0+ r8());
+        v[2] = P3D::V3<P3D::fp>(100+ r8(),-100+ r8(),0+ r8());
+
+        render_device->TransformVertexes(v, 3);
+
+        render_device->DrawTriangle(vi, uv, lights);
+    }
+
+    BenchmarkResult result;
+    result.render_flags = render_flags;
+    result.vertex_bytes = sizeof(P3D::Internal::Vertex4d<render_flags>);
+    result.edge_bytes = sizeof(P3D::Internal::TriEdgeTrace<render_flags>);
+
+#ifndef __arm__
+    const uint64_t ns = t.nsecsElapsed();
+
+    result.ms = ns / 1000000.0;
+    result.tri_cost = (double)ns / runs;
+#else
+    const uint64_t ticks = REG_TM3CNT_L;
+
+    //Each tick is 65 * 256 cycles.
+    result.ms = ticks;
+    result.tri_cost = (double)(ticks * 65 * 256) / runs;
+#endif
+
+    return result;
+}
+
+//Clears the depth buffer then draws a frame of triangles with it, so the cost of the clear is part of each frame.
+//With fill every clear fills the Z-buffer, as it would without DEPTH_EPOCH_CLEAR.
+BenchmarkResult RunClearBenchmark(P3D::RenderDevice* render_device, const P3D::RenderTarget* render_target, const bool fill)
+{
+    constexpr unsigned int render_flags = P3D::RenderFlags::ZTest | P3D::RenderFlags::ZWrite;
+    constexpr int frame_tris = 10;
+
+    render_device->SetRenderFlags<render_flags, P3D::PixelShaderGBA8<render_flags>>();
+
+    P3D::V2<P3D::fp> uv[3];
+    uv[0] = P3D::V2<P3D::fp>(0,0);
+    uv[1] = P3D::V2<P3D::fp>(64,0);
+    uv[2] = P3D::V2<P3D::fp>(64,64);
+
+    P3D::fp lights[3] = {P3D::fp(0.25), P3D::fp(0.5), P3D::fp(0.75)};
+
+#ifndef __arm__
+    QElapsedTimer t;
+    t.start();
+#else
+    StartTimer();
+#endif
+
+    for(int i = 0; i < runs / frame_tris; i++)
+    {
+#ifdef DEPTH_EPOCH_CLEAR
+        if(fill)
+            render_target->ResetDepthEpoch();
+#else
+        (void)render_target;
+        (void)fill;
+#endif
+
+        render_device->ClearDepth(1);
+
+        for(int j = 0; j < frame_tris; j++)
+        {
+            P3D::V3<P3D::fp> v[3];
+            v[0] = P3D::V3<P3D::fp>(-100 + r8(),100+ r8(),0+ r8());
+            v[1] = P3D::V3<P3D::fp>(100+ r8(),100+ r8(),0+ r8());
+            v[2] = P3D::V3<P3D::fp>(100+ r8(),-100+ r8(),0+ r8());
+
+            render_device->DrawTriangle(v, uv, lights);
+        }
+    }
+
+    BenchmarkResult result;
+    result.render_flags = render_flags;
+    result.vertex_bytes = sizeof(P3D::Internal::Vertex4d<render_flags>);
+    result.edge_bytes = sizeof(P3D::Internal::TriEdgeTrace<render_flags>);
+
+#ifndef __arm__
+    const uint64_t ns = t.nsecsElapsed();
+
+    result.ms = ns / 1000000.0;
+    result.tri_cost = (double)ns / runs;
+#else
+    const uint64_t ticks = REG_TM3CNT_L;
+
+    //Each tick is 65 * 256 cycles.
+    result.ms = ticks;
+    result.tri_cost = (double)(ticks * 65 * 256) / runs;
+#endif
+
+    return result;
+}
+
+#ifdef RENDER_STATS
+//Z buffered frames of triangles that each pick one of several textures, so consecutive spans keep changing texture.
+//Counts how often a span is drawn with a different texture to the one before.
+//That is a proxy for texel cache misses, not a measure of them. See RenderStats::texture_switches.
+BenchmarkResult RunTextureSortBenchmark(P3D::RenderDevice* render_device, unsigned int& switches_per_frame)
+{
+    constexpr unsigned int render_flags = P3D::RenderFlags::ZTest | P3D::RenderFlags::ZWrite;
+    constexpr int frame_tris = 50;
+    constexpr int texture_count = 8;
+
+    static P3D::pixel textures[texture_count][P3D::TEX_SIZE_PIXELS];
+    static P3D::Material materials[texture_count];
+
+    for(int i = 0; i < texture_count; i++)
+    {
+        for(int j = 0; j < P3D::TEX_SIZE_PIXELS; j++)
+            textures[i][j] = rng32();
+
+        materials[i].type = P3D::Material::Texture;
+        materials[i].pixels = textures[i];
+    }
+
+    render_device->SetRenderFlags<render_flags, P3D::PixelShaderGBA8<render_flags>>();
+    render_device->SetFogLightMap(fogLightMap);
+
+    P3D::V2<P3D::fp> uv[3];
+    uv[0] = P3D::V2<P3D::fp>(0,0);
+    uv[1] = P3D::V2<P3D::fp>(64,0);
+    uv[2] = P3D::V2<P3D::fp>(64,64);
+
+    P3D::fp lights[3] = {P3D::fp(0.25), P3D::fp(0.5), P3D::fp(0.75)};
+
+    const int frames = runs / frame_tris;
+    const unsigned int switches = render_device->GetRenderStats().texture_switches;
+
+    QElapsedTimer t;
+    t.start();
+
+    for(int i = 0; i < frames; i++)
+    {
+        //Draws the spans held back from the frame before.
+        render_device->ClearDepth(1);
+
+        for(int j = 0; j < frame_tris; j++)
+        {
+            P3D::V3<P3D::fp> v[3];
+            v[0] = P3D::V3<P3D::fp>(-100 + r8(),100+ r8(),0+ r8());
+            v[1] = P3D::V3<P3D::fp>(100+ r8(),100+ r8(),0+ r8());
+            v[2] = P3D::V3<P3D::fp>(100+ r8(),-100+ r8(),0+ r8());
+
+            render_device->SetMaterial(materials[rng32() % texture_count]);
+            render_device->DrawTriangle(v, uv, lights);
+        }
+    }
+
+    render_device->EndDraw();
+
+    BenchmarkResult result;
+    result.render_flags = render_flags;
+    result.vertex_bytes = sizeof(P3D::Internal::Vertex4d<render_flags>);
+    result.edge_bytes = sizeof(P3D::Internal::TriEdgeTrace<render_flags>);
+
+    const uint64_t ns = t.nsecsElapsed();
+
+    result.ms = ns / 1000000.0;
+    result.tri_cost = (double)ns / runs;
+
+    switches_per_frame = (render_device->GetRenderStats().texture_switches - switches) / frames;
+
+    return result;
+}
+#endif
+
+#ifndef __arm__
+typedef struct SceneTriangle
+{
+    P3D::V3<P3D::fp> verts[3];
+} SceneTriangle;
+
+//One of several views of the same scene. Split-screen halves, a minimap and security camera feeds.
+typedef struct ViewportSetup
+{
+    unsigned int width;
+    unsigned int height;
+    int yaw; //Degrees around the scene.
+} ViewportSetup;
+
+typedef struct ParallelViewportResult
+{
+    unsigned int viewports;
+    unsigned int threads;
+    double serial_ms;
+    double parallel_ms;
+    bool matches; //Every parallel frame was the same as its serial one.
+} ParallelViewportResult;
+
+//Draws frames of the scene into target and returns a checksum of every frame drawn.
+uint32_t DrawViewportFrames(P3D::RenderDevice* render_device, P3D::RenderTarget* target, const ViewportSetup& viewport, const std::vector<SceneTriangle>& scene, const P3D::Material& material, const int frames)
+{
+    constexpr unsigned int render_flags = P3D::RenderFlags::ZTest | P3D::RenderFlags::ZWrite | P3D::RenderFlags::SubdividePerspectiveMapping;
+
+    render_device->SetRenderFlags<render_flags, P3D::PixelShaderGBA8<render_flags>>();
+    render_device->SetRenderTarget(target);
+    render_device->SetPerspective(60, (float)viewport.width / (float)viewport.height, 10, 1000);
+    render_device->SetMaterial(material);
+
+    P3D::V2<P3D::fp> uv[3];
+    uv[0] = P3D::V2<P3D::fp>(0,0);
+    uv[1] = P3D::V2<P3D::fp>(64,0);
+    uv[2] = P3D::V2<P3D::fp>(64,64);
+
+    P3D::fp lights[3] = {P3D::fp(0.25), P3D::fp(0.5), P3D::fp(0.75)};
+
+    uint32_t checksum = 2166136261u;
+
+    for(int i = 0; i < frames; i++)
+    {
+        render_device->ClearColor(0);
+        render_device->ClearDepth(1);
+
+        render_device->PushMatrix();
+        render_device->Translate(P3D::V3<P3D::fp>(0,0,-500));
+        render_device->RotateY(viewport.yaw + i);
+
+        render_device->BeginFrame();
+        render_device->BeginDraw();
+
+        for(const SceneTriangle& t : scene)
+            render_device->DrawTriangle(t.verts, uv, lights);
+
+        render_device->EndDraw();
+        render_device->EndFrame();
+
+        render_device->PopMatrix();
+
+        const P3D::pixel* p = target->GetColorBuffer();
+
+        for(unsigned int j = 0; j < viewport.width * viewport.height; j++)
+            checksum = (checksum ^ p[j]) * 16777619u;
+    }
+
+    return checksum;
+}
+
+//Draws each viewport with its own RenderDevice and RenderTarget. First one after another, then all at once on their own threads.
+ParallelViewportResult RunParallelViewportBenchmark(const P3D::Material& material)
+{
+    constexpr int frames = 200;
+    constexpr int scene_tris = 200;
+
+    const ViewportSetup viewports[] =
+    {
+        {120, 160, 0}, {120, 160, 180}, //Split-screen.
+        {64, 64, 90}, //Minimap.
+        {80, 60, 45}, {80, 60, 135}, {80, 60, 225}, {80, 60, 270}, {80, 60, 315}, //Security cameras.
+    };
+
+    constexpr unsigned int count = sizeof(viewports) / sizeof(viewports[0]);
+
+    std::vector<SceneTriangle> scene(scene_tris);
+
+    for(SceneTriangle& t : scene)
+    {
+        const P3D::V3<P3D::fp> c(r8() * 2, r8(), r8() * 2);
+
+        for(P3D::V3<P3D::fp>& v : t.verts)
+            v = c + P3D::V3<P3D::fp>(r8() / 2, r8() / 2, r8() / 2);
+    }
+
+    uint32_t serial_checksums[count];
+    uint32_t parallel_checksums[count];
+
+    ParallelViewportResult result;
+    result.viewports = count;
+    result.threads = std::thread::hardware_concurrency();
+
+    QElapsedTimer t;
+    t.start();
+
+    for(unsigned int i = 0; i < count; i++)
+    {
+        P3D::RenderDevice render_device;
+        P3D::RenderTarget target(viewports[i].width, viewports[i].height);
+        target.AttachZBuffer();
+
+        serial_checksums[i] = DrawViewportFrames(&render_device, &target, viewports[i], scene, material, frames);
+    }
+
+    result.serial_ms = t.nsecsElapsed() / 1000000.0;
+
+    t.restart();
+
+    std::vector<std::thread> threads;
+
+    for(unsigned int i = 0; i < count; i++)
+    {
+        threads.emplace_back([&, i]()
+        {
+            P3D::RenderDevice render_device;
+            P3D::RenderTarget target(viewports[i].width, viewports[i].height);
+            target.AttachZBuffer();
+
+            parallel_checksums[i] = DrawViewportFrames(&render_device, &target, viewports[i], scene, material, frames);
+        });
+    }
+
+    for(std::thread& thread : threads)
+        thread.join();
+
+    result.parallel_ms = t.nsecsElapsed() / 1000000.0;
+
+    result.matches = true;
+
+    for(unsigned int i = 0; i < count; i++)
+        result.matches &= (serial_checksums[i] == parallel_checksums[i]);
+
+    return result;
+}
+#endif
+
+#ifdef BSP_PARALLEL_SORT
+typedef struct ParallelSortResult
+{
+    unsigned int threads;
+    unsigned int split_depth;
+    double view_us; //Polygons for drawing and triangles for collision, from one view.
+    bool matches; //Every view gave the same lists as Sort().
+} ParallelSortResult;
+
+typedef struct SortBenchmarkView
+{
+    P3D::V3<P3D::fp> eye;
+    P3D::Plane<P3D::fp> frustrum_planes[6];
+    P3D::AABB<P3D::fp> collision_box;
+} SortBenchmarkView;
+
+//Adds the node splitting lo to hi in half across axis depth % 3, then the nodes for each half until levels runs out.
+//Each node has a wall on its plane facing either way, like the rooms of a level.
+unsigned int AddSortBenchmarkNode(std::vector<P3D::BspModelNode>& nodes, std::vector<P3D::BspModelTriangle>& tris, std::vector<P3D::BspModelPolygon>& polys,
+                                  const float lo[3], const float hi[3], const unsigned int parent, const unsigned int depth, const unsigned int levels)
+{
+    const unsigned int index = nodes.size();
+
+    nodes.emplace_back();
+
+    const unsigned int axis = depth % 3;
+    const unsigned int a = (axis + 1) % 3;
+    const unsigned int b = (axis + 2) % 3;
+
+    const float split = (lo[axis] + hi[axis]) / 2;
+
+    float normal[3] = {0, 0, 0};
+    normal[axis] = 1;
+
+    const P3D::V3<P3D::fp> front_normal(normal[0], normal[1], normal[2]);
+    const P3D::V3<P3D::fp> back_normal(-normal[0], -normal[1], -normal[2]);
+
+    P3D::BspModelNode& n = nodes[index];
+
+    n.plane = P3D::Plane<P3D::fp>(front_normal, P3D::fp(split));
+    n.node_bb = P3D::AABB<P3D::fp>();
+    n.child_bb = P3D::AABB<P3D::fp>(lo[0], hi[0], lo[1], hi[1], lo[2], hi[2]);
+    n.parent_node = parent;
+    n.front_node = 0;
+    n.back_node = 0;
+
+    for(unsigned int side = 0; side < 2; side++)
+    {
+        //Half the cell across, somewhere in it.
+        const float wa = (hi[a] - lo[a]) / 2;
+        const float wb = (hi[b] - lo[b]) / 2;
+
+        const float ua = lo[a] + (wa * (rng32() % 256) / 256);
+        const float ub = lo[b] + (wb * (rng32() % 256) / 256);
+
+        const float corners[4][2] = {{ua, ub}, {ua + wa, ub}, {ua + wa, ub + wb}, {ua, ub + wb}};
+
+        P3D::V3<P3D::fp> verts[4];
+
+        for(unsigned int v = 0; v < 4; v++)
+        {
+            //Back facing walls are wound the other way.
+            const float* c = corners[side ? (3 - v) : v];
+
+            float pos[3];
+            pos[axis] = split;
+            pos[a] = c[0];
+            pos[b] = c[1];
+
+            verts[v] = P3D::V3<P3D::fp>(pos[0], pos[1], pos[2]);
+        }
+
+        const P3D::Plane<P3D::fp> wall_plane = side ? P3D::Plane<P3D::fp>(back_normal, P3D::fp(-split)) : n.plane;
+
+        P3D::TriIndexList& poly_list = side ? n.back_polys : n.front_polys;
+        poly_list.offset = polys.size();
+        poly_list.count = 1;
+
+        P3D::BspModelPolygon poly;
+        poly.vertex_count = 4;
+        poly.poly_bb = P3D::AABB<P3D::fp>();
+
+        for(unsigned int v = 0; v < 4; v++)
+        {
+            poly.verts[v].pos = verts[v];
+            poly.verts[v].uv = P3D::V2<P3D::fp>(0, 0);
+            poly.poly_bb.AddPoint(verts[v]);
+        }
+
+        poly.normal_plane = wall_plane;
+        poly.u_axis = P3D::V3<P3D::fp>(0, 0, 0);
+        poly.v_axis = P3D::V3<P3D::fp>(0, 0, 0);
+        poly.texture = -1;
+        poly.color = index;
+
+        polys.push_back(poly);
+
+        n.node_bb.AddAABB(poly.poly_bb);
+
+        P3D::TriIndexList& tri_list = side ? n.back_tris : n.front_tris;
+        tri_list.offset = tris.size();
+        tri_list.count = 2;
+
+        for(unsigned int t = 0; t < 2; t++)
+        {
+            P3D::BspModelTriangle tri;
+            tri.tri.verts[0].pos = verts[0];
+            tri.tri.verts[1].pos = verts[t + 1];
+            tri.tri.verts[2].pos = verts[t + 2];
+
+            for(P3D::Vertex3d& v : tri.tri.verts)
+                v.uv = P3D::V2<P3D::fp>(0, 0);
+
+            tri.tri_bb = P3D::AABB<P3D::fp>();
+            tri.tri_bb.AddTriangle(verts[0], verts[t + 1], verts[t + 2]);
+
+            tri.normal_plane = wall_plane;
+
+            //Sorting never reads the collision edges or texture axes.
+            tri.edge_plane_0_1 = tri.edge_plane_1_2 = tri.edge_plane_2_0 = P3D::Plane<P3D::fp>(P3D::V3<P3D::fp>(0, 0, 0), 0);
+            tri.u_axis = P3D::V3<P3D::fp>(0, 0, 0);
+            tri.v_axis = P3D::V3<P3D::fp>(0, 0, 0);
+
+            tri.texture = -1;
+            tri.color = index;
+
+            tris.push_back(tri);
+        }
+    }
+
+    if(levels > 1)
+    {
+        float front_lo[3] = {lo[0], lo[1], lo[2]};
+        float back_hi[3] = {hi[0], hi[1], hi[2]};
+
+        front_lo[axis] = split;
+        back_hi[axis] = split;
+
+        //n is not safe to use from here. Adding children can move nodes.
+        const unsigned int front = AddSortBenchmarkNode(nodes, tris, polys, front_lo, hi, index, depth + 1, levels - 1);
+        const unsigned int back = AddSortBenchmarkNode(nodes, tris, polys, lo, back_hi, index, depth + 1, levels - 1);
+
+        nodes[index].front_node = front;
+        nodes[index].back_node = back;
+    }
+
+    return index;
+}
+
+//A balanced tree of (2^levels) - 1 nodes filling a cube. Laid out as a .bsp file is, so it can be used as a BspModel.
+std::vector<unsigned char> BuildSortBenchmarkModel(const unsigned int levels)
+{
+    std::vector<P3D::BspModelNode> nodes;
+    std::vector<P3D::BspModelTriangle> tris;
+    std::vector<P3D::BspModelPolygon> polys;
+
+    const float lo[3] = {-2048, -2048, -2048};
+    const float hi[3] = {2048, 2048, 2048};
+
+    AddSortBenchmarkNode(nodes, tris, polys, lo, hi, 0, 0, levels);
+
+    P3D::BspModelHeader header;
+    memset(&header, 0, sizeof(header));
+
+    header.node_count = nodes.size();
+    header.node_offset = sizeof(header);
+
+    header.triangle_count = tris.size();
+    header.triangle_offset = header.node_offset + (sizeof(P3D::BspModelNode) * nodes.size());
+
+    header.polygon_count = polys.size();
+    header.polygon_offset = header.triangle_offset + (sizeof(P3D::BspModelTriangle) * tris.size());
+
+    std::vector<unsigned char> bytes(header.polygon_offset + (sizeof(P3D::BspModelPolygon) * polys.size()));
+
+    memcpy(&bytes[0], &header, sizeof(header));
+    memcpy(&bytes[header.node_offset], nodes.data(), sizeof(P3D::BspModelNode) * nodes.size());
+    memcpy(&bytes[header.triangle_offset], tris.data(), sizeof(P3D::BspModelTriangle) * tris.size());
+    memcpy(&bytes[header.polygon_offset], polys.data(), sizeof(P3D::BspModelPolygon) * polys.size());
+
+    return bytes;
+}
+
+//Sorts a generated tree from many views with Sort(), then with SortParallel() at each split depth and thread count.
+std::vector<ParallelSortResult> RunParallelSortBenchmark(unsigned int& node_count, double& serial_view_us)
+{
+    constexpr unsigned int levels = 11;
+    constexpr unsigned int views = 64;
+
+    const unsigned int thread_counts[] = {1, 2, 4, std::thread::hardware_concurrency()};
+    const unsigned int split_depths[] = {0, 2, 4, 6};
+
+    const std::vector<unsigned char> bytes = BuildSortBenchmarkModel(levels);
+    const P3D::BspModel* model = (const P3D::BspModel*)bytes.data();
+
+    assert(model->CheckLimits());
+
+    node_count = model->header.node_count;
+
+    P3D::M4<P3D::fp> projection;
+    projection.perspective(60, (float)240 / (float)160, 10, 1500);
+
+    std::vector<SortBenchmarkView> view_list(views);
+
+    for(SortBenchmarkView& v : view_list)
+    {
+        v.eye = P3D::V3<P3D::fp>((r16() * 6) - 1536, (r16() * 6) - 1536, (r16() * 6) - 1536);
+
+        P3D::M4<P3D::fp> view;
+        view.setToIdentity();
+        view.rotateY(-(int)(rng32() % 360));
+        view.translate(P3D::V3<P3D::fp>(-v.eye.x, -v.eye.y, -v.eye.z));
+
+        (projection * view).ExtractFrustrumPlanes(v.frustrum_planes);
+
+        v.collision_box = P3D::AABB<P3D::fp>(v.eye, P3D::fp(1024));
+    }
+
+    std::vector<std::vector<const P3D::BspModelPolygon*>> serial_polys(views), parallel_polys(views);
+    std::vector<std::vector<const P3D::BspModelTriangle*>> serial_tris(views), parallel_tris(views);
+
+    P3D::BspQueryContext context(model->GetQueryCapacity());
+
+    QElapsedTimer t;
+    t.start();
+
+    for(unsigned int i = 0; i < views; i++)
+    {
+        model->Sort(view_list[i].eye, view_list[i].frustrum_planes, serial_polys[i], true, context);
+        assert(!context.Overflowed());
+
+        model->Sort(view_list[i].eye, view_list[i].collision_box, serial_tris[i], false, context);
+        assert(!context.Overflowed());
+    }
+
+    serial_view_us = t.nsecsElapsed() / 1000.0 / views;
+
+    std::vector<ParallelSortResult> results;
+
+    for(const unsigned int& threads : thread_counts)
+    {
+        //hardware_concurrency() can be one of the counts before it.
+        if(std::find(thread_counts, &threads, threads) != &threads)
+            continue;
+
+        P3D::BspSortPool pool(threads);
+
+        for(const unsigned int split_depth : split_depths)
+        {
+            t.restart();
+
+            for(unsigned int i = 0; i < views; i++)
+            {
+                model->SortParallel(view_list[i].eye, view_list[i].frustrum_planes, parallel_polys[i], true, pool, split_depth);
+                assert(!pool.Overflowed());
+
+                model->SortParallel(view_list[i].eye, view_list[i].collision_box, parallel_tris[i], false, pool, split_depth);
+                assert(!pool.Overflowed());
+            }
+
+            ParallelSortResult result;
+            result.threads = pool.GetThreadCount();
+            result.split_depth = split_depth;
+            result.view_us = t.nsecsElapsed() / 1000.0 / views;
+            result.matches = (parallel_polys == serial_polys) && (parallel_tris == serial_tris);
+
+            results.push_back(result);
+        }
+    }
+
+    return results;
+}
+#endif
+
+//Eye distance covered by one stored depth value, at a few distances from near to far.
+//Asserts that a 16 bit depth format gives the expected resolution at near and far, its finest and coarsest.
+void PrintDepthPrecision(const float z_near, const float z_far)
+{
+#ifdef DEPTH_16
+    const char* depth_format = "16 bit";
+#else
+    const char* depth_format = "fp";
+#endif
+
+    //z = z_ratio_1 + (z_ratio_2 / d). The same mapping the projection matrix gives.
+    const float zr1 = z_far / (z_far - z_near);
+    const float zr2 = (-z_far * z_near) / (z_far - z_near);
+
+    const float d_steps[] = {z_near, 100, 250, 500, 1000, z_far};
+
+    for(const float d : d_steps)
+    {
+        //What 16 fraction bits of z give. Measured in steps of 1/16 of it.
+        const float expected = (d * d) / (-zr2 * 65536);
+        const float step = expected / 16;
+
+        //Walk away from the ends of the range, so as not to hit the clamp.
+        const float dir = (d < z_far) ? step : -step;
+
+        float a = d;
+
+        while((a >= z_near) && (a <= z_far) && P3D::z_val(P3D::fp(zr1 + (zr2 / a))) == P3D::z_val(P3D::fp(zr1 + (zr2 / d))))
+            a += dir;
+
+        float b = a;
+
+        while((b >= z_near) && (b <= z_far) && P3D::z_val(P3D::fp(zr1 + (zr2 / b))) == P3D::z_val(P3D::fp(zr1 + (zr2 / a))))
+            b += dir;
+
+        const float measured = (b > a) ? (b - a) : (a - b);
+
+        printf("Depth (%s) near %d far %d: %f per step at %d (%f expected)\n", depth_format, (int)z_near, (int)z_far, measured, (int)d, expected);
+
+        //Float depth has finer steps. Otherwise the walk gets within a step or two of 1/16 of expected.
+        if constexpr(!std::is_floating_point<P3D::z_val>::value)
+        {
+            if((d == z_near) || (d == z_far))
+                assert((measured > expected * 0.875f) && (measured < expected * 1.125f));
+        }
+    }
+}
+
 int main()
 {
 #ifdef __arm__
@@ -98,12 +797,6 @@ int main()
 
     P3D::RenderDevice* render_device = new P3D::RenderDevice();
     render_device->SetRenderFlags<P3D::RenderFlags::NoFlags, P3D::PixelShaderGBA8<P3D::RenderFlags::NoFlags>>();
-    //render_device->SetRenderFlags<P3D::RenderFlags::SubdividePerspectiveMapping, P3D::PixelShaderGBA8<P3D::RenderFlags::SubdividePerspectiveMapping>>();
-    //render_device->SetRenderFlags<P3D::RenderFlags::FullPerspectiveMapping, P3D::PixelShaderGBA8<P3D::RenderFlags::FullPerspectiveMapping>>();
-    //render_device->SetRenderFlags<P3D::RenderFlags::ZTest | P3D::RenderFlags::ZWrite, P3D::PixelShaderGBA8<P3D::RenderFlags::ZTest | P3D::RenderFlags::ZWrite>>();
-    //render_device->SetRenderFlags<P3D::RenderFlags::Fog, P3D::PixelShaderGBA8<P3D::RenderFlags::Fog>>();
-    //render_device->SetRenderFlags<P3D::RenderFlags::VertexLight | P3D::RenderFlags::Fog, P3D::PixelShaderGBA8<P3D::RenderFlags::VertexLight | P3D::RenderFlags::Fog>>();
-    //render_device->SetRenderFlags<P3D::RenderFlags::VertexLight, P3D::PixelShaderGBA8<P3D::RenderFlags::VertexLight>>();
 
 
 #if 0
@@ -151,80 +844,110 @@ int main()
     render_device->BeginDraw();
     render_device->ClearColor(0);
 
+    I_FinishUpdate_e32();
 
-    P3D::V2<P3D::fp> uv[3];
-    uv[0] = P3D::V2<P3D::fp>(0,0);
-    uv[1] = P3D::V2<P3D::fp>(64,0);
-    uv[2] = P3D::V2<P3D::fp>(64,64);
-
-    unsigned int vi[3] = {2,1,0};
+    BenchmarkResult results[] =
+    {
+        RunBenchmark<P3D::RenderFlags::NoFlags>(render_device),
+        RunBenchmark<P3D::RenderFlags::SubdividePerspectiveMapping>(render_device),
+        RunBenchmark<P3D::RenderFlags::FullPerspectiveMapping>(render_device),
+        RunBenchmark<P3D::RenderFlags::ZTest | P3D::RenderFlags::ZWrite>(render_device),
+        RunBenchmark<P3D::RenderFlags::Fog>(render_device),
+        RunBenchmark<P3D::RenderFlags::VertexLight | P3D::RenderFlags::Fog>(render_device),
+        RunBenchmark<P3D::RenderFlags::VertexLight>(render_device),
+    };
+
+    const BenchmarkResult clear_fill_result = RunClearBenchmark(render_device, render_target, true);
+
+#ifdef DEPTH_EPOCH_CLEAR
+    const BenchmarkResult clear_epoch_result = RunClearBenchmark(render_device, render_target, false);
+#endif
 
 #ifndef __arm__
-    QElapsedTimer t;
-    t.start();
-#else
-    REG_TM2CNT_L= 65535-65;     // 65 ticks = 1/1000 secs
-    REG_TM2CNT_H = TM_FREQ_256 | TM_ENABLE;       // we're using the 256 cycle timer
+    //The same Z buffered fill with colour and depth rows interleaved in one buffer.
+    //The GBA has no data cache to gain from it, so it's only measured on the host.
+    P3D::RenderTarget* interleaved_target = new P3D::RenderTarget(240, 160);
+    interleaved_target->AttachInterleavedBuffers();
 
-    // cascade into tm3
-    REG_TM3CNT_H = TM_CASCADE | TM_ENABLE;
+    render_device->SetRenderTarget(interleaved_target);
+
+    const BenchmarkResult interleaved_result = RunBenchmark<P3D::RenderFlags::ZTest | P3D::RenderFlags::ZWrite>(render_device);
+
+    interleaved_target->ResolveColorBuffer(I_GetBackBuffer());
+
+    render_device->SetRenderTarget(render_target);
+
+    delete interleaved_target;
+
+    const ParallelViewportResult viewport_result = RunParallelViewportBenchmark(m);
+#endif
+
+#ifdef BSP_PARALLEL_SORT
+    unsigned int sort_node_count = 0;
+    double sort_serial_us = 0;
+    const std::vector<ParallelSortResult> sort_results = RunParallelSortBenchmark(sort_node_count, sort_serial_us);
+#endif
+
+#ifdef RENDER_STATS
+    unsigned int texture_switches = 0;
+    const BenchmarkResult texture_sort_result = RunTextureSortBenchmark(render_device, texture_switches);
 #endif
 
 #ifdef __arm__
-    const int runs = 1000;
+    consoleDemoInit();
+    const char* cost_unit = "cycles";
 #else
-    const int runs = 1000000;
+    const char* cost_unit = "ns";
 #endif
 
-    I_FinishUpdate_e32();
+    render_device->EndDraw();
 
-    unsigned int ll;
+    render_device->EndFrame();
 
-    P3D::fp lights[3] = {ll,ll,ll};
+    render_device->PopMatrix();
+    render_device->PopMatrix();
 
-    for(int i = 0; i < runs; i++)
+    for(const BenchmarkResult& r : results)
     {
-        P3D::V3<P3D::fp> v[3];
-        v[0] = P3D::V3<P3D::fp>(-100 + r8(),100+ r8(),0+ r8());
-        v[1] = P3D::V3<P3D::fp>(100+ r8(),100+ r8(),0+ r8());
-        v[2] = P3D::V3<P3D::fp>(100+ r8(),-100+ r8(),0+ r8());
+        double s = r.ms / 1000.0;
+        double p = (double)runs / s;
 
-        render_device->TransformVertexes(v, 3);
-
-        render_device->DrawTriangle(vi, uv, lights);
-
-        //P3D::fp dx = v[0].x * v[0].y;
-        //P3D::fp dy = v[0].y * v[0].z;
-
-        //P3D::fp dz = (dx/dy);
-        //P3D::fp dz = P3D::pApproxDiv(dx, dy);
-
-        //I_GetBackBuffer()[0] = dz.i();
+        printf("Flags %u: %u bytes/vertex %u bytes/edge\n", r.render_flags, r.vertex_bytes, r.edge_bytes);
+        printf("  %d polys in %f s, %d polys/s, %d %s/poly\n", runs, s, (int)p, (int)r.tri_cost, cost_unit);
     }
 
+    printf("ClearDepth (fill) + 10 polys/frame: %d %s/poly\n", (int)clear_fill_result.tri_cost, cost_unit);
 
+#ifdef DEPTH_EPOCH_CLEAR
+    printf("ClearDepth (epoch) + 10 polys/frame: %d %s/poly\n", (int)clear_epoch_result.tri_cost, cost_unit);
+#endif
 
-#ifndef __arm__
-    uint64_t x = t.elapsed();
+#ifdef RENDER_STATS
+#ifdef DEFERRED_SPANS
+    const char* span_mode = "deferred";
 #else
+    const char* span_mode = "immediate";
+#endif
 
-    uint64_t x = REG_TM3CNT_L;
-    consoleDemoInit();
-
+    printf("8 textures (%s spans): %d %s/poly, %u texture switches/frame (cache miss proxy)\n", span_mode, (int)texture_sort_result.tri_cost, cost_unit, texture_switches);
 #endif
 
-    render_device->EndDraw();
+#ifndef __arm__
+    printf("Flags %u split: %d %s/poly, interleaved: %d %s/poly\n", results[3].render_flags, (int)results[3].tri_cost, cost_unit, (int)interleaved_result.tri_cost, cost_unit);
 
-    render_device->EndFrame();
+    printf("%u viewports: serial %f ms, parallel %f ms on %u threads, %s serial output\n", viewport_result.viewports, viewport_result.serial_ms, viewport_result.parallel_ms,
+           viewport_result.threads, viewport_result.matches ? "matches" : "DOES NOT MATCH");
+#endif
 
-    render_device->PopMatrix();
-    render_device->PopMatrix();
+#ifdef BSP_PARALLEL_SORT
+    printf("BSP sort %u nodes: Sort %f us/view\n", sort_node_count, sort_serial_us);
 
-    double s = x / 1000.0;
-    double p = (double)runs / s;
+    for(const ParallelSortResult& r : sort_results)
+        printf("  SortParallel split %u on %u threads: %f us/view, %s Sort output\n", r.split_depth, r.threads, r.view_us, r.matches ? "matches" : "DOES NOT MATCH");
+#endif
 
-    printf("%d polys rendered in %f s\n", runs, s);
-    printf("Polys/second %d\n", (int)p);
+    //The largest z_far in the examples.
+    PrintDepthPrecision(10, 1500);
 
     while(true)
     {
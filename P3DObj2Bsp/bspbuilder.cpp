@@ -1,4 +1,5 @@
 #include "bspbuilder.h"
+#include "../BspModelDefs.h"
 
 namespace Obj2Bsp
 {
@@ -79,6 +80,9 @@ namespace Obj2Bsp
 
         SeperateTriangles(best_plane, triangles, front_tris, back_tris, node->front_tris, node->back_tris);
 
+        MergeTriangles(node->front_tris, node->front_polys);
+        MergeTriangles(node->back_tris, node->back_polys);
+
         for(unsigned int i = 0; i < node->front_tris.size(); i++)
         {
             node->node_bb.AddTriangle(*node->front_tris[i]->tri);
@@ -735,6 +739,124 @@ namespace Obj2Bsp
         return out;
     }
 
+    void BspBuilder::MergeTriangles(std::vector<BspTriangle*>& triangles, std::vector<BspPolygon*>& polygons)
+    {
+        for(unsigned int i = 0; i < triangles.size(); i++)
+        {
+            triangles[i]->ComputePlanes();
+            triangles[i]->ComputeTextureAxes();
+
+            BspPolygon* poly = new BspPolygon();
+
+            poly->verts.assign(std::begin(triangles[i]->tri->verts), std::end(triangles[i]->tri->verts));
+            poly->normal_plane = triangles[i]->normal_plane;
+            poly->u_axis = triangles[i]->u_axis;
+            poly->v_axis = triangles[i]->v_axis;
+            poly->texture = triangles[i]->texture;
+            poly->color = triangles[i]->color;
+
+            polygons.push_back(poly);
+        }
+
+        //Keep joining pairs across a shared edge until no pair gives a small enough convex polygon.
+        bool merged = true;
+
+        while(merged)
+        {
+            merged = false;
+
+            for(unsigned int i = 0; i < polygons.size(); i++)
+            {
+                for(unsigned int j = i + 1; j < polygons.size(); j++)
+                {
+                    BspPolygon joined;
+
+                    if(!MergePolygons(*polygons[i], *polygons[j], joined))
+                        continue;
+
+                    *polygons[i] = joined;
+
+                    delete polygons[j];
+                    polygons.erase(polygons.begin() + j);
+
+                    merged = true;
+                    j = i;
+                }
+            }
+        }
+
+        qDebug() << "Merged" << triangles.size() << "triangles into" << polygons.size() << "polygons";
+    }
+
+    bool BspBuilder::MergePolygons(const BspPolygon& a, const BspPolygon& b, BspPolygon& out)
+    {
+        if((a.texture != b.texture) || (a.color != b.color))
+            return false;
+
+        //A seam in the texture mapping can't be drawn with one set of gradients.
+        if(a.texture && (!SameAxis(a.u_axis, b.u_axis) || !SameAxis(a.v_axis, b.v_axis)))
+            return false;
+
+        const unsigned int na = a.verts.size();
+        const unsigned int nb = b.verts.size();
+
+        if((na + nb - 2) > P3D::BSP_POLYGON_MAX_VERTS)
+            return false;
+
+        for(unsigned int i = 0; i < na; i++)
+        {
+            for(unsigned int j = 0; j < nb; j++)
+            {
+                //Both wind the same way so a shared edge runs in opposite directions.
+                if(!SameVertex(a.verts[i], b.verts[(j + 1) % nb]) || !SameVertex(a.verts[(i + 1) % na], b.verts[j]))
+                    continue;
+
+                out = a;
+                out.verts.clear();
+
+                //All of a starting after the shared edge, then the rest of b.
+                for(unsigned int k = 0; k < na; k++)
+                    out.verts.push_back(a.verts[(i + 1 + k) % na]);
+
+                for(unsigned int k = 2; k < nb; k++)
+                    out.verts.push_back(b.verts[(j + k) % nb]);
+
+                return IsConvex(out);
+            }
+        }
+
+        return false;
+    }
+
+    bool BspBuilder::IsConvex(const BspPolygon& polygon)
+    {
+        const unsigned int n = polygon.verts.size();
+
+        for(unsigned int i = 0; i < n; i++)
+        {
+            const QVector3D e1 = polygon.verts[(i + 1) % n].pos - polygon.verts[i].pos;
+            const QVector3D e2 = polygon.verts[(i + 2) % n].pos - polygon.verts[(i + 1) % n].pos;
+
+            //Every turn must go the same way as the triangles did. Colinear verts are allowed.
+            const float turn = QVector3D::dotProduct(QVector3D::crossProduct(e1, e2), polygon.normal_plane.normal);
+
+            if(turn > (merge_epsilon * e1.length() * e2.length()))
+                return false;
+        }
+
+        return true;
+    }
+
+    bool BspBuilder::SameVertex(const Vertex3d& a, const Vertex3d& b)
+    {
+        return ((a.pos - b.pos).length() < merge_epsilon) && ((a.uv - b.uv).length() < merge_epsilon);
+    }
+
+    bool BspBuilder::SameAxis(const QVector3D& a, const QVector3D& b)
+    {
+        return (a - b).length() < (merge_epsilon * std::max(1.0f, a.length()));
+    }
+
     BspPlane BspBuilder::CalculatePlane(const Triangle3d* triangle)
     {
         QVector3D normal = QVector3D::normal(triangle->verts[0].pos, triangle->verts[1].pos, triangle->verts[2].pos);
@@ -134,6 +134,8 @@ namespace Obj2Bsp
         BspPlane edge_plane_01;
         BspPlane edge_plane_12;
         BspPlane edge_plane_20;
+        QVector3D u_axis;
+        QVector3D v_axis;
         const Texture* texture;
         P3D::pixel color;
 
@@ -161,6 +163,41 @@ namespace Obj2Bsp
             edge_plane_20.normal = QVector3D::crossProduct(side20, normal_plane.normal).normalized();
             edge_plane_20.distance = -QVector3D::dotProduct(edge_plane_20.normal, tri->verts[2].pos);
         }
+
+        void ComputeTextureAxes()
+        {
+            //Solve for the in-plane vectors that move +1 texel in u and in v.
+            //side01 = u_axis * duv01.x + v_axis * duv01.y (and the same for side02)
+            QVector3D side01 = tri->verts[1].pos - tri->verts[0].pos;
+            QVector3D side02 = tri->verts[2].pos - tri->verts[0].pos;
+
+            QVector2D duv01 = tri->verts[1].uv - tri->verts[0].uv;
+            QVector2D duv02 = tri->verts[2].uv - tri->verts[0].uv;
+
+            float det = (duv01.x() * duv02.y()) - (duv02.x() * duv01.y());
+
+            //Degenerate mapping. The renderer falls back to per vertex gradients.
+            if(std::abs(det) < 0.0001f)
+            {
+                u_axis = v_axis = QVector3D();
+                return;
+            }
+
+            u_axis = ((side01 * duv02.y()) - (side02 * duv01.y())) / det;
+            v_axis = ((side02 * duv01.x()) - (side01 * duv02.x())) / det;
+        }
+    };
+
+    //Convex outline of coplanar triangles that share a material and texture mapping.
+    class BspPolygon
+    {
+    public:
+        std::vector<Vertex3d> verts;
+        BspPlane normal_plane;
+        QVector3D u_axis;
+        QVector3D v_axis;
+        const Texture* texture;
+        P3D::pixel color;
     };
 
     class BspNode
@@ -169,6 +206,8 @@ namespace Obj2Bsp
         BspPlane plane; //Plane that this node splits on.
         std::vector<BspTriangle*> back_tris; //Back facing triangles that lie on this plane.
         std::vector<BspTriangle*> front_tris; //Triangles that lie on this plane.
+        std::vector<BspPolygon*> back_polys; //back_tris merged for drawing.
+        std::vector<BspPolygon*> front_polys; //front_tris merged for drawing.
         BspNode* parent = nullptr; //Parent node.
         BspNode* front = nullptr; //Front children.
         BspNode* back = nullptr; //Back children.
@@ -192,7 +231,14 @@ namespace Obj2Bsp
         float Relation(float a, float b);
         Vertex3d LerpVertex(Vertex3d& out, const Vertex3d& vx1, const Vertex3d& vx2, float frac);
 
+        void MergeTriangles(std::vector<BspTriangle*>& triangles, std::vector<BspPolygon*>& polygons);
+        bool MergePolygons(const BspPolygon& a, const BspPolygon& b, BspPolygon& out);
+        bool IsConvex(const BspPolygon& polygon);
+        bool SameVertex(const Vertex3d& a, const Vertex3d& b);
+        bool SameAxis(const QVector3D& a, const QVector3D& b);
+
         static constexpr float epsilon = 0.25f;
+        static constexpr float merge_epsilon = 0.001f;
     };
 
 }
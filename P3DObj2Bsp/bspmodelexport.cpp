@@ -10,6 +10,12 @@ namespace Obj2Bsp
 
         TraverseNodesRecursive(root, nodeList);
 
+        if(nodeList.length() > (int)P3D::BSP_MAX_NODES)
+        {
+            qDebug() << "Too many BSP nodes:" << nodeList.length() << "max" << P3D::BSP_MAX_NODES;
+            return QByteArray();
+        }
+
         QByteArray bytes;
         QBuffer buffer(&bytes);
         buffer.open(QIODevice::WriteOnly);
@@ -20,6 +26,7 @@ namespace Obj2Bsp
         QList<P3D::BspModelNode> modelNodeList;
         QList<P3D::BspNodeTexture> modelTextureList;
         QList<P3D::BspModelTriangle> modelTriList;
+        QList<P3D::BspModelPolygon> modelPolyList;
 
 
         QByteArray texturePixels;
@@ -36,6 +43,14 @@ namespace Obj2Bsp
                       std::end(nodeList[i]->back_tris),
                       [](const Obj2Bsp::BspTriangle* a, const Obj2Bsp::BspTriangle* b) -> bool {return a->texture > b->texture; });
 
+            std::sort(std::begin(nodeList[i]->front_polys),
+                      std::end(nodeList[i]->front_polys),
+                      [](const Obj2Bsp::BspPolygon* a, const Obj2Bsp::BspPolygon* b) -> bool {return a->texture > b->texture; });
+
+            std::sort(std::begin(nodeList[i]->back_polys),
+                      std::end(nodeList[i]->back_polys),
+                      [](const Obj2Bsp::BspPolygon* a, const Obj2Bsp::BspPolygon* b) -> bool {return a->texture > b->texture; });
+
 
 
             P3D::BspModelNode bn;
@@ -59,6 +74,7 @@ namespace Obj2Bsp
                 P3D::BspModelTriangle bmt;
 
                 nodeList[i]->front_tris[j]->ComputePlanes();
+                nodeList[i]->front_tris[j]->ComputeTextureAxes();
 
                 for(int v = 0; v < 3; v++)
                 {
@@ -95,6 +111,14 @@ namespace Obj2Bsp
 
                 bmt.tri_bb.AddTriangle(bmt.tri.verts[0].pos, bmt.tri.verts[1].pos, bmt.tri.verts[2].pos);
 
+                bmt.u_axis = P3D::V3<P3D::fp>(  nodeList[i]->front_tris[j]->u_axis.x(),
+                                                nodeList[i]->front_tris[j]->u_axis.y(),
+                                                nodeList[i]->front_tris[j]->u_axis.z());
+
+                bmt.v_axis = P3D::V3<P3D::fp>(  nodeList[i]->front_tris[j]->v_axis.x(),
+                                                nodeList[i]->front_tris[j]->v_axis.y(),
+                                                nodeList[i]->front_tris[j]->v_axis.z());
+
                 const Texture* tex = nodeList[i]->front_tris[j]->texture;
 
                 if(tex)
@@ -113,6 +137,14 @@ namespace Obj2Bsp
 
                         texturePixels.append(nodeList[i]->front_tris[j]->texture->pixels);
 
+                        bnt.alpha_skip_offset = 0;
+
+                        if(bnt.alpha)
+                        {
+                            bnt.alpha_skip_offset = texturePixels.length() / sizeof(P3D::pixel);
+                            texturePixels.append(BuildAlphaSkipTable(nodeList[i]->front_tris[j]->texture->pixels));
+                        }
+
                         bmt.texture = modelTextureList.length();
 
                         modelTextureList.append(bnt);
@@ -133,6 +165,7 @@ namespace Obj2Bsp
                 P3D::BspModelTriangle bmt;
 
                 nodeList[i]->back_tris[j]->ComputePlanes();
+                nodeList[i]->back_tris[j]->ComputeTextureAxes();
 
                 for(int v = 0; v < 3; v++)
                 {
@@ -169,6 +202,14 @@ namespace Obj2Bsp
 
                 bmt.tri_bb.AddTriangle(bmt.tri.verts[0].pos, bmt.tri.verts[1].pos, bmt.tri.verts[2].pos);
 
+                bmt.u_axis = P3D::V3<P3D::fp>(  nodeList[i]->back_tris[j]->u_axis.x(),
+                                                nodeList[i]->back_tris[j]->u_axis.y(),
+                                                nodeList[i]->back_tris[j]->u_axis.z());
+
+                bmt.v_axis = P3D::V3<P3D::fp>(  nodeList[i]->back_tris[j]->v_axis.x(),
+                                                nodeList[i]->back_tris[j]->v_axis.y(),
+                                                nodeList[i]->back_tris[j]->v_axis.z());
+
                 const Texture* tex = nodeList[i]->back_tris[j]->texture;
 
                 if(tex)
@@ -187,6 +228,14 @@ namespace Obj2Bsp
 
                         texturePixels.append(nodeList[i]->back_tris[j]->texture->pixels);
 
+                        bnt.alpha_skip_offset = 0;
+
+                        if(bnt.alpha)
+                        {
+                            bnt.alpha_skip_offset = texturePixels.length() / sizeof(P3D::pixel);
+                            texturePixels.append(BuildAlphaSkipTable(nodeList[i]->back_tris[j]->texture->pixels));
+                        }
+
                         bmt.texture = modelTextureList.length();
 
                         modelTextureList.append(bnt);
@@ -197,7 +246,22 @@ namespace Obj2Bsp
                 modelTriList.append(bmt);
             }
 
+            //Polygons reuse the textures their triangles added above.
+            bn.front_polys.count = nodeList[i]->front_polys.size() & 0xffff;
+            bn.front_polys.offset = modelPolyList.length();
 
+            for(unsigned int j = 0; j < nodeList[i]->front_polys.size(); j++)
+            {
+                modelPolyList.append(ExportPolygon(nodeList[i]->front_polys[j], textureList));
+            }
+
+            bn.back_polys.count = nodeList[i]->back_polys.size() & 0xffff;
+            bn.back_polys.offset = modelPolyList.length();
+
+            for(unsigned int j = 0; j < nodeList[i]->back_polys.size(); j++)
+            {
+                modelPolyList.append(ExportPolygon(nodeList[i]->back_polys[j], textureList));
+            }
 
             bn.front_node = 0;
             bn.back_node = 0;
@@ -241,6 +305,14 @@ namespace Obj2Bsp
             buffer.write((const char*)&modelTriList[i], sizeof(modelTriList[i]));
         }
 
+        bmh.polygon_count = modelPolyList.length();
+        bmh.polygon_offset = buffer.pos();
+
+        for(int i = 0; i < modelPolyList.length(); i++)
+        {
+            buffer.write((const char*)&modelPolyList[i], sizeof(modelPolyList[i]));
+        }
+
         bmh.texture_count = modelTextureList.length();
         bmh.texture_offset = buffer.pos();
 
@@ -266,6 +338,88 @@ namespace Obj2Bsp
         return bytes;
     }
 
+    P3D::BspModelPolygon BspModelExport::ExportPolygon(const BspPolygon* poly, const QList<const Texture*>& textureList)
+    {
+        P3D::BspModelPolygon bmp;
+
+        bmp.vertex_count = poly->verts.size();
+
+        for(unsigned int v = 0; v < bmp.vertex_count; v++)
+        {
+            bmp.verts[v].pos.x = poly->verts[v].pos.x();
+            bmp.verts[v].pos.y = poly->verts[v].pos.y();
+            bmp.verts[v].pos.z = poly->verts[v].pos.z();
+            bmp.verts[v].uv.x = poly->verts[v].uv.x();
+            bmp.verts[v].uv.y = poly->verts[v].uv.y();
+            bmp.verts[v].vertex_id = poly->verts[v].vertex_id;
+
+            bmp.poly_bb.AddPoint(bmp.verts[v].pos);
+        }
+
+        P3D::V3<P3D::fp> normal = P3D::V3<P3D::fp>(poly->normal_plane.normal.x(),
+                                                   poly->normal_plane.normal.y(),
+                                                   poly->normal_plane.normal.z());
+        bmp.normal_plane = P3D::Plane<P3D::fp>(normal, poly->normal_plane.distance);
+
+        bmp.u_axis = P3D::V3<P3D::fp>(poly->u_axis.x(), poly->u_axis.y(), poly->u_axis.z());
+        bmp.v_axis = P3D::V3<P3D::fp>(poly->v_axis.x(), poly->v_axis.y(), poly->v_axis.z());
+
+        bmp.color = poly->color;
+        bmp.texture = poly->texture ? textureList.indexOf(poly->texture) : -1;
+
+        return bmp;
+    }
+
+    //For each texel, how many texels away in u or v (wrapping) the nearest opaque texel is.
+    //0 if the texel is opaque. Texels of value 0 are transparent.
+    QByteArray BspModelExport::BuildAlphaSkipTable(const QByteArray& pixels)
+    {
+        const P3D::pixel* texels = (const P3D::pixel*)pixels.constData();
+
+        QByteArray skip(TEX_SIZE * TEX_SIZE, (char)255);
+        QVector<int> queue;
+
+        for(int i = 0; i < TEX_SIZE * TEX_SIZE; i++)
+        {
+            if(texels[i] != 0)
+            {
+                skip[i] = 0;
+                queue.append(i);
+            }
+        }
+
+        //Breadth first out from the opaque texels. Diagonal steps count as one, so the distance is max(|du|, |dv|).
+        for(int q = 0; q < queue.size(); q++)
+        {
+            const int x = queue[q] % TEX_SIZE;
+            const int y = queue[q] / TEX_SIZE;
+            const int d = (unsigned char)skip[queue[q]] + 1;
+
+            if(d > 255)
+                continue;
+
+            for(int dy = -1; dy <= 1; dy++)
+            {
+                for(int dx = -1; dx <= 1; dx++)
+                {
+                    const int n = (((y + dy) & (TEX_SIZE - 1)) * TEX_SIZE) + ((x + dx) & (TEX_SIZE - 1));
+
+                    if((unsigned char)skip[n] > d)
+                    {
+                        skip[n] = (char)d;
+                        queue.append(n);
+                    }
+                }
+            }
+        }
+
+        //Padded to whole pixels so following textures stay aligned.
+        while(skip.length() % sizeof(P3D::pixel))
+            skip.append((char)255);
+
+        return skip;
+    }
+
     void BspModelExport::TraverseNodesRecursive(BspNode* n, QList<BspNode*>& nodeList)
     {
         if (!n) return;
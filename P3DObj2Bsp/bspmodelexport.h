@@ -20,6 +20,8 @@ namespace Obj2Bsp
 
     private:
         void TraverseNodesRecursive(BspNode* n, QList<BspNode*>& nodeList);
+        P3D::BspModelPolygon ExportPolygon(const BspPolygon* poly, const QList<const Texture*>& textureList);
+        QByteArray BuildAlphaSkipTable(const QByteArray& pixels);
 
     };
 
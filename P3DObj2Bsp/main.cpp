@@ -38,6 +38,9 @@ int main(int argc, char *argv[])
 
     QByteArray bspData = bspExport.ExportBSPModel(root, loader.GetModel());
 
+    if(bspData.isEmpty())
+        return 0;
+
     QDir workDir = QDir(QFileInfo(objPath).absolutePath());
     QString baseName = QFileInfo(objPath).fileName().chopped(3);
 
@@ -12,7 +12,8 @@ namespace P3D
     {
         public:
 
-        static void DrawScanlinePixelPair(pixel* fb, z_val *zb, const z_val zv1, const z_val zv2, const pixel* texels, const fp u1, const fp v1, const fp u2, const fp v2, const fp f1, const fp f2, const fp l1, const fp l2, const pixel fog_color, const unsigned char* fog_light_map = nullptr)
+        //With fog_light_row set fog_light_map is the remap row of one fog and light level. This shader doesn't make rows.
+        template<bool fog_light_row = false> static void DrawScanlinePixelPair(pixel* fb, z_val *zb, const z_val zv1, const z_val zv2, const pixel* texels, const fp u1, const fp v1, const fp u2, const fp v2, const fp f1, const fp f2, const fp l1, const fp l2, const pixel fog_color, const unsigned char* fog_light_map = nullptr)
         {
             if constexpr (render_flags & ZTest)
             {
@@ -22,24 +23,19 @@ namespace P3D
                         return; //Both Z Reject.
 
                     //Accept right.
-                    DrawScanlinePixel(fb+1, zb+1, zv2, texels, u2, v2, f2, l2, fog_color, fog_light_map);
+                    DrawScanlinePixel<fog_light_row>(fb+1, zb+1, zv2, texels, u2, v2, f2, l2, fog_color, fog_light_map);
                     return;
                 }
                 else //Accept left.
                 {
                     if(zv2 >= zb[1]) //Reject right?
                     {
-                        DrawScanlinePixel(fb, zb, zv1, texels, u1, v1, f1, l1, fog_color, fog_light_map);
+                        DrawScanlinePixel<fog_light_row>(fb, zb, zv1, texels, u1, v1, f1, l1, fog_color, fog_light_map);
                         return;
                     }
                 }
             }
 
-            if constexpr (render_flags & ZWrite)
-            {
-                zb[0] = zv1, zb[1] = zv2;
-            }
-
             const unsigned int tx = (unsigned int)u1 & TEX_MASK;
             const unsigned int ty = ((unsigned int)v1 & TEX_MASK) << TEX_SHIFT;
 
@@ -48,16 +44,35 @@ namespace P3D
 
             pixel p1 = texels[(ty + tx)], p2 = texels[(ty2 + tx2)];
 
+            if constexpr (render_flags & AlphaTest)
+            {
+                if((p1 == 0) || (p2 == 0))
+                {
+                    if(p1 != 0)
+                        DrawScanlinePixel<fog_light_row>(fb, zb, zv1, texels, u1, v1, f1, l1, fog_color, fog_light_map);
+
+                    if(p2 != 0)
+                        DrawScanlinePixel<fog_light_row>(fb+1, zb+1, zv2, texels, u2, v2, f2, l2, fog_color, fog_light_map);
+
+                    return;
+                }
+            }
+
+            if constexpr (render_flags & ZWrite)
+            {
+                zb[0] = zv1, zb[1] = zv2;
+            }
+
             if constexpr(render_flags & (Fog | VertexLight))
             {
-                p1 = FogLightPixel(p1, f1, l1, fog_color, fog_light_map);
-                p2 = FogLightPixel(p2, f2, l2, fog_color, fog_light_map);
+                p1 = FogLightPixel<fog_light_row>(p1, f1, l1, fog_color, fog_light_map);
+                p2 = FogLightPixel<fog_light_row>(p2, f2, l2, fog_color, fog_light_map);
             }
 
             *(pixel_pair*)fb = ( (p1) | ((pixel_pair)p2 << (sizeof(pixel)*8)) );
         }
 
-        static void DrawScanlinePixel(pixel *fb, z_val *zb, const z_val zv, const pixel* texels, const fp u, const fp v, const fp f, const fp l, const pixel fog_color, const unsigned char* fog_light_map = nullptr)
+        template<bool fog_light_row = false> static void DrawScanlinePixel(pixel *fb, z_val *zb, const z_val zv, const pixel* texels, const fp u, const fp v, const fp f, const fp l, const pixel fog_color, const unsigned char* fog_light_map = nullptr)
         {
             if constexpr (render_flags & ZTest)
             {
@@ -65,32 +80,38 @@ namespace P3D
                     return;
             }
 
-            if constexpr (render_flags & ZWrite)
-            {
-                *zb = zv;
-            }
-
             const unsigned int tx = (int)u & TEX_MASK;
             const unsigned int ty = ((int)v & TEX_MASK) << TEX_SHIFT;
 
             pixel p1 = texels[(ty + tx)];
 
+            if constexpr (render_flags & AlphaTest)
+            {
+                if(p1 == 0)
+                    return;
+            }
+
+            if constexpr (render_flags & ZWrite)
+            {
+                *zb = zv;
+            }
+
             if constexpr(render_flags & (Fog | VertexLight))
             {
-                p1 = FogLightPixel(p1, f, l, fog_color, fog_light_map);
+                p1 = FogLightPixel<fog_light_row>(p1, f, l, fog_color, fog_light_map);
             }
 
             *fb = p1;
         }
 
-        static void DrawScanlinePixelHigh(pixel *fb, z_val *zb, const z_val zv, const pixel* texels, const fp u, const fp v, const fp f, const fp l, const pixel fog_color, const unsigned char* fog_light_map = nullptr)
+        template<bool fog_light_row = false> static void DrawScanlinePixelHigh(pixel *fb, z_val *zb, const z_val zv, const pixel* texels, const fp u, const fp v, const fp f, const fp l, const pixel fog_color, const unsigned char* fog_light_map = nullptr)
         {
-            DrawScanlinePixel(fb, zb, zv, texels, u, v, f, l, fog_color, fog_light_map);
+            DrawScanlinePixel<fog_light_row>(fb, zb, zv, texels, u, v, f, l, fog_color, fog_light_map);
         }
 
-        static void DrawScanlinePixelLow(pixel *fb, z_val *zb, const z_val zv, const pixel* texels, const fp u, const fp v, const fp f, const fp l, const pixel fog_color, const unsigned char* fog_light_map = nullptr)
+        template<bool fog_light_row = false> static void DrawScanlinePixelLow(pixel *fb, z_val *zb, const z_val zv, const pixel* texels, const fp u, const fp v, const fp f, const fp l, const pixel fog_color, const unsigned char* fog_light_map = nullptr)
         {
-            DrawScanlinePixel(fb, zb, zv, texels, u, v, f, l, fog_color, fog_light_map);
+            DrawScanlinePixel<fog_light_row>(fb, zb, zv, texels, u, v, f, l, fog_color, fog_light_map);
         }
 
 
@@ -120,9 +141,13 @@ namespace P3D
             }
         }
 
-        static constexpr pixel FogLightPixel(pixel src_color, fp fog_frac, fp light_frac, pixel fog_color, const unsigned char* fog_light_map)
+        template<bool fog_light_row = false> static constexpr pixel FogLightPixel(pixel src_color, fp fog_frac, fp light_frac, pixel fog_color, const unsigned char* fog_light_map)
         {
-            if constexpr(sizeof(pixel) == 1)
+            if constexpr(fog_light_row)
+            {
+                return fog_light_map[src_color];
+            }
+            else if constexpr(sizeof(pixel) == 1)
             {
                 //(color×16×16)+(light×16)+fog
 
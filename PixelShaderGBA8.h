@@ -9,7 +9,8 @@ namespace P3D
     {
         public:
 
-        static void DrawScanlinePixelPair(pixel* fb, z_val *zb, const z_val zv1, const z_val zv2, const pixel* texels, const fp u1, const fp v1, const fp u2, const fp v2, const fp f1, const fp f2, const fp l1, const fp l2, const pixel fog_color, const unsigned char* fog_light_map = nullptr)
+        //With fog_light_row set fog_light_map is the 256 byte remap row of one fog and light level. f and l are ignored.
+        template<bool fog_light_row = false> static void DrawScanlinePixelPair(pixel* fb, z_val *zb, const z_val zv1, const z_val zv2, const pixel* texels, const fp u1, const fp v1, const fp u2, const fp v2, const fp f1, const fp f2, const fp l1, const fp l2, const pixel fog_color, const unsigned char* fog_light_map = nullptr)
         {
             if constexpr (render_flags & ZTest)
             {
@@ -19,14 +20,14 @@ namespace P3D
                         return; //Both Z Reject.
 
                     //Accept right.
-                    DrawScanlinePixelHigh(fb+1, zb+1, zv2, texels, u2, v2, f2, l2, fog_color);
+                    DrawScanlinePixelHigh<fog_light_row>(fb+1, zb+1, zv2, texels, u2, v2, f2, l2, fog_color, fog_light_map);
                     return;
                 }
                 else //Accept left.
                 {
                     if(zv2 >= zb[1]) //Reject right?
                     {
-                        DrawScanlinePixelLow(fb, zb, zv1, texels, u1, v1, f1, l1, fog_color);
+                        DrawScanlinePixelLow<fog_light_row>(fb, zb, zv1, texels, u1, v1, f1, l1, fog_color, fog_light_map);
                         return;
                     }
                 }
@@ -40,10 +41,27 @@ namespace P3D
 
             pixel p1 = texels[(ty + tx)], p2 = texels[(ty2 + tx2)];
 
+            if constexpr (render_flags & AlphaTest)
+            {
+                if(p1 == 0)
+                {
+                    if(p2 != 0)
+                        DrawScanlinePixelHigh<fog_light_row>(fb+1, zb+1, zv2, texels, u2, v2, f2, l2, fog_color, fog_light_map);
+
+                    return;
+                }
+
+                if(p2 == 0)
+                {
+                    DrawScanlinePixelLow<fog_light_row>(fb, zb, zv1, texels, u1, v1, f1, l1, fog_color, fog_light_map);
+                    return;
+                }
+            }
+
             if constexpr(render_flags & (Fog | VertexLight))
             {
-                p1 = FogLightPixel(p1, f1, l1, fog_light_map);
-                p2 = FogLightPixel(p2, f2, l2, fog_light_map);
+                p1 = FogLightPixel<fog_light_row>(p1, f1, l1, fog_light_map);
+                p2 = FogLightPixel<fog_light_row>(p2, f2, l2, fog_light_map);
             }
 
             *(unsigned short*)fb = (p1 | (p2 << 8));
@@ -54,7 +72,7 @@ namespace P3D
             }
         }
 
-        static void DrawScanlinePixelHigh(pixel *fb, z_val *zb, const z_val zv, const pixel* texels, const fp u, const fp v, const fp f, const fp l, const pixel, const unsigned char* fog_light_map = nullptr)
+        template<bool fog_light_row = false> static void DrawScanlinePixelHigh(pixel *fb, z_val *zb, const z_val zv, const pixel* texels, const fp u, const fp v, const fp f, const fp l, const pixel, const unsigned char* fog_light_map = nullptr)
         {
             if constexpr (render_flags & ZTest)
             {
@@ -62,19 +80,25 @@ namespace P3D
                     return;
             }
 
-            if constexpr (render_flags & ZWrite)
-            {
-                *zb = zv;
-            }
-
             const unsigned int tx = (int)u & TEX_MASK;
             const unsigned int ty = ((int)v & TEX_MASK) << TEX_SHIFT;
 
             pixel p1 = texels[(ty + tx)];
 
+            if constexpr (render_flags & AlphaTest)
+            {
+                if(p1 == 0)
+                    return;
+            }
+
+            if constexpr (render_flags & ZWrite)
+            {
+                *zb = zv;
+            }
+
             if constexpr(render_flags & (Fog | VertexLight))
             {
-                p1 = FogLightPixel(p1, f, l, fog_light_map);
+                p1 = FogLightPixel<fog_light_row>(p1, f, l, fog_light_map);
             }
 
             unsigned short* p16 = (unsigned short*)(fb-1);
@@ -85,7 +109,7 @@ namespace P3D
             *p16 = texel;
         }
 
-        static void DrawScanlinePixelLow(pixel *fb, z_val *zb, const z_val zv, const pixel* texels, const fp u, const fp v, const fp f, const fp l, const pixel, const unsigned char* fog_light_map = nullptr)
+        template<bool fog_light_row = false> static void DrawScanlinePixelLow(pixel *fb, z_val *zb, const z_val zv, const pixel* texels, const fp u, const fp v, const fp f, const fp l, const pixel, const unsigned char* fog_light_map = nullptr)
         {
             if constexpr (render_flags & ZTest)
             {
@@ -93,19 +117,25 @@ namespace P3D
                     return;
             }
 
-            if constexpr (render_flags & ZWrite)
-            {
-                *zb = zv;
-            }
-
             const unsigned int tx = (int)u & TEX_MASK;
             const unsigned int ty = ((int)v & TEX_MASK) << TEX_SHIFT;
 
             pixel p1 = texels[(ty + tx)];
 
+            if constexpr (render_flags & AlphaTest)
+            {
+                if(p1 == 0)
+                    return;
+            }
+
+            if constexpr (render_flags & ZWrite)
+            {
+                *zb = zv;
+            }
+
             if constexpr(render_flags & (Fog | VertexLight))
             {
-                p1 = FogLightPixel(p1, f, l, fog_light_map);
+                p1 = FogLightPixel<fog_light_row>(p1, f, l, fog_light_map);
             }
 
             unsigned short* p16 = (unsigned short*)(fb);
@@ -116,7 +146,16 @@ namespace P3D
             *p16 = texel;
         }
 
-        static constexpr pixel FogLightPixel(pixel src_color, fp fog_frac, fp light_frac, const unsigned char* fog_light_map)
+        template<bool fog_light_row = false> static constexpr pixel FogLightPixel(pixel src_color, fp fog_frac, fp light_frac, const unsigned char* fog_light_map)
+        {
+            if constexpr(fog_light_row)
+                return fog_light_map[src_color];
+            else
+                return FogLightRow(fog_frac, light_frac, fog_light_map)[src_color];
+        }
+
+        //The 256 byte remap row for the fog and light level fog_frac and light_frac fall in.
+        static constexpr const unsigned char* FogLightRow(fp fog_frac, fp light_frac, const unsigned char* fog_light_map)
         {
             unsigned int light = 0, fog = 0;
 
@@ -130,9 +169,7 @@ namespace P3D
                 fog = pASL(pClamp(fp(0), fog_frac, FOG_MAX), FOG_SHIFT);
             }
 
-            const unsigned int texel = src_color;
-
-            return fog_light_map[FogLightIndex(texel, fog, light)];
+            return &fog_light_map[FogLightIndex(0, fog, light)];
         }
 
         static constexpr unsigned int FogLightIndex(const unsigned int color, const unsigned int fog, const unsigned int light)
@@ -48,6 +48,7 @@ HEADERS += \
     ../RenderTriangle.h \
     ../TextureCache.h \
     ../Pixel.h \
+    ../Depth.h \
     ../bspmodel.h \
     ../object3d.h \
     ../potato3d.h \
@@ -205,6 +205,7 @@ void MainWindow2::paintEvent(QPaintEvent *event)
     p.drawText(32,128, QString("Spans checked: %1").arg(rs.span_checks));
     p.drawText(32,144, QString("Spans generated: %1").arg(rs.span_count));
     p.drawText(32,160, QString("Triangles clipped: %1").arg(rs.triangles_clipped));
+    p.drawText(32,176, QString("Pixels per reciprocal: %1").arg(rs.PixelsPerReciprocal()));
 
 
     this->update();
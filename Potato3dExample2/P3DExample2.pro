@@ -29,7 +29,8 @@ HEADERS += \
     include/setup.h \
     include/videosystem.h \
     include/worldmodel.h \
-    include/collision.h
+    include/collision.h \
+    include/framequeue.h
 
 
     # Default rules for deployment.
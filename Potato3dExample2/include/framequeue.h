@@ -0,0 +1,90 @@
+#ifndef FRAMEQUEUE_H
+#define FRAMEQUEUE_H
+
+#include <atomic>
+
+//Bounded lock free queue between exactly one producer thread and one consumer thread.
+//Items live in the queue and are filled and read in place so nothing is copied or allocated per frame.
+//The consumer can sleep until there is an item, or until the queue is closed. The producer never waits.
+template<class T, unsigned int size> class FrameQueue
+{
+public:
+    //Producer. Returns the next free item to fill, or nullptr if the queue is full.
+    T* BeginPush()
+    {
+        const unsigned int t = tail.load(std::memory_order_relaxed);
+
+        if(t - head.load(std::memory_order_acquire) == size)
+            return nullptr;
+
+        return &items[t % size];
+    }
+
+    //Producer. Hands the item from BeginPush() to the consumer.
+    void EndPush()
+    {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+
+        pushes.fetch_add(1, std::memory_order_release);
+        pushes.notify_one();
+    }
+
+    //Consumer. Returns the oldest item, or nullptr if the queue is empty.
+    T* Front()
+    {
+        const unsigned int h = head.load(std::memory_order_relaxed);
+
+        if(h == tail.load(std::memory_order_acquire))
+            return nullptr;
+
+        return &items[h % size];
+    }
+
+    //Consumer. As Front(), but sleeps until there is an item. Returns nullptr once the queue is closed.
+    T* WaitFront()
+    {
+        while(true)
+        {
+            //Read before checking, so a push or close in between changes it and the wait returns at once.
+            const unsigned int p = pushes.load(std::memory_order_acquire);
+
+            if(closed.load(std::memory_order_acquire))
+                return nullptr;
+
+            if(T* item = Front())
+                return item;
+
+            pushes.wait(p, std::memory_order_acquire);
+        }
+    }
+
+    //Either thread. Wakes the consumer and makes every WaitFront() after return nullptr.
+    void Close()
+    {
+        closed.store(true, std::memory_order_release);
+
+        pushes.fetch_add(1, std::memory_order_release);
+        pushes.notify_one();
+    }
+
+    //Consumer. Hands the item from Front() back to the producer.
+    void Pop()
+    {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+private:
+    static_assert((size & (size - 1)) == 0, "FrameQueue size must be a power of 2.");
+
+    T items[size];
+
+    //Free running counts. Kept apart so the two threads don't share a cache line.
+    alignas(64) std::atomic<unsigned int> head = 0;
+    alignas(64) std::atomic<unsigned int> tail = 0;
+
+    //Counts pushes and closes for WaitFront() to sleep on.
+    std::atomic<unsigned int> pushes = 0;
+    std::atomic<bool> closed = false;
+};
+
+#endif // FRAMEQUEUE_H
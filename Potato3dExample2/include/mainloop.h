@@ -13,6 +13,30 @@
 #include "../include/worldmodel.h"
 #include "../include/collision.h"
 
+#if !defined(GBA) && defined(SETUP_BATCH)
+    //Sort and set up frame N+1 on the main thread while frame N is rasterised on a second thread.
+    #define FRAME_PIPELINE
+
+    #include "../include/framequeue.h"
+#endif
+
+//What the main thread hands the draw for one frame.
+class FrameBatch
+{
+public:
+    P3D::V3<P3D::fp> eye;
+    P3D::V3<P3D::fp> angle;
+
+    P3D::Plane<P3D::fp> frustrumPlanes[6];
+
+    std::vector<const P3D::BspModelPolygon*> polyBuffer;
+
+#ifdef FRAME_PIPELINE
+    //polyBuffer transformed, clipped and set up. Only rasterising is left for the draw thread.
+    P3D::SetupBatch setup;
+#endif
+};
+
 class MainLoop
 {
 public:
@@ -22,9 +46,11 @@ public:
 
 private:
 
-    void UpdateFrustrumBB();
-    void RenderModel();
-    bool FrustrumTestTriangle(const P3D::BspModelTriangle* tri) const;
+    void SetupRenderDevice(P3D::RenderDevice& device);
+    void SortFrame(FrameBatch& frame);
+    void DrawFrame(const FrameBatch& frame, const P3D::RenderTarget* target);
+    void DrawView(P3D::RenderDevice& device, const FrameBatch& frame);
+    void RenderModel(P3D::RenderDevice& device, const std::vector<const P3D::BspModelPolygon*>& polyBuffer);
     void ResolveCollisions();
     void RunTimeslots();
 
@@ -32,17 +58,15 @@ private:
     static constexpr P3D::fp zFar = 1500;
     static constexpr P3D::fp vFov = 60;
     static constexpr P3D::fp hFov = 90;
+    static constexpr P3D::fp aspectRatio = 1.5;
 
     static constexpr unsigned int frameTicks = 50;
 
     P3D::fp gravity_velocity = 0;
 
+    P3D::pixel background = 0;
 
-    P3D::V3<P3D::fp> frustrumPoints[4]; //Top left and bottom-right frustrum points.
-
-    P3D::Plane<P3D::fp> frustrumPlanes[6];
-
-    P3D::AABB<P3D::fp> viewFrustrumBB;
+    P3D::M4<P3D::fp> projection;
 
     P3D::RenderDevice renderDev;
 
@@ -55,6 +79,28 @@ private:
     unsigned short keyState = 0;
 
     std::vector<const P3D::BspModelTriangle*> triBuffer;
+
+    P3D::BspSortCache sortCache;
+
+    //Collision and sorting each have their own so they don't depend on running on the same thread.
+    P3D::BspQueryContext collisionQuery;
+    P3D::BspQueryContext sortQuery;
+
+#ifdef FRAME_PIPELINE
+    void RunPipelined();
+    void DrawThread();
+    void SetupFrame(FrameBatch& frame);
+
+    //Runs the geometry phase on the main thread. renderDev only rasterises.
+    P3D::RenderDevice geometryDev;
+
+    //Sorted frames waiting to be drawn, and buffers waiting to be shown or drawn into.
+    FrameQueue<FrameBatch, 2> frames;
+    FrameQueue<int, 2> drawnBuffers;
+    FrameQueue<int, 2> freeBuffers;
+#else
+    FrameBatch frame;
+#endif
 };
 
 #endif // MAINLOOP_H
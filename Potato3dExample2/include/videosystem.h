@@ -22,6 +22,8 @@ public:
 
     void SetBackbuffer(QImage* image) { backBuffer = image; }
 
+    bool IsClosed() const { return closed; }
+
 protected:
     void paintEvent(QPaintEvent *event) override
     {
@@ -35,11 +37,12 @@ protected:
         p.drawImage(this->rect(), *backBuffer, backBuffer->rect());
     }
 
+    //The main loop sees it and shuts down, so the draw thread isn't left running into exit().
     void closeEvent(QCloseEvent *event) override
     {
         Q_UNUSED(event)
 
-        exit(0);
+        closed = true;
     }
 
     void keyPressEvent(QKeyEvent *event) override
@@ -76,6 +79,8 @@ private:
     QImage* backBuffer = nullptr;
 
     unsigned short* keyState = nullptr;
+
+    bool closed = false;
 };
 #endif
 
@@ -88,11 +93,20 @@ public:
     void Setup(unsigned short *keyState);
     const P3D::RenderTarget *GetBackBuffer();
     void PageFlip();
+
+#ifndef GBA
+    //For drawing off the main thread. Buffer is 0 or 1 and ShowBuffer() must be called from the main thread.
+    const P3D::RenderTarget *GetBuffer(int buffer);
+    void ShowBuffer(int buffer);
+#endif
     void SetPalette(const unsigned int pal[]);
 
     void UpdateKeys();
     unsigned int GetTime();
 
+    //The window was closed. Never on GBA.
+    bool IsClosed();
+
 private:
     P3D::RenderTarget* buffers[2] = {nullptr};
     int currentBuffer = 1;
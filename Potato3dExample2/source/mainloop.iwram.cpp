@@ -1,21 +1,18 @@
 #include "../include/mainloop.h"
 #include "../include/videosystem.h"
 
+#include <cassert>
+
+#ifdef FRAME_PIPELINE
+    #include <thread>
+#endif
 
 MainLoop::MainLoop()
 {
-    const P3D::fp halfHFov = hFov / 2;
-    const P3D::fp halfVFov = vFov / 2;
-
-    const P3D::fp halfFrustrumWidth = zFar * std::tan((float)P3D::pD2R(halfHFov));
-    const P3D::fp halfFrustrumHeight = zFar * std::tan((float)P3D::pD2R(halfVFov));
-
-    frustrumPoints[0] = P3D::V3<P3D::fp>(-halfFrustrumWidth, -halfFrustrumHeight, -zFar);
-    frustrumPoints[1] = P3D::V3<P3D::fp>(halfFrustrumWidth, halfFrustrumHeight, -zFar);
-    frustrumPoints[2] = P3D::V3<P3D::fp>(-halfFrustrumWidth, halfFrustrumHeight, -zFar);
-    frustrumPoints[3] = P3D::V3<P3D::fp>(halfFrustrumWidth, -halfFrustrumHeight, -zFar);
-
     triBuffer.reserve(8192);
+
+    collisionQuery.Reserve(model.GetModel()->GetQueryCapacity());
+    sortQuery.Reserve(model.GetModel()->GetQueryCapacity());
 }
 
 void MainLoop::Run()
@@ -23,96 +20,251 @@ void MainLoop::Run()
     vid.Setup(&keyState);
     vid.SetPalette(model.GetModel()->GetColorMap());
 
+    SetupRenderDevice(renderDev);
+
+    projection.perspective(vFov, aspectRatio, zNear, zFar);
+
+    background = model.GetModel()->GetFogLightMap()[(P3D::FOG_LEVELS-1)*256];
+
+#ifdef FRAME_PIPELINE
+    //Only its size is used. Everything it draws goes to a frame's setup batch.
+    geometryDev.SetRenderTarget(vid.GetBuffer(0));
+
+    SetupRenderDevice(geometryDev);
+
+    RunPipelined();
+#else
+    while(!vid.IsClosed())
+    {
+        RunTimeslots();
+
+        SortFrame(frame);
+
+        DrawFrame(frame, vid.GetBackBuffer());
+
+        vid.PageFlip();
+    }
+#endif
+}
+
+//Devices sharing setup batches need the same modes, planes and fog.
+void MainLoop::SetupRenderDevice(P3D::RenderDevice& device)
+{
     constexpr unsigned int flags = P3D::NoFlags;
     //constexpr unsigned int flags = P3D::SubdividePerspectiveMapping;
     //constexpr unsigned int flags = P3D::Fog;
     //constexpr unsigned int flags = P3D::SubdividePerspectiveMapping | P3D::Fog;
     //constexpr unsigned int flags = P3D::SubdividePerspectiveMapping | P3D::VertexLight | P3D::Fog;
 
-    renderDev.SetRenderFlags<flags, P3D::PixelShaderGBA8<flags>>();
+    //Mode 1 is for textures with transparent texels.
+    device.SetRenderModes<P3D::RenderMode<flags, P3D::PixelShaderGBA8<flags>>,
+                          P3D::RenderMode<flags | P3D::AlphaTest, P3D::PixelShaderGBA8<flags | P3D::AlphaTest>>>();
 
 
-    renderDev.SetPerspective(vFov, 1.5, zNear, zFar);
+    device.SetPerspective(vFov, aspectRatio, zNear, zFar);
 
-    renderDev.SetFogMode(P3D::FogExponential2);
-    renderDev.SetFogDensity(1.33);
+    device.SetFogMode(P3D::FogExponential2);
+    device.SetFogDensity(1.33);
 
-    //renderDev.SetFogMode(P3D::FogLinear);
-    //renderDev.SetFogDepth(750, 1000);
+    //device.SetFogMode(P3D::FogLinear);
+    //device.SetFogDepth(750, 1000);
 
 
-    renderDev.SetFogLightMap(model.GetModel()->GetFogLightMap());
+    device.SetFogLightMap(model.GetModel()->GetFogLightMap());
+}
 
-    const P3D::pixel background = model.GetModel()->GetFogLightMap()[(P3D::FOG_LEVELS-1)*256];
+#ifdef FRAME_PIPELINE
+void MainLoop::RunPipelined()
+{
+    for(int i = 0; i < 2; i++)
+    {
+        int* slot = freeBuffers.BeginPush();
 
-    while(true)
+        assert(slot);
+
+        *slot = i;
+        freeBuffers.EndPush();
+    }
+
+    std::thread drawThread(&MainLoop::DrawThread, this);
+
+    int shownBuffer = -1;
+
+    //Closing the window is seen when ShowBuffer() processes events.
+    while(!vid.IsClosed())
     {
-        RunTimeslots();
+        //Input, collision, sorting and the geometry phase for the next frame. Runs while the frame before is rasterised.
+        if(FrameBatch* next = frames.BeginPush())
+        {
+            RunTimeslots();
+
+            SortFrame(*next);
+
+            SetupFrame(*next);
+
+            frames.EndPush();
+        }
+        else
+        {
+            //Nothing to do until the draw thread finishes a frame. It has one, and has or will get a buffer
+            //as at most one of the two is on screen.
+            drawnBuffers.WaitFront();
+        }
 
-        renderDev.SetRenderTarget(vid.GetBackBuffer());
+        //Qt wants the window updated from this thread.
+        if(const int* drawn = drawnBuffers.Front())
+        {
+            const int buffer = *drawn;
 
-        renderDev.ClearColor(background);
+            drawnBuffers.Pop();
 
-        renderDev.PushMatrix();
+            vid.ShowBuffer(buffer);
 
-        renderDev.RotateX(-camera.GetAngle().x);
-        renderDev.RotateY(-camera.GetAngle().y);
-        renderDev.RotateZ(-camera.GetAngle().z);
+            //The buffer that was on screen can be drawn into again.
+            //There are only two buffers and this one is in neither queue, so there is room for it.
+            if(shownBuffer != -1)
+            {
+                int* slot = freeBuffers.BeginPush();
 
-        renderDev.Translate(P3D::V3<P3D::fp>(-camera.GetEyePosition().x, -camera.GetEyePosition().y, -camera.GetEyePosition().z));
+                assert(slot);
 
-        UpdateFrustrumBB();
+                *slot = shownBuffer;
+                freeBuffers.EndPush();
+            }
 
-        renderDev.BeginFrame();
+            shownBuffer = buffer;
+        }
+    }
 
-        renderDev.BeginDraw(frustrumPlanes);
+    //Wakes the draw thread if it is waiting, and stops it before it takes another frame.
+    frames.Close();
+    freeBuffers.Close();
 
-        RenderModel();
+    drawThread.join();
+}
 
-        renderDev.EndDraw();
+void MainLoop::DrawThread()
+{
+    //Only this thread touches renderDev once started.
+    while(true)
+    {
+        const FrameBatch* next = frames.WaitFront();
 
-        renderDev.EndFrame();
+        if(!next)
+            return;
 
-        renderDev.PopMatrix();
+        const int* buffer = freeBuffers.WaitFront();
 
-        vid.PageFlip();
+        if(!buffer)
+            return;
+
+        const int drawBuffer = *buffer;
+
+        freeBuffers.Pop();
+
+        DrawFrame(*next, vid.GetBuffer(drawBuffer));
+
+        frames.Pop();
+
+        //There are only two buffers and this one is in neither queue, so there is room for it.
+        int* slot = drawnBuffers.BeginPush();
+
+        assert(slot);
+
+        *slot = drawBuffer;
+        drawnBuffers.EndPush();
     }
 }
 
-void MainLoop::UpdateFrustrumBB()
+void MainLoop::SetupFrame(FrameBatch& frame)
+{
+    frame.setup.Clear();
+
+    geometryDev.SetSetupBatch(&frame.setup);
+
+    DrawView(geometryDev, frame);
+
+    //The batch belongs to the draw thread once pushed.
+    geometryDev.SetSetupBatch(nullptr);
+}
+#endif
+
+void MainLoop::SortFrame(FrameBatch& frame)
+{
+    frame.eye = camera.GetEyePosition();
+    frame.angle = camera.GetAngle();
+
+    //The same view transform DrawView() gives the device.
+    P3D::M4<P3D::fp> view;
+    view.setToIdentity();
+
+    view.rotateX(-frame.angle.x);
+    view.rotateY(-frame.angle.y);
+    view.rotateZ(-frame.angle.z);
+
+    view.translate(P3D::V3<P3D::fp>(-frame.eye.x, -frame.eye.y, -frame.eye.z));
+
+    const P3D::M4<P3D::fp> transform = projection * view;
+
+    transform.ExtractFrustrumPlanes(frame.frustrumPlanes);
+
+    //Polygons come back already frustrum tested.
+    model.GetModel()->SortCoherent(frame.eye, frame.frustrumPlanes, frame.polyBuffer, true, sortCache, sortQuery);
+
+    //Reserved to the model's query capacity, so this can't happen.
+    assert(!sortQuery.Overflowed());
+}
+
+void MainLoop::DrawFrame(const FrameBatch& frame, const P3D::RenderTarget* target)
 {
-    viewFrustrumBB = P3D::AABB<P3D::fp>();
+    renderDev.SetRenderTarget(target);
 
-    P3D::M4<P3D::fp> camMatrix = renderDev.GetMatrix().Inverted();
+    renderDev.ClearColor(background);
 
-    P3D::V4<P3D::fp> t1 = camMatrix * frustrumPoints[0];
-    P3D::V4<P3D::fp> t2 = camMatrix * frustrumPoints[1];
-    P3D::V4<P3D::fp> t3 = camMatrix * frustrumPoints[2];
-    P3D::V4<P3D::fp> t4 = camMatrix * frustrumPoints[3];
+    renderDev.BeginFrame();
 
-    viewFrustrumBB.AddPoint(camera.GetEyePosition());
+#ifdef FRAME_PIPELINE
+    renderDev.DrawSetupBatch(frame.setup);
+#else
+    DrawView(renderDev, frame);
+#endif
 
-    viewFrustrumBB.AddPoint(P3D::V3<P3D::fp>(t1.x, t1.y, t1.z));
-    viewFrustrumBB.AddPoint(P3D::V3<P3D::fp>(t2.x, t2.y, t2.z));
-    viewFrustrumBB.AddPoint(P3D::V3<P3D::fp>(t3.x, t3.y, t3.z));
-    viewFrustrumBB.AddPoint(P3D::V3<P3D::fp>(t4.x, t4.y, t4.z));
+    renderDev.EndFrame();
 }
 
-void MainLoop::RenderModel()
+void MainLoop::DrawView(P3D::RenderDevice& device, const FrameBatch& frame)
 {
-    model.GetModel()->Sort(camera.GetEyePosition(), viewFrustrumBB, triBuffer, true);
+    device.PushMatrix();
+
+    device.RotateX(-frame.angle.x);
+    device.RotateY(-frame.angle.y);
+    device.RotateZ(-frame.angle.z);
 
-    //for(int i = triBuffer.size()-1; i >= 0; i--)
-    for(unsigned int i = 0; i < triBuffer.size(); i++)
+    device.Translate(P3D::V3<P3D::fp>(-frame.eye.x, -frame.eye.y, -frame.eye.z));
+
+    device.BeginDraw();
+
+    RenderModel(device, frame.polyBuffer);
+
+    device.EndDraw();
+
+    device.PopMatrix();
+}
+
+void MainLoop::RenderModel(P3D::RenderDevice& device, const std::vector<const P3D::BspModelPolygon*>& polyBuffer)
+{
+    for(unsigned int i = 0; i < polyBuffer.size(); i++)
     {
-        const P3D::BspModelTriangle* tri = triBuffer[i];
+        const P3D::BspModelPolygon* poly = polyBuffer[i];
+
+        const P3D::BspNodeTexture* ntex = model.GetModel()->GetTexture(poly->texture);
 
-        if(!FrustrumTestTriangle(tri))
-            continue;
+        const unsigned int count = poly->vertex_count;
 
-        const P3D::BspNodeTexture* ntex = model.GetModel()->GetTexture(tri->texture);
+        P3D::V3<P3D::fp> verts[P3D::BSP_POLYGON_MAX_VERTS];
 
-        P3D::V3<P3D::fp> verts[3] = {tri->tri.verts[0].pos, tri->tri.verts[1].pos, tri->tri.verts[2].pos};
+        for(unsigned int v = 0; v < count; v++)
+            verts[v] = poly->verts[v].pos;
 
         P3D::Material m;
 
@@ -121,49 +273,51 @@ void MainLoop::RenderModel()
             m.type = P3D::Material::Texture;
             m.pixels = model.GetModel()->GetTexturePixels(ntex->texture_pixels_offset);
 
+            if(ntex->alpha)
+            {
+                m.render_mode = 1;
+                m.alpha = true;
+                m.alpha_skip = model.GetModel()->GetTextureAlphaSkip(ntex->alpha_skip_offset);
+            }
+
             const P3D::V3<P3D::fp> lightVector(0.66,0.66,0.33);
 
-            const P3D::fp lightLevel = P3D::fp(0.5) + P3D::pASR(P3D::fp(1) + tri->normal_plane.Normal().DotProduct(lightVector), 2);
+            const P3D::fp lightLevel = P3D::fp(0.5) + P3D::pASR(P3D::fp(1) + poly->normal_plane.Normal().DotProduct(lightVector), 2);
 
-            const P3D::fp light_levels[3] = {lightLevel, lightLevel, lightLevel};
+            P3D::fp light_levels[P3D::BSP_POLYGON_MAX_VERTS];
+            P3D::V2<P3D::fp> uvs[P3D::BSP_POLYGON_MAX_VERTS];
 
-            const P3D::V2<P3D::fp> uvs[3] = {tri->tri.verts[0].uv, tri->tri.verts[1].uv, tri->tri.verts[2].uv};
+            for(unsigned int v = 0; v < count; v++)
+            {
+                light_levels[v] = lightLevel;
+                uvs[v] = poly->verts[v].uv;
+            }
+
+            const P3D::V3<P3D::fp> texture_axes[2] = {poly->u_axis, poly->v_axis};
 
-            renderDev.SetMaterial(m);
+            device.SetMaterial(m);
 
-            renderDev.DrawTriangle(verts, uvs, light_levels);
-            //renderDev.DrawTriangle(verts, uvs);
+            device.DrawPolygon(verts, count, uvs, light_levels, texture_axes);
         }
         else
         {
-            m.color = tri->color;
+            m.color = poly->color;
 
-            renderDev.SetMaterial(m);
+            device.SetMaterial(m);
 
-            renderDev.DrawTriangle(verts);
+            device.DrawPolygon(verts, count);
         }
     }
 }
 
-bool MainLoop::FrustrumTestTriangle(const P3D::BspModelTriangle* tri) const
-{
-    for(unsigned int i = P3D::Left; i <= P3D::Near; i++)
-    {
-        if(!frustrumPlanes[i].TriangleIsFrontside(tri->tri.verts[0].pos, tri->tri.verts[1].pos, tri->tri.verts[2].pos))
-        {
-            return false;
-        }
-    }
-
-    return true;
-}
-
 void MainLoop::ResolveCollisions()
 {
     const int bb_size = 100;
     P3D::AABB<P3D::fp> player_box(camera.GetPosition(), bb_size);
 
-    model.GetModel()->Sort(camera.GetPosition(), player_box, triBuffer, true);
+    model.GetModel()->Sort(camera.GetPosition(), player_box, triBuffer, true, collisionQuery);
+
+    assert(!collisionQuery.Overflowed());
 
     int collision_count = 0;
 
@@ -72,14 +72,28 @@ void VideoSystem::PageFlip()
 {
 #ifdef GBA
     REG_DISPCNT ^= DCNT_PAGE;
+
+    currentBuffer = 1 - currentBuffer;
 #else
-    window->SetBackbuffer(image[currentBuffer]);
+    ShowBuffer(currentBuffer);
+#endif
+}
+
+#ifndef GBA
+const P3D::RenderTarget* VideoSystem::GetBuffer(int buffer)
+{
+    return buffers[buffer];
+}
+
+void VideoSystem::ShowBuffer(int buffer)
+{
+    window->SetBackbuffer(image[buffer]);
     window->repaint();
     application->processEvents();
-#endif
 
-    currentBuffer = 1 - currentBuffer;
+    currentBuffer = 1 - buffer;
 }
+#endif
 
 void VideoSystem::SetPalette(const unsigned int pal[256])
 {
@@ -143,6 +157,15 @@ void VideoSystem::UpdateKeys()
 #endif
 }
 
+bool VideoSystem::IsClosed()
+{
+#ifndef GBA
+    return window->IsClosed();
+#else
+    return false;
+#endif
+}
+
 unsigned int VideoSystem::GetTime()
 {
 #ifndef GBA
@@ -1,8 +1,10 @@
 #include "../include/worldmodel.h"
 
+#include <cassert>
+
 WorldModel::WorldModel()
 {
-
+    assert(model->CheckLimits());
 }
 
 const P3D::BspModel* WorldModel::GetModel() const
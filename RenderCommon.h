@@ -1,6 +1,7 @@
 #ifndef RENDERCOMMON_H
 #define RENDERCOMMON_H
 
+#include <type_traits>
 #include "Config.h"
 
 namespace P3D
@@ -11,7 +12,7 @@ namespace P3D
         ZTest = 1ul,
         ZWrite = 2ul,
         ZBuffer = ZTest | ZWrite,
-        AlphaTest = 4ul,
+        AlphaTest = 4ul, //Texels of value 0 are not drawn.
         FullPerspectiveMapping = 16ul,
         SubdividePerspectiveMapping = 32ul,
         BackFaceCulling = 64ul,
@@ -27,6 +28,12 @@ namespace P3D
         FogExponential2 = 2u, //Exponential Squared Fog
     } FogMode;
 
+    //Most verts a convex polygon may be submitted with.
+    inline constexpr unsigned int POLYGON_MAX_VERTS = 8;
+
+    //Most render modes a RenderDevice may hold at once.
+    inline constexpr unsigned int RENDER_MODES_MAX = 8;
+
     class Material
     {
     public:
@@ -40,20 +47,20 @@ namespace P3D
         };
 
         MaterialType type = Color;
+        unsigned char render_mode = 0; //Index into the modes given to RenderDevice::SetRenderModes(). Out of range draws with mode 0.
 
         union
         {
-            struct
-            {
-                const pixel* pixels;
-                bool alpha; //If pixel == 0. Don't draw.
-            };
-            struct
-            {
-                pixel color;
-            };
+            const pixel* pixels;
+            pixel color;
         };
 
+        bool alpha = false; //If pixel == 0. Don't draw. Needs an AlphaTest render mode.
+
+        //Optional. Per texel, how many texels away in u or v the nearest opaque texel is. 0 if opaque.
+        //AlphaTest modes use it to step over transparent runs.
+        const unsigned char* alpha_skip = nullptr;
+
         static constexpr unsigned int width = TEX_SIZE;
         static constexpr unsigned int height = TEX_SIZE;
     };
@@ -63,21 +70,46 @@ namespace P3D
     public:
         unsigned int vertex_transformed;
         unsigned int triangles_submitted;
-        unsigned int triangles_drawn;
+        unsigned int triangles_drawn; //Triangles rasterised. A polygon counts as (verts - 2).
+        unsigned int polygons_drawn;
         unsigned int scanlines_drawn;
         unsigned int span_checks;
         unsigned int span_count;
         unsigned int triangles_clipped;
+        unsigned int triangles_guard_band; //Crossed the viewport edge but were scissored instead of clipped.
+        unsigned int perspective_pixels; //Pixels drawn with perspective correct or subdivided mapping.
+        unsigned int perspective_reciprocals; //Reciprocals of w taken to draw them.
+        unsigned int hi_z_pixels_rejected; //Z tested pixels skipped because their Hi-Z tile was nearer.
+        unsigned int spans_deferred; //Spans held back to be drawn grouped by texture.
+        //Textured spans drawn with a different texture to the one before. Not a count of cache misses,
+        //which can't be counted here. Only a stand-in for them: each switch is where a span may stop
+        //reading texels that are still cached.
+        unsigned int texture_switches;
+
+        const pixel* last_texture; //Of the last textured span drawn.
 
         void ResetToZero()
         {
             vertex_transformed = 0;
             triangles_submitted = 0;
             triangles_drawn = 0;
+            polygons_drawn = 0;
             scanlines_drawn = 0;
             span_checks = 0;
             span_count = 0;
             triangles_clipped = 0;
+            triangles_guard_band = 0;
+            perspective_pixels = 0;
+            perspective_reciprocals = 0;
+            hi_z_pixels_rejected = 0;
+            spans_deferred = 0;
+            texture_switches = 0;
+            last_texture = nullptr;
+        }
+
+        float PixelsPerReciprocal() const
+        {
+            return perspective_reciprocals ? (float)perspective_pixels / perspective_reciprocals : 0.0f;
         }
     };
 
@@ -93,6 +125,14 @@ namespace P3D
 
             z_val* z_start = nullptr;
             unsigned int z_y_pitch;
+            fp z_bias = 0; //Added to all depth written and tested. Set by the depth epoch.
+
+            //Furthest depth in each Hi-Z tile. Tiles are aligned to the render target, not the viewport.
+            z_val* hi_z = nullptr;
+            unsigned int hi_z_y_pitch = 0;
+            unsigned int x = 0, y = 0; //Of the viewport in the render target.
+
+            unsigned int clip_guard_band_shift = CLIP_GUARD_BAND_SHIFT;
         };
 
         class RenderDeviceNearFarPlanes
@@ -132,6 +172,17 @@ namespace P3D
 
         } ClipPlane;
 
+        //Outcode bits for the guard band X/Y planes are the ClipPlane bits shifted up by this.
+        inline constexpr unsigned int GUARD_BAND_OUTCODE_SHIFT = 8;
+
+        inline constexpr unsigned int XY_CLIP_PLANES = (X_W_Left | X_W_Right | Y_W_Top | Y_W_Bottom);
+        inline constexpr unsigned int REJECT_OUTCODES = (W_Near | XY_CLIP_PLANES | W_Far);
+
+        //Clipping to the near and 4 X/Y planes. Each plane adds at most one vertex
+        //to the polygon and creates at most two new ones in the vertex pool.
+        inline constexpr unsigned int CLIP_POLYGON_MAX_VERTS = POLYGON_MAX_VERTS + 5;
+        inline constexpr unsigned int CLIP_VERTEX_POOL_SIZE = POLYGON_MAX_VERTS + (5 * 2);
+
         typedef enum ClipOperation : unsigned int
         {
             Accept = 0u, //No clip required.
@@ -139,13 +190,25 @@ namespace P3D
             Reject = 2u //All out. Reject polygon.
         } ClipOperation;
 
-        class Vertex4d
+        //Stands in for an attribute that render_flags leave disabled. Reads as zero and ignores writes.
+        //Declared [[no_unique_address]] it takes no storage. The tag keeps each one a distinct type.
+        template<class T, unsigned int tag> class NoAttribute
+        {
+        public:
+            constexpr operator T() const { return T(); }
+            constexpr NoAttribute& operator=(const T&) { return *this; }
+            constexpr NoAttribute& operator+=(const T&) { return *this; }
+        };
+
+        template<bool enabled, class T, unsigned int tag> using OptionalAttribute = std::conditional_t<enabled, T, NoAttribute<T, tag>>;
+
+        template<const unsigned int render_flags> class Vertex4d
         {
         public:
             V4<fp> pos;
             V2<fp> uv;
-            fp fog_factor;
-            fp light_factor;
+            [[no_unique_address]] OptionalAttribute<(render_flags & Fog) != 0, fp, 0> fog_factor;
+            [[no_unique_address]] OptionalAttribute<(render_flags & VertexLight) != 0, fp, 1> light_factor;
 
             void toPerspectiveCorrect(const fp scale = fp(1))
             {
@@ -155,10 +218,23 @@ namespace P3D
             }
         };
 
-        class TransformedTriangle
+        class TransformedVertex
+        {
+        public:
+            V4<fp> pos;
+            unsigned int outcode; //Planes this vertex is outside of.
+        };
+
+        //Convex and planar. Verts are in order around the outline.
+        class TransformedPolygon
         {
         public:
-            Vertex4d verts[8];
+            const TransformedVertex* verts[POLYGON_MAX_VERTS];
+            unsigned int vertex_count;
+            const V2<fp>* uvs; //nullptr if not textured.
+            const fp* light_levels; //May be nullptr.
+            const V3<fp>* texture_axes; //Object space u and v axes of the face. May be nullptr.
+            unsigned int outcodes; //Outcodes of the input verts OR'd together.
         };
     };
 };
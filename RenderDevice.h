@@ -12,6 +12,16 @@
 
 namespace P3D
 {
+    //A render flags and pixel shader pair. A list of them is given to RenderDevice::SetRenderModes().
+    template<const unsigned int flags, class TPixelShader = PixelShaderDefault<flags>> class RenderMode
+    {
+    public:
+        static constexpr unsigned int render_flags = flags;
+        using PixelShader = TPixelShader;
+    };
+
+    //Shares no mutable state with other RenderDevices. Devices on different threads may draw at
+    //the same time, each into its own RenderTarget. Textures, materials and fog light maps are only read.
     class RenderDevice
     {
     public:
@@ -19,14 +29,26 @@ namespace P3D
         {
             texture_cache = new TextureCacheDefault();
 
-            current_material = new Material();
+            current_material = &default_material;
 
             //Populate matrix stack with 1 identity matrix.
             model_view_matrix_stack.push_back(M4<fp>());
             LoadIdentity();
         }
 
-        ~RenderDevice() {}
+        //Render modes point back into the device that made them.
+        RenderDevice(const RenderDevice&) = delete;
+        RenderDevice& operator=(const RenderDevice&) = delete;
+        RenderDevice(RenderDevice&&) = delete;
+        RenderDevice& operator=(RenderDevice&&) = delete;
+
+        ~RenderDevice()
+        {
+            DeleteRenderModes();
+
+            delete texture_cache;
+            delete[] transformed_vertexes;
+        }
 
         //Render Target
         void SetRenderTarget(const RenderTarget *target)
@@ -34,10 +56,17 @@ namespace P3D
             render_target = target;
 
             SetViewport(0, 0, render_target->GetWidth(), render_target->GetHeight());
+
+#ifdef DEPTH_EPOCH_CLEAR
+            //Carry on from the epoch the target's Z-buffer was left in.
+            SetDepthEpoch(render_target->GetDepthEpoch());
+#endif
         }
 
         void SetViewport(unsigned int x, unsigned int y, unsigned int width, unsigned int height)
         {
+            FlushRenderModes();
+
             if(((x + width) > render_target->GetWidth()) || (y + height > render_target->GetHeight()))
             {
                 x = 0;
@@ -49,6 +78,10 @@ namespace P3D
             viewport.width = width;
             viewport.height = height;
 
+#ifdef GUARD_BAND_CLIPPING
+            viewport.clip_guard_band_shift = GetGuardBandShift(width, height);
+#endif
+
             viewport.start = &render_target->GetColorBuffer()[(y * render_target->GetColorBufferYPitch()) + x];
             viewport.y_pitch = render_target->GetColorBufferYPitch();
 
@@ -63,27 +96,40 @@ namespace P3D
                 viewport.z_y_pitch = 0;
             }
 
-            if(triangle_render)
+            viewport.hi_z = render_target->GetHiZBuffer();
+            viewport.hi_z_y_pitch = render_target->GetHiZYPitch();
+            viewport.x = x;
+            viewport.y = y;
+
+            for(unsigned int i = 0; i < render_mode_count; i++)
             {
-                triangle_render->SetRenderStateViewport(viewport);
+                render_modes[i]->SetRenderStateViewport(viewport);
             }
         }
 
         template<const unsigned int render_flags, class TPixelShader = PixelShaderDefault<render_flags>> void SetRenderFlags()
         {
-            if(triangle_render)
-                delete triangle_render;
+            SetRenderModes<RenderMode<render_flags, TPixelShader>>();
+        }
 
-            triangle_render = new P3D::Internal::RenderTriangle<render_flags, TPixelShader>();
+        //Creates a triangle renderer for each mode up front. Mode 0 is made current.
+        //Materials pick one by their render_mode index so switching costs no allocation.
+        template<class... TRenderModes> void SetRenderModes()
+        {
+            static_assert((sizeof...(TRenderModes) > 0) && (sizeof...(TRenderModes) <= RENDER_MODES_MAX), "1 to RENDER_MODES_MAX render modes.");
 
-            triangle_render->SetRenderStateViewport(viewport);
-            triangle_render->SetZPlanes(z_planes);
-            triangle_render->SetTextureCache(texture_cache);
-            triangle_render->SetFogParams(fog_params);
+            FlushRenderModes();
+            DeleteRenderModes();
 
-    #ifdef RENDER_STATS
-            triangle_render->SetRenderStats(render_stats);
-    #endif
+            (AddRenderMode<TRenderModes>(), ...);
+
+            triangle_render = render_modes[0];
+        }
+
+        //A mode that was never given falls back to mode 0, so what's drawn doesn't depend on the material before.
+        void SetRenderMode(const unsigned int mode)
+        {
+            triangle_render = (mode < render_mode_count) ? render_modes[mode] : render_modes[0];
         }
 
         //Matrix
@@ -107,9 +153,9 @@ namespace P3D
 
             z_planes.z_ratio_3 = pReciprocal(z_far - z_near);
 
-            if(triangle_render)
+            for(unsigned int i = 0; i < render_mode_count; i++)
             {
-                triangle_render->SetZPlanes(z_planes);
+                render_modes[i]->SetZPlanes(z_planes);
             }
         }
 
@@ -181,6 +227,8 @@ namespace P3D
         //Clear
         void ClearColor(const pixel color)
         {
+            FlushRenderModes();
+
             unsigned int c32 = color;
             unsigned int shift = 0;
 
@@ -203,21 +251,36 @@ namespace P3D
             }
         }
 
-        void ClearDepth(const z_val depth)
+        void ClearDepth(const fp depth)
         {
-            for(unsigned int y = 0; y < render_target->GetHeight(); y++)
+            FlushRenderModes();
+
+#ifdef DEPTH_EPOCH_CLEAR
+            //Clearing to the far plane only steps to the next epoch.
+            //Depth left from earlier epochs is further away than anything drawn in this one.
+            if(depth >= fp(1))
             {
-                z_val* z = &render_target->GetZBuffer()[y * render_target->GetZBufferYPitch()];
+                const unsigned int depth_epoch = render_target->GetDepthEpoch();
 
-                for(unsigned int x = 0; x < render_target->GetWidth(); x++)
+                if(depth_epoch)
                 {
-                    z[x] = depth;
+                    SetDepthEpoch(depth_epoch - 1);
+                    return;
                 }
+
+                //Out of epochs. Fill with depth older than all of them and start again.
+                FillDepth(depth + (fp(int(DEPTH_EPOCH_COUNT)) * DEPTH_EPOCH_SPAN));
+                SetDepthEpoch(DEPTH_EPOCH_COUNT - 1);
+                return;
             }
+#endif
+            FillDepth(depth + viewport.z_bias);
         }
 
         void ClearViewportColor(const pixel color)
         {
+            FlushRenderModes();
+
             unsigned int c32 = color;
             unsigned int shift = 0;
 
@@ -255,21 +318,40 @@ namespace P3D
             }
         }
 
-        void ClearViewportDepth(const z_val depth)
+        void ClearViewportDepth(const fp depth)
         {
+            FlushRenderModes();
+
+            const z_val z_clear = depth + viewport.z_bias;
+
             for(unsigned int y = 0; y < viewport.height; y++)
             {
                 z_val* z = &viewport.z_start[y * viewport.z_y_pitch];
 
                 for(unsigned int x = 0; x < viewport.width; x++)
                 {
-                    z[x] = depth;
+                    z[x] = z_clear;
+                }
+            }
+
+            //Tiles on the edge of the viewport keep depth from outside it.
+            if(viewport.hi_z)
+            {
+                for(unsigned int ty = viewport.y >> HI_Z_TILE_SHIFT; ty <= ((viewport.y + viewport.height - 1) >> HI_Z_TILE_SHIFT); ty++)
+                {
+                    for(unsigned int tx = viewport.x >> HI_Z_TILE_SHIFT; tx <= ((viewport.x + viewport.width - 1) >> HI_Z_TILE_SHIFT); tx++)
+                    {
+                        z_val& tile = viewport.hi_z[(ty * viewport.hi_z_y_pitch) + tx];
+                        tile = pMax(tile, z_clear);
+                    }
                 }
             }
         }
 
         void SetFogColor(const pixel color)
         {
+            FlushRenderModes();
+
             fog_params.fog_color = color;
         }
 
@@ -297,7 +379,10 @@ namespace P3D
 #endif
         }
 
-        void EndFrame() {}
+        void EndFrame()
+        {
+            FlushRenderModes();
+        }
 
         void BeginDraw(Plane<fp> frustrumPlanes[6] = nullptr)
         {
@@ -309,42 +394,82 @@ namespace P3D
             }
         }
 
-        void EndDraw() {}
+        void EndDraw()
+        {
+            FlushRenderModes();
+        }
 
         //
         void SetTextureCache(TextureCacheBase* cache)
         {
+            FlushRenderModes();
+
             if(texture_cache)
                 delete texture_cache;
 
             texture_cache = cache;
 
-            triangle_render->SetTextureCache(texture_cache);
+            for(unsigned int i = 0; i < render_mode_count; i++)
+            {
+                render_modes[i]->SetTextureCache(texture_cache);
+            }
         }
 
         void SetMaterial(const Material& material, const signed char importance = 0)
         {
             current_material = &material;
 
+            SetRenderMode(material.render_mode);
+
             if(material.type == Material::Texture)
             {
+#ifdef SETUP_BATCH
+                //The device that rasterises the batch has its own cache.
+                if(setup_batch)
+                {
+                    setup_batch->textures.push_back({material.pixels, importance, (unsigned int)setup_batch->runs.size()});
+                    return;
+                }
+#endif
+
                 texture_cache->AddTexture(material.pixels, importance);
             }
         }
 
         void SetFogLightMap(const unsigned char* colorMap)
         {
-            triangle_render->SetFogLightMap(colorMap);
+            FlushRenderModes();
+
+            fog_light_map = colorMap;
+
+            for(unsigned int i = 0; i < render_mode_count; i++)
+            {
+                render_modes[i]->SetFogLightMap(fog_light_map);
+            }
         }
 
         //Draw Objects.
-        void DrawTriangle(const V3<fp> vertexes[3], const V2<fp> uvs[3] = nullptr, const fp light_levels[3] = nullptr)
+        //texture_axes are the object space steps for +1 texel in u and v across a planar face.
+        //When given, perspective correct modes take their texture gradients from them once per face.
+        void DrawTriangle(const V3<fp> vertexes[3], const V2<fp> uvs[3] = nullptr, const fp light_levels[3] = nullptr, const V3<fp> texture_axes[2] = nullptr)
+        {
+            DrawPolygon(vertexes, 3, uvs, light_levels, texture_axes);
+        }
+
+        //Convex, planar and at most POLYGON_MAX_VERTS verts. Rasterised in one pass, not as a fan of triangles.
+        void DrawPolygon(const V3<fp>* vertexes, const unsigned int count, const V2<fp>* uvs = nullptr, const fp* light_levels = nullptr, const V3<fp> texture_axes[2] = nullptr)
         {
-            TransformVertexes(vertexes, 3);
+            if(count > POLYGON_MAX_VERTS)
+                return;
+
+            TransformVertexes(vertexes, count);
 
-            const unsigned int indexes[3] = {0,1,2};
+            unsigned int indexes[POLYGON_MAX_VERTS];
 
-            DrawTriangle(indexes, uvs, light_levels);
+            for(unsigned int i = 0; i < count; i++)
+                indexes[i] = i;
+
+            DrawPolygon(indexes, count, uvs, light_levels, texture_axes);
         }
 
         void TransformVertexes(const V3<fp>* vertexes, const unsigned int count)
@@ -352,13 +477,14 @@ namespace P3D
             if(transformed_vertexes_buffer_count < count)
             {
                 delete[] transformed_vertexes;
-                transformed_vertexes = new V4<fp>[count];
+                transformed_vertexes = new P3D::Internal::TransformedVertex[count];
                 transformed_vertexes_buffer_count = count;
             }
 
             for(unsigned int i = 0; i < count; i++)
             {
-                transformed_vertexes[i] = transform_matrix * vertexes[i];
+                transformed_vertexes[i].pos = transform_matrix * vertexes[i];
+                transformed_vertexes[i].outcode = GetVertexOutcode(transformed_vertexes[i].pos);
             }
 
 #ifdef RENDER_STATS
@@ -366,31 +492,111 @@ namespace P3D
 #endif
         }
 
-        void DrawTriangle(const unsigned int indexes[3], const V2<fp> uvs[3] = nullptr, const fp light_levels[3] = nullptr) const
+        void DrawTriangle(const unsigned int indexes[3], const V2<fp> uvs[3] = nullptr, const fp light_levels[3] = nullptr, const V3<fp> texture_axes[2] = nullptr)
         {
-            P3D::Internal::TransformedTriangle tri;
+            DrawPolygon(indexes, 3, uvs, light_levels, texture_axes);
+        }
+
+        void DrawPolygon(const unsigned int* indexes, const unsigned int count, const V2<fp>* uvs = nullptr, const fp* light_levels = nullptr, const V3<fp> texture_axes[2] = nullptr)
+        {
+            if((count < 3) || (count > POLYGON_MAX_VERTS))
+                return;
+
+#ifdef RENDER_STATS
+            render_stats.triangles_submitted++;
+#endif
+
+            //The triangle renderer only copies out the attributes its render flags use.
+            P3D::Internal::TransformedPolygon poly;
 
-            tri.verts[0].pos = transformed_vertexes[indexes[0]];
-            tri.verts[1].pos = transformed_vertexes[indexes[1]];
-            tri.verts[2].pos = transformed_vertexes[indexes[2]];
+            unsigned int outcodes_and = ~0u;
+            unsigned int outcodes_or = 0;
 
-            if(current_material->type == Material::Texture)
+            for(unsigned int i = 0; i < count; i++)
             {
-                tri.verts[0].uv =  uvs[0];
-                tri.verts[1].uv =  uvs[1];
-                tri.verts[2].uv =  uvs[2];
+                const P3D::Internal::TransformedVertex& v = transformed_vertexes[indexes[i]];
+
+                poly.verts[i] = &v;
+
+                outcodes_and &= v.outcode;
+                outcodes_or |= v.outcode;
             }
 
-            if(light_levels)
+            //All verts outside the same plane. Reject.
+            if(outcodes_and & P3D::Internal::REJECT_OUTCODES)
+                return;
+
+            poly.vertex_count = count;
+            poly.outcodes = outcodes_or;
+
+            poly.uvs = (current_material->type == Material::Texture) ? uvs : nullptr;
+            poly.light_levels = light_levels;
+            poly.texture_axes = texture_axes;
+
+            //Polygons are rasterised in the order they are drawn. Those set up in another mode go first.
+            if(triangle_render != setup_render_mode)
             {
-                tri.verts[0].light_factor = pClamp(fp(0), fp(1) - light_levels[0], LIGHT_MAX);
-                tri.verts[1].light_factor = pClamp(fp(0), fp(1) - light_levels[1], LIGHT_MAX);
-                tri.verts[2].light_factor = pClamp(fp(0), fp(1) - light_levels[2], LIGHT_MAX);
+                if(setup_render_mode)
+                    setup_render_mode->DrawSetupPolygons();
+
+                setup_render_mode = triangle_render;
             }
 
-            triangle_render->DrawTriangle(tri, *current_material);
+#ifdef DEFERRED_SPANS
+            //Spans that depend on draw order go after those held back.
+            if(!triangle_render->DefersSpans())
+                FlushDeferredSpans();
+#endif
+
+            triangle_render->DrawPolygon(poly, *current_material);
         }
 
+#ifdef SETUP_BATCH
+        //Draws go through the geometry phase into batch and are not rasterised. nullptr rasterises them again.
+        //Textures given to SetMaterial() meanwhile go into batch for the drawing device's cache.
+        //The render target still sets the viewport they are set up for, and clears still go to it.
+        void SetSetupBatch(SetupBatch* batch)
+        {
+            FlushRenderModes();
+
+            setup_batch = batch;
+
+            for(unsigned int i = 0; i < render_mode_count; i++)
+            {
+                render_modes[i]->SetSetupBatch(setup_batch, i);
+            }
+        }
+
+        //Rasterises a batch into the render target, in the order it was drawn. Only reads the batch.
+        void DrawSetupBatch(const SetupBatch& batch)
+        {
+            FlushRenderModes();
+
+            unsigned int texture = 0;
+
+            for(unsigned int r = 0; r < batch.runs.size(); r++)
+            {
+                //Textures reach the cache at the same point in the draws as they did through SetMaterial().
+                for(; (texture < batch.textures.size()) && (batch.textures[texture].run <= r); texture++)
+                {
+                    texture_cache->AddTexture(batch.textures[texture].pixels, batch.textures[texture].importance);
+                }
+
+                const P3D::Internal::SetupBatchRun& run = batch.runs[r];
+
+                if(run.mode >= render_mode_count)
+                    continue;
+
+#ifdef DEFERRED_SPANS
+                if(!render_modes[run.mode]->DefersSpans())
+                    FlushDeferredSpans();
+#endif
+
+                render_modes[run.mode]->DrawSetupBatchRun(batch, run);
+            }
+        }
+#endif
+
 #ifdef RENDER_STATS
         const RenderStats& GetRenderStats() const
         {
@@ -400,6 +606,120 @@ namespace P3D
 
     private:
 
+        template<class TRenderMode> void AddRenderMode()
+        {
+            P3D::Internal::RenderTriangleBase* mode = new P3D::Internal::RenderTriangle<TRenderMode::render_flags, typename TRenderMode::PixelShader>();
+
+            mode->SetRenderStateViewport(viewport);
+            mode->SetZPlanes(z_planes);
+            mode->SetTextureCache(texture_cache);
+            mode->SetFogParams(fog_params);
+            mode->SetFogLightMap(fog_light_map);
+            mode->SetTransformMatrix(transform_matrix);
+
+    #ifdef RENDER_STATS
+            mode->SetRenderStats(render_stats);
+    #endif
+
+    #ifdef SETUP_BATCH
+            mode->SetSetupBatch(setup_batch, render_mode_count);
+    #endif
+
+            render_modes[render_mode_count++] = mode;
+        }
+
+        //Rasterises the polygons set up so far, then draws the spans every render mode has held back.
+        void FlushRenderModes()
+        {
+            if(setup_render_mode)
+                setup_render_mode->DrawSetupPolygons();
+
+#ifdef DEFERRED_SPANS
+            FlushDeferredSpans();
+#endif
+        }
+
+#ifdef DEFERRED_SPANS
+        void FlushDeferredSpans()
+        {
+            for(unsigned int i = 0; i < render_mode_count; i++)
+            {
+                render_modes[i]->FlushSpans();
+            }
+        }
+#endif
+
+        void DeleteRenderModes()
+        {
+            for(unsigned int i = 0; i < render_mode_count; i++)
+            {
+                delete render_modes[i];
+                render_modes[i] = nullptr;
+            }
+
+            render_mode_count = 0;
+            triangle_render = nullptr;
+            setup_render_mode = nullptr;
+        }
+
+        unsigned int GetVertexOutcode(const V4<fp>& pos) const
+        {
+            using namespace P3D::Internal;
+
+            const fp w = pos.w;
+
+            //Scale x/y down rather than w up so a wide guard band can't overflow.
+            const fp gx = pASR(pos.x, viewport.clip_guard_band_shift);
+            const fp gy = pASR(pos.y, viewport.clip_guard_band_shift);
+
+            unsigned int outcode = NoClip;
+
+            if(w < z_planes.z_near)
+                outcode |= W_Near;
+
+            if(w >= z_planes.z_far)
+                outcode |= W_Far;
+
+            if((w + pos.x) < 0)
+                outcode |= X_W_Left;
+
+            if((w - pos.x) < 0)
+                outcode |= X_W_Right;
+
+            if((w - pos.y) < 0)
+                outcode |= Y_W_Top;
+
+            if((w + pos.y) < 0)
+                outcode |= Y_W_Bottom;
+
+            if((w + gx) < 0)
+                outcode |= (X_W_Left << GUARD_BAND_OUTCODE_SHIFT);
+
+            if((w - gx) < 0)
+                outcode |= (X_W_Right << GUARD_BAND_OUTCODE_SHIFT);
+
+            if((w - gy) < 0)
+                outcode |= (Y_W_Top << GUARD_BAND_OUTCODE_SHIFT);
+
+            if((w + gy) < 0)
+                outcode |= (Y_W_Bottom << GUARD_BAND_OUTCODE_SHIFT);
+
+            return outcode;
+        }
+
+        static unsigned int GetGuardBandShift(const unsigned int width, const unsigned int height)
+        {
+            //A vert on the guard band projects to half_size * (2^shift + 1) pixels from the viewport edge.
+            const unsigned int half_size = pMax(width, height) >> 1;
+
+            unsigned int shift = CLIP_GUARD_BAND_SHIFT;
+
+            while((shift < GUARD_BAND_MAX_SHIFT) && ((half_size * ((2u << shift) + 1)) <= GUARD_BAND_MAX_COORD))
+                shift++;
+
+            return shift;
+        }
+
         void UpdateTransformMatrix()
         {
             transform_matrix = projection_matrix * model_view_matrix_stack.back();
@@ -410,6 +730,37 @@ namespace P3D
             }
         }
 
+        void FillDepth(const z_val depth)
+        {
+            for(unsigned int y = 0; y < render_target->GetHeight(); y++)
+            {
+                z_val* z = &render_target->GetZBuffer()[y * render_target->GetZBufferYPitch()];
+
+                for(unsigned int x = 0; x < render_target->GetWidth(); x++)
+                {
+                    z[x] = depth;
+                }
+            }
+
+            if(render_target->GetHiZBuffer())
+            {
+                const unsigned int tiles = render_target->GetHiZYPitch() * ((render_target->GetHeight() + HI_Z_TILE_SIZE - 1) >> HI_Z_TILE_SHIFT);
+
+                for(unsigned int i = 0; i < tiles; i++)
+                {
+                    render_target->GetHiZBuffer()[i] = depth;
+                }
+            }
+        }
+
+#ifdef DEPTH_EPOCH_CLEAR
+        void SetDepthEpoch(const unsigned int epoch)
+        {
+            render_target->SetDepthEpoch(epoch);
+            viewport.z_bias = fp(int(epoch)) * DEPTH_EPOCH_SPAN;
+        }
+#endif
+
         const RenderTarget* render_target = nullptr;
         P3D::Internal::RenderTargetViewport viewport;
         P3D::Internal::RenderDeviceNearFarPlanes z_planes;
@@ -420,17 +771,27 @@ namespace P3D
         M4<fp> transform_matrix; //P*V*Stack
         std::vector<M4<fp>> model_view_matrix_stack;
 
-        V4<fp>* transformed_vertexes = nullptr;
+        P3D::Internal::TransformedVertex* transformed_vertexes = nullptr;
         unsigned int transformed_vertexes_buffer_count = 0;
 
-        TextureCacheBase* texture_cache = nullptr;
+        TextureCacheBase* texture_cache = nullptr; //Owned. Not to be given to another device.
         const Material* current_material = nullptr;
+        Material default_material;
+        const unsigned char* fog_light_map = nullptr;
+
+        P3D::Internal::RenderTriangleBase* render_modes[RENDER_MODES_MAX] = {};
+        unsigned int render_mode_count = 0;
 
-        P3D::Internal::RenderTriangleBase* triangle_render = nullptr;
+        P3D::Internal::RenderTriangleBase* triangle_render = nullptr; //Current mode.
+        P3D::Internal::RenderTriangleBase* setup_render_mode = nullptr; //Mode with polygons set up and not yet rasterised.
 
 #ifdef RENDER_STATS
         RenderStats render_stats;
 #endif
+
+#ifdef SETUP_BATCH
+        SetupBatch* setup_batch = nullptr; //Not owned.
+#endif
     };
 };
 #endif // RENDERDEVICE_H
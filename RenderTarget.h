@@ -54,6 +54,7 @@ namespace P3D
             return true;
         }
 
+        //z_val is fp, or 16 bits with DEPTH_16. y_pitch is in z_vals.
         bool AttachZBuffer(z_val* buffer = nullptr, unsigned int y_pitch = 0)
         {
             RemoveZBuffer();
@@ -79,9 +80,58 @@ namespace P3D
                 owned_z_buffer = true;
             }
 
+            AttachHiZBuffer();
+
             return true;
         }
 
+        //Colour and depth in one buffer, each colour row followed by its depth row.
+        //A span then reads and writes one stretch of memory rather than two far apart.
+        //Both are drawn to as usual through their pitches. ResolveColorBuffer() copies out a linear image.
+        bool AttachInterleavedBuffers()
+        {
+            const unsigned int w = width, h = height;
+
+            RemoveColorBuffer();
+            RemoveZBuffer();
+
+            if(!w || !h)
+                return false;
+
+            //Rows start word aligned so clears can fill them a word at a time.
+            constexpr unsigned int row_align = (sizeof(z_val) > 4) ? sizeof(z_val) : 4;
+
+            const unsigned int color_bytes = ((w * sizeof(pixel)) + (row_align - 1)) & ~(row_align - 1);
+            const unsigned int z_bytes = ((w * sizeof(z_val)) + (row_align - 1)) & ~(row_align - 1);
+            const unsigned int row_bytes = color_bytes + z_bytes;
+
+            interleaved_buffer = new unsigned char[row_bytes * h];
+
+            unsigned char* base = interleaved_buffer;
+
+            color_buffer = (pixel*)base;
+            color_buffer_y_pitch = row_bytes / sizeof(pixel);
+
+            z_buffer = (z_val*)(base + color_bytes);
+            z_buffer_y_pitch = row_bytes / sizeof(z_val);
+
+            AttachHiZBuffer();
+
+            return true;
+        }
+
+        //Copies the colour buffer to a linear image. dest_y_pitch is in pixels, 0 for width.
+        void ResolveColorBuffer(pixel* dest, unsigned int dest_y_pitch = 0) const
+        {
+            if(dest_y_pitch == 0)
+                dest_y_pitch = width;
+
+            for(unsigned int y = 0; y < height; y++)
+            {
+                FastCopy16((unsigned short*)&dest[y * dest_y_pitch], (const unsigned short*)&color_buffer[y * color_buffer_y_pitch], width * sizeof(pixel));
+            }
+        }
+
         void RemoveZBuffer()
         {
             if(owned_z_buffer)
@@ -89,6 +139,18 @@ namespace P3D
 
             z_buffer = nullptr;
             z_buffer_y_pitch = 0;
+            owned_z_buffer = false;
+
+#ifdef DEPTH_EPOCH_CLEAR
+            depth_epoch = 0;
+#endif
+
+            RemoveInterleavedBuffers();
+
+            delete[] hi_z_buffer;
+
+            hi_z_buffer = nullptr;
+            hi_z_y_pitch = 0;
         }
 
         unsigned int GetWidth() const               {return width;}
@@ -98,7 +160,24 @@ namespace P3D
 
         z_val* GetZBuffer() const                   {return z_buffer;}
         unsigned int GetZBufferYPitch() const       {return z_buffer_y_pitch;}
+
+        //Furthest depth in each HI_Z_TILE_SIZE square tile of the Z-buffer. nullptr without HI_Z.
+        z_val* GetHiZBuffer() const                 {return hi_z_buffer;}
+        unsigned int GetHiZYPitch() const           {return hi_z_y_pitch;}
+
+#ifdef DEPTH_EPOCH_CLEAR
+        //Epoch the depth in the Z-buffer belongs to. Kept here so it lasts across SetRenderTarget() calls.
+        unsigned int GetDepthEpoch() const          {return depth_epoch;}
+
+        //The next RenderDevice::ClearDepth() to the far plane fills the Z-buffer.
+        void ResetDepthEpoch() const                {depth_epoch = 0;}
+#endif
     private:
+        friend class RenderDevice;
+
+#ifdef DEPTH_EPOCH_CLEAR
+        void SetDepthEpoch(unsigned int epoch) const {depth_epoch = epoch;}
+#endif
 
         void RemoveColorBuffer()
         {
@@ -107,6 +186,36 @@ namespace P3D
 
             color_buffer = nullptr;
             owned_color_buffer = false;
+
+            RemoveInterleavedBuffers();
+        }
+
+        //Both buffers go together. The one left behind no longer has anywhere to live.
+        void RemoveInterleavedBuffers()
+        {
+            if(!interleaved_buffer)
+                return;
+
+            delete[] interleaved_buffer;
+            interleaved_buffer = nullptr;
+
+            color_buffer = nullptr;
+            color_buffer_y_pitch = 0;
+
+            z_buffer = nullptr;
+            z_buffer_y_pitch = 0;
+
+#ifdef DEPTH_EPOCH_CLEAR
+            depth_epoch = 0;
+#endif
+        }
+
+        void AttachHiZBuffer()
+        {
+#ifdef HI_Z
+            hi_z_y_pitch = (width + HI_Z_TILE_SIZE - 1) >> HI_Z_TILE_SHIFT;
+            hi_z_buffer = new z_val[hi_z_y_pitch * ((height + HI_Z_TILE_SIZE - 1) >> HI_Z_TILE_SHIFT)];
+#endif
         }
 
         pixel* color_buffer = nullptr;
@@ -117,8 +226,18 @@ namespace P3D
         z_val* z_buffer = nullptr;
         unsigned int z_buffer_y_pitch = 0;
 
+        z_val* hi_z_buffer = nullptr;
+        unsigned int hi_z_y_pitch = 0;
+
         bool owned_color_buffer = false;
         bool owned_z_buffer = false;
+
+        unsigned char* interleaved_buffer = nullptr;
+
+#ifdef DEPTH_EPOCH_CLEAR
+        //Counts down. At 0 the next clear fills the Z-buffer. Changes with the buffer's contents, not the target.
+        mutable unsigned int depth_epoch = 0;
+#endif
     };
 };
 #endif // RENDERTARGET_H
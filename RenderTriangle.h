@@ -5,82 +5,276 @@
 #include "RenderCommon.h"
 #include "TextureCache.h"
 
+#ifdef SETUP_BATCH
+    #include <vector>
+    #include <memory>
+#endif
+
 namespace P3D
 {
     namespace Internal
     {
-        typedef struct TriEdgeTrace
+        //Attributes that render_flags disable take no storage and generate no code.
+        template<const unsigned int render_flags> struct TriEdgeTrace
         {
+            static constexpr bool has_w = (render_flags & (FullPerspectiveMapping | SubdividePerspectiveMapping)) != 0;
+            static constexpr bool has_z = (render_flags & (ZTest | ZWrite)) != 0;
+
             fp x_left, x_right;
             fp u_left;
             fp v_left;
-            fp w_left;
-            fp z_left;
-            fp f_left;
-            fp l_left;
+            [[no_unique_address]] OptionalAttribute<has_w, fp, 0> w_left;
+            [[no_unique_address]] OptionalAttribute<has_z, fp, 1> z_left;
+            [[no_unique_address]] OptionalAttribute<(render_flags & Fog) != 0, fp, 2> f_left;
+            [[no_unique_address]] OptionalAttribute<(render_flags & VertexLight) != 0, fp, 3> l_left;
             pixel* fb_ypos;
-            z_val* zb_ypos;
-        } TriEdgeTrace;
+            [[no_unique_address]] OptionalAttribute<has_z, z_val*, 4> zb_ypos;
+        };
 
-        typedef struct
+        template<const unsigned int render_flags> struct TriDrawXDeltaZWUV
         {
             fp u;
             fp v;
-            fp w;
-            fp z;
-            fp f;
-            fp l;
-        } TriDrawXDeltaZWUV;
+            [[no_unique_address]] OptionalAttribute<TriEdgeTrace<render_flags>::has_w, fp, 0> w;
+            [[no_unique_address]] OptionalAttribute<TriEdgeTrace<render_flags>::has_z, fp, 1> z;
+            [[no_unique_address]] OptionalAttribute<(render_flags & Fog) != 0, fp, 2> f;
+            [[no_unique_address]] OptionalAttribute<(render_flags & VertexLight) != 0, fp, 3> l;
+        };
 
-        typedef struct TriDrawYDeltaZWUV
+        template<const unsigned int render_flags> struct TriDrawYDeltaZWUV
         {
             fp x;
             fp u;
             fp v;
-            fp w;
-            fp z;
-            fp f;
-            fp l;
-        } TriDrawYDeltaZWUV;
+            [[no_unique_address]] OptionalAttribute<TriEdgeTrace<render_flags>::has_w, fp, 0> w;
+            [[no_unique_address]] OptionalAttribute<TriEdgeTrace<render_flags>::has_z, fp, 1> z;
+            [[no_unique_address]] OptionalAttribute<(render_flags & Fog) != 0, fp, 2> f;
+            [[no_unique_address]] OptionalAttribute<(render_flags & VertexLight) != 0, fp, 3> l;
+        };
+
+        //Integer edge stepper on sub-pixel screen coords. Steps a scanline with adds and a compare.
+        struct TriEdgeDDA
+        {
+            int x;              //First column whose pixel centre is on or right of the edge.
+            int x_step;         //Whole columns stepped per scanline.
+            int error;          //Distance from the edge to the centre of column x. In [0, error_adjust).
+            int error_step;     //Fraction of a column stepped per scanline. Scaled by error_adjust.
+            int error_adjust;   //One column.
+        };
+
+        //The Hi-Z tile row a polygon is walking down, and the columns it has covered on every scanline of it.
+        //z along a scanline is z0 + (dz * x). z0_max is the furthest z0 of the scanlines so far.
+        struct HiZTileRow
+        {
+            int tile_row = -1;
+            int rows = 0;
+            int x_left, x_right;
+            fp z0_max;
+        };
+
+        //A polygon the geometry phase has clipped, projected and culled, waiting for the raster phase.
+        //Its verts are held apart from it, in order around the outline.
+        template<const unsigned int render_flags> struct PolygonSetup
+        {
+            TriDrawXDeltaZWUV<render_flags> x_delta;
+            [[no_unique_address]] OptionalAttribute<TriEdgeTrace<render_flags>::has_w, TriDrawXDeltaZWUV<render_flags>, 0> face_y_delta;
+            const pixel* texture; //Not yet looked up in the texture cache.
+            [[no_unique_address]] OptionalAttribute<(render_flags & AlphaTest) != 0, const unsigned char*, 1> alpha_skip;
+            unsigned short first_vertex;
+            unsigned char vertex_count;
+            unsigned char top, bottom, widest;
+            pixel color;
+            bool widest_is_right;
+            bool column_major;
+            bool subdivide_spans;
+            bool constant_w_spans;
+            bool face_gradients;
+        };
+
+#ifdef DEFERRED_SPANS
+        //A span rasterised but not yet drawn, and the state of its polygon that drawing it reads.
+        template<const unsigned int render_flags> struct DeferredSpan
+        {
+            TriEdgeTrace<render_flags> pos;
+            TriDrawXDeltaZWUV<render_flags> delta;
+            const pixel* texture;
+            [[no_unique_address]] OptionalAttribute<(render_flags & AlphaTest) != 0, const unsigned char*, 0> alpha_skip;
+            pixel color;
+            bool column;
+            bool subdivide_spans;
+            bool constant_w_spans;
+        };
+#endif
+
+#ifdef SETUP_BATCH
+        //Setup buffers of one render mode, recorded into a SetupBatch.
+        class SetupBatchModeBase
+        {
+        public:
+            virtual ~SetupBatchModeBase() {};
+            virtual void Clear() = 0;
+
+            unsigned int render_flags = 0; //Of the mode that recorded them.
+        };
+
+        template<const unsigned int flags> class SetupBatchMode final : public SetupBatchModeBase
+        {
+        public:
+            SetupBatchMode() { render_flags = flags; }
+
+            void Clear() override { polygons.clear(); vertexes.clear(); }
+
+            std::vector<PolygonSetup<flags>> polygons;
+            std::vector<Vertex4d<flags>> vertexes;
+        };
+
+        //One setup buffer. first_vertex of its polygons counts from vertex_offset.
+        struct SetupBatchRun
+        {
+            unsigned int mode;
+            unsigned int polygon_offset;
+            unsigned int polygon_count;
+            unsigned int vertex_offset;
+        };
+
+        //A texture given to RenderDevice::SetMaterial() while recording. Added to the drawing device's cache
+        //before the run it was recorded ahead of.
+        struct SetupBatchTexture
+        {
+            const pixel* pixels;
+            signed char importance;
+            unsigned int run;
+        };
+
+        template<const unsigned int render_flags, class TPixelShader> class RenderTriangle;
+#endif
+    };
+
+#ifdef SETUP_BATCH
+    //Polygons a RenderDevice has taken through the geometry phase, for RenderDevice::DrawSetupBatch() to rasterise.
+    //The device drawing it may be on another thread. It needs the same render modes, viewport size, z planes and fog
+    //as the one that recorded it. Textures are added to and looked up in the drawing device's texture cache.
+    class SetupBatch
+    {
+    public:
+        SetupBatch() = default;
+
+        SetupBatch(const SetupBatch&) = delete;
+        SetupBatch& operator=(const SetupBatch&) = delete;
+
+        //Keeps the memory for the next frame.
+        void Clear()
+        {
+            runs.clear();
+            textures.clear();
+
+            for(std::unique_ptr<Internal::SetupBatchModeBase>& mode : modes)
+            {
+                if(mode)
+                    mode->Clear();
+            }
+        }
+
+    private:
+        friend class RenderDevice;
+        template<const unsigned int, class> friend class Internal::RenderTriangle;
 
+        std::unique_ptr<Internal::SetupBatchModeBase> modes[RENDER_MODES_MAX];
+
+        //In the order they are to be drawn.
+        std::vector<Internal::SetupBatchRun> runs;
+
+        //In the order they were given.
+        std::vector<Internal::SetupBatchTexture> textures;
+    };
+#endif
+
+    namespace Internal
+    {
         class RenderTriangleBase
         {
         public:
 
             virtual ~RenderTriangleBase() {};
-            virtual void DrawTriangle(TransformedTriangle& tri, const Material& material) = 0;
+
+            //Geometry phase. Clips, projects and culls the polygon and sets it up to be rasterised.
+            virtual void DrawPolygon(TransformedPolygon& poly, const Material& material) = 0;
+
+            //Raster phase. Draws the polygons set up so far, in the order they were set up.
+            virtual void DrawSetupPolygons() = 0;
+
             virtual void SetRenderStateViewport(const RenderTargetViewport& viewport) = 0;
             virtual void SetZPlanes(const RenderDeviceNearFarPlanes& planes) = 0;
             virtual void SetTextureCache(const TextureCacheBase* texture_cache) = 0;
             virtual void SetFogParams(const RenderDeviceFogParameters& fog_params) = 0;
             virtual void SetFogLightMap(const unsigned char* fog_light_map) = 0;
+            virtual void SetTransformMatrix(const M4<fp>& matrix) = 0;
 
 #ifdef RENDER_STATS
             virtual void SetRenderStats(RenderStats& render_stats) = 0;
 #endif
+
+#ifdef DEFERRED_SPANS
+            virtual bool DefersSpans() const = 0;
+            virtual void FlushSpans() = 0;
+#endif
+
+#ifdef SETUP_BATCH
+            //Setup buffers go to the end of batch instead of being rasterised. nullptr rasterises them again.
+            virtual void SetSetupBatch(SetupBatch* batch, unsigned int mode) = 0;
+
+            //Raster phase for one run of a batch. Runs recorded with other render flags are skipped.
+            virtual void DrawSetupBatchRun(const SetupBatch& batch, const SetupBatchRun& run) = 0;
+#endif
         };
 
         template<const unsigned int render_flags, class TPixelShader> class RenderTriangle final : public RenderTriangleBase
         {
         public:
-            void no_inline DrawTriangle(TransformedTriangle& tri, const Material& material) override
+            void no_inline DrawPolygon(TransformedPolygon& poly, const Material& material) override
             {
+                //Make room for the most verts clipping can leave.
+                if((setup_polygon_count == SETUP_BUFFER_POLYGONS) || ((setup_vertex_count + CLIP_POLYGON_MAX_VERTS) > SETUP_BUFFER_VERTS))
+                    DrawSetupPolygons();
 
-#ifdef RENDER_STATS
-                render_stats->triangles_submitted++;
-#endif
-
+                //Until it is rasterised this only says the polygon is textured.
                 if(material.type == Material::Texture)
-                    current_texture = tex_cache->GetTexture(material.pixels);
+                    current_texture = material.pixels;
                 else
                 {
                     current_texture = nullptr;
                     current_color = material.color;
                 }
 
+                if constexpr (render_flags & AlphaTest)
+                {
+                    current_alpha_skip = (current_texture && material.alpha) ? material.alpha_skip : nullptr;
+                }
+
+                //Vertex pool for clipping. Input verts first, clipping appends new verts after them.
+                Vertex4d<render_flags> verts[CLIP_VERTEX_POOL_SIZE];
+
+                //Indexes into verts of the (possibly clipped) polygon.
+                unsigned char polygon[CLIP_POLYGON_MAX_VERTS];
+
+                for(unsigned int i = 0; i < poly.vertex_count; i++)
+                {
+                    polygon[i] = i;
+
+                    verts[i].pos = poly.verts[i]->pos;
+
+                    if(current_texture)
+                        verts[i].uv = poly.uvs[i];
+
+                    if constexpr (render_flags & VertexLight)
+                    {
+                        verts[i].light_factor = poly.light_levels ? pClamp(fp(0), fp(1) - poly.light_levels[i], LIGHT_MAX) : fp(0);
+                    }
+                }
+
                 if constexpr (render_flags & (SubdividePerspectiveMapping))
                 {
-                    subdivide_spans = (GetZDelta(tri.verts) > SUBDIVIDE_Z_THREASHOLD);
+                    subdivide_spans = (GetZDelta(verts, poly.vertex_count) > SUBDIVIDE_Z_THREASHOLD);
 /*
                     if(!subdivide_spans)
                     {
@@ -90,34 +284,44 @@ namespace P3D
 */
                 }
 
-                unsigned int vxCount = ClipTriangle(tri);
+                unsigned int vxCount = ClipPolygon(verts, poly.vertex_count, poly.outcodes, polygon);
 
                 if(vxCount < 3)
                     return;
 
                 for(unsigned int i = 0; i < vxCount; i++)
                 {
-                    tri.verts[i].pos.ToScreenSpace();
+                    ToScreenSpace(verts[polygon[i]].pos);
                 }
 
-                if(!CullTriangle(tri.verts))
+                if(!CullPolygon(verts, polygon, vxCount))
                     return;
 
+                if constexpr (render_flags & (FullPerspectiveMapping | SubdividePerspectiveMapping))
+                {
+                    face_gradients = false;
+
+                    if(current_texture && poly.texture_axes && ((render_flags & FullPerspectiveMapping) || subdivide_spans))
+                        face_gradients = GetFaceTextureGradients(verts, polygon, vxCount, poly.texture_axes);
+                }
+
                 for(unsigned int i = 0; i < vxCount; i++)
                 {
-                    tri.verts[i].pos.x = fracToX(tri.verts[i].pos.x);
-                    tri.verts[i].pos.y = fracToY(tri.verts[i].pos.y);
+                    Vertex4d<render_flags>& v = verts[polygon[i]];
+
+                    v.pos.x = fracToX(v.pos.x);
+                    v.pos.y = fracToY(v.pos.y);
 
                     if constexpr (render_flags & Fog)
                     {
-                        tri.verts[i].fog_factor = GetFogFactor(tri.verts[i].pos);
+                        v.fog_factor = GetFogFactor(v.pos);
                     }
 
                     if constexpr (render_flags & FullPerspectiveMapping)
                     {
                         if(current_texture)
                         {
-                            tri.verts[i].toPerspectiveCorrect(max_w_tex_scale);
+                            v.toPerspectiveCorrect(max_w_tex_scale);
                         }
                     }
 
@@ -125,14 +329,93 @@ namespace P3D
                     {
                         if(current_texture && subdivide_spans)
                         {
-                            tri.verts[i].toPerspectiveCorrect(max_w_tex_scale);
+                            v.toPerspectiveCorrect(max_w_tex_scale);
                         }
                     }
                 }
 
-                TriangulatePolygon(tri.verts, vxCount);
+                if constexpr (render_flags & (FullPerspectiveMapping | SubdividePerspectiveMapping))
+                {
+                    constant_w_spans = false;
+
+#if defined(WALL_COLUMNS) || defined(FLOOR_SPANS)
+                    fp dwdx, dwdy, w_min, width, height;
+
+                    if(current_texture && ((render_flags & FullPerspectiveMapping) || subdivide_spans) && GetWGradients(verts, polygon, vxCount, dwdx, dwdy, w_min, width, height))
+                    {
+#ifdef WALL_COLUMNS
+                        //Walls seen by a level camera. w is constant down each column.
+                        if(IsConstantW(dwdy, w_min, height))
+                        {
+                            //Walk it transposed so scanlines become screen columns.
+                            for(unsigned int i = 0; i < vxCount; i++)
+                            {
+                                V4<fp>& pos = verts[polygon[i]].pos;
+                                std::swap(pos.x, pos.y);
+                            }
+
+                            std::swap(face_x_delta, face_y_delta);
+
+                            AddPolygonSetup<true>(verts, polygon, vxCount);
+                            return;
+                        }
+#endif
+
+#ifdef FLOOR_SPANS
+                        //Floors and ceilings under a camera without roll. w is constant along each scanline.
+                        constant_w_spans = IsConstantW(dwdx, w_min, width);
+#endif
+                    }
+#endif
+                }
+
+                AddPolygonSetup<false>(verts, polygon, vxCount);
             }
 
+            void no_inline DrawSetupPolygons() override
+            {
+#ifdef SETUP_BATCH
+                if(setup_batch)
+                {
+                    RecordSetupPolygons();
+                    return;
+                }
+#endif
+
+                for(unsigned int i = 0; i < setup_polygon_count; i++)
+                {
+                    DrawSetupPolygon(setup_polygons[i], setup_vertexes);
+                }
+
+                setup_polygon_count = 0;
+                setup_vertex_count = 0;
+            }
+
+#ifdef SETUP_BATCH
+            void SetSetupBatch(SetupBatch* batch, unsigned int mode) override
+            {
+                setup_batch = batch;
+                setup_batch_mode = mode;
+            }
+
+            void no_inline DrawSetupBatchRun(const SetupBatch& batch, const SetupBatchRun& run) override
+            {
+                const SetupBatchModeBase* recorded = batch.modes[run.mode].get();
+
+                if(!recorded || (recorded->render_flags != render_flags))
+                    return;
+
+                const SetupBatchMode<render_flags>* storage = static_cast<const SetupBatchMode<render_flags>*>(recorded);
+
+                const Vertex4d<render_flags>* vertexes = &storage->vertexes[run.vertex_offset];
+
+                for(unsigned int i = 0; i < run.polygon_count; i++)
+                {
+                    DrawSetupPolygon(storage->polygons[run.polygon_offset + i], vertexes);
+                }
+            }
+#endif
+
             void SetRenderStateViewport(const RenderTargetViewport& viewport) override
             {
                 current_viewport = &viewport;
@@ -172,6 +455,11 @@ namespace P3D
                 this->fog_light_map = fog_light_map;
             }
 
+            void SetTransformMatrix(const M4<fp>& matrix) override
+            {
+                transform_matrix = &matrix;
+            }
+
 
 #ifdef RENDER_STATS
             void SetRenderStats(RenderStats& stats) override
@@ -180,14 +468,80 @@ namespace P3D
             }
 #endif
 
+#ifdef DEFERRED_SPANS
+            bool DefersSpans() const override
+            {
+                return defer_spans;
+            }
+
+            //Draws the spans held back, grouped by texture. Within a texture they keep the order they were rasterised in.
+            void no_inline FlushSpans() override
+            {
+                if constexpr (defer_spans)
+                {
+                    if(!deferred_span_count)
+                        return;
+
+                    for(unsigned int i = 0; i < deferred_span_count; i++)
+                        deferred_order[i] = i;
+
+                    std::sort(deferred_order, deferred_order + deferred_span_count, [this](const unsigned short a, const unsigned short b)
+                    {
+                        const size_t ta = (size_t)deferred_spans[a].texture;
+                        const size_t tb = (size_t)deferred_spans[b].texture;
+
+                        return (ta != tb) ? (ta < tb) : (a < b);
+                    });
+
+                    //May be part way through a polygon that ran out of room.
+                    const pixel* texture = current_texture;
+                    const pixel color = current_color;
+                    const unsigned char* alpha_skip = current_alpha_skip;
+                    const bool subdivide = subdivide_spans;
+                    const bool constant_w = constant_w_spans;
+
+                    for(unsigned int i = 0; i < deferred_span_count; i++)
+                    {
+                        DeferredSpan<render_flags>& span = deferred_spans[deferred_order[i]];
+
+                        current_texture = span.texture;
+                        current_color = span.color;
+                        current_alpha_skip = span.alpha_skip;
+                        subdivide_spans = span.subdivide_spans;
+                        constant_w_spans = span.constant_w_spans;
+
+                        //Only perspective modes walk polygons in columns.
+                        if constexpr (TriEdgeTrace<render_flags>::has_w)
+                        {
+                            if(span.column)
+                            {
+                                DrawColumnPixels(span.pos, span.delta);
+                                continue;
+                            }
+                        }
+
+                        DrawSpanPixels(span.pos, span.delta);
+                    }
+
+                    current_texture = texture;
+                    current_color = color;
+                    current_alpha_skip = alpha_skip;
+                    subdivide_spans = subdivide;
+                    constant_w_spans = constant_w;
+
+                    deferred_span_count = 0;
+                }
+            }
+#endif
+
 
         private:
 
-            bool no_inline CullTriangle(const Vertex4d screenSpacePoints[3]) const
+            bool no_inline CullPolygon(const Vertex4d<render_flags> verts[], const unsigned char polygon[], const unsigned int vxCount) const
             {
                 if constexpr (render_flags & (BackFaceCulling | FrontFaceCulling))
                 {
-                    const bool is_front = IsTriangleFrontface(screenSpacePoints);
+                    const bool is_front = IsPolygonFrontface(verts, polygon, vxCount);
 
                     if constexpr(render_flags & BackFaceCulling)
                     {
@@ -202,493 +556,1047 @@ namespace P3D
                 }
                 else
                 {
-                    if  (
-                        screenSpacePoints[0].pos.x == screenSpacePoints[1].pos.x &&
-                        screenSpacePoints[0].pos.x == screenSpacePoints[2].pos.x
-                        ) [[unlikely]]
-                        return false;
+                    const V4<fp>& p0 = verts[polygon[0]].pos;
+
+                    bool same_x = true, same_y = true;
 
-                    if  (
-                        screenSpacePoints[0].pos.y == screenSpacePoints[1].pos.y &&
-                        screenSpacePoints[0].pos.y == screenSpacePoints[2].pos.y
-                        ) [[unlikely]]
+                    for(unsigned int i = 1; i < vxCount; i++)
+                    {
+                        same_x &= (verts[polygon[i]].pos.x == p0.x);
+                        same_y &= (verts[polygon[i]].pos.y == p0.y);
+                    }
+
+                    if(same_x || same_y) [[unlikely]]
                         return false;
                 }
 
                 return true;
             }
 
-            unsigned int no_inline ClipTriangle(TransformedTriangle& clipSpacePoints) const
+            unsigned int no_inline ClipPolygon(Vertex4d<render_flags> clipSpacePoints[CLIP_VERTEX_POOL_SIZE], const unsigned int inCount, const unsigned int outcodes, unsigned char polygon[CLIP_POLYGON_MAX_VERTS]) const
             {
-                fp z_far = z_planes->z_far;
-                fp z_near = z_planes->z_near;
-                unsigned int clip = 0;
-
-
-                fp w0 = clipSpacePoints.verts[0].pos.w;
-                fp w1 = clipSpacePoints.verts[1].pos.w;
-                fp w2 = clipSpacePoints.verts[2].pos.w;
-
-                if(pAllGTEqZ3(w0 - z_far, w1 - z_far, w2 - z_far))
-                    return 0; //One or more outside far plane. Reject
+                //Trivial rejects have already been done on the vertex outcodes.
+                //Only need to clip to X/Y planes that a vertex is outside the guard band of.
 
-                if(pAllLTZ3(w0 - z_near, w1 - z_near, w2 - z_near))
-                    return 0; //All outside near plane. Reject
-                else if (!pAllGTEqZ3(w0 - z_near, w1 - z_near, w2 - z_near))
-                    clip = W_Near; //Intersects near plane
+                const unsigned int clip = (outcodes & W_Near) | ((outcodes >> GUARD_BAND_OUTCODE_SHIFT) & XY_CLIP_PLANES);
 
-                //
-                for(unsigned int i = X_W_Left; i < W_Far; i <<= 1)
+                if (clip == NoClip)
                 {
-                    ClipOperation op = GetClipOperation(clipSpacePoints.verts, ClipPlane(i));
-
-                    if(op == Reject)
-                        return 0;
-                    else if(op == Clip)
-                        clip |= i;
+#ifdef RENDER_STATS
+                    if(outcodes & XY_CLIP_PLANES)
+                        render_stats->triangles_guard_band++;
+#endif
+                    return inCount;
                 }
 
-                if (clip == NoClip)
-                    return 3;
-
 #ifdef RENDER_STATS
                 render_stats->triangles_clipped++;
 #endif
 
-                unsigned int vxCount = 3;
-
-                if(clip & W_Near)
-                    vxCount = ClipWNear(clipSpacePoints.verts);
+                //Verts are never moved. Each plane reads one index list and writes the other.
+                //Only verts created on a plane edge are written to, appended to the pool.
+                unsigned char polygonB[CLIP_POLYGON_MAX_VERTS];
 
-                Vertex4d outputVxB[8];
+                unsigned char* inPolygon = polygon;
+                unsigned char* outPolygon = polygonB;
 
-                //As we clip against each frustrum plane, we swap the buffers
-                //so the output of the last clip is used as input to the next.
-                Vertex4d* inBuffer = clipSpacePoints.verts;
-                Vertex4d* outBuffer = outputVxB;
+                unsigned int vxCount = inCount;
+                unsigned int poolCount = inCount;
 
-                for(unsigned int i = X_W_Left; i < W_Far; i <<= 1)
+                for(unsigned int i = W_Near; i < W_Far; i <<= 1)
                 {
                     if(clip & i)
                     {
-                        vxCount = ClipPolygonToPlane(inBuffer, vxCount, outBuffer, ClipPlane(i));
+                        vxCount = ClipPolygonToPlane(clipSpacePoints, poolCount, inPolygon, vxCount, outPolygon, ClipPlane(i));
 
                         if(vxCount == 0)
                             return 0;
 
-                        std::swap(inBuffer, outBuffer);
+                        std::swap(inPolygon, outPolygon);
                     }
                 }
 
-                //Now inBuffer and countA contain the final result.
-                if(inBuffer != clipSpacePoints.verts)
-                    FastCopy32(clipSpacePoints.verts, inBuffer, sizeof(Vertex4d) * vxCount);
+                if(inPolygon != polygon)
+                {
+                    for(unsigned int i = 0; i < vxCount; i++)
+                        polygon[i] = inPolygon[i];
+                }
 
                 return vxCount;
             }
 
-            unsigned int no_inline ClipWNear(Vertex4d clipSpacePointsIn[3]) const
+            unsigned int no_inline ClipPolygonToPlane(Vertex4d<render_flags> pool[], unsigned int& poolCount, const unsigned char polygonIn[], const unsigned int vxCount, unsigned char polygonOut[], const ClipPlane clipPlane) const
             {
-                Vertex4d tmpVx[4];
+                fp distance[CLIP_POLYGON_MAX_VERTS];
+
+                for(unsigned int i = 0; i < vxCount; i++)
+                    distance[i] = GetClipDistance(pool[polygonIn[i]], clipPlane);
+
                 unsigned int vxCountOut = 0;
-                fp z_near = z_planes->z_near;
 
-                for(int i = 0; i < 3; i++)
+                for(unsigned int i = 0; i < vxCount; i++)
                 {
-                    int i2 = i < 2 ? i+1 : 0;
+                    const unsigned int i2 = (i < (vxCount-1)) ? i+1 : 0;
 
-                    fp w1 = clipSpacePointsIn[i].pos.w;
-                    fp w2 = clipSpacePointsIn[i2].pos.w;
+                    const fp d1 = distance[i];
+                    const fp d2 = distance[i2];
 
-                    if(w1 >= z_near)
-                    {
-                        FastCopy32(&tmpVx[vxCountOut], &clipSpacePointsIn[i], sizeof(Vertex4d));
-                        vxCountOut++;
-                    }
+                    if(d1 >= 0)
+                        polygonOut[vxCountOut++] = polygonIn[i];
 
-                    if(!pSameSignBit(w1 - z_near, w2 - z_near))
+                    if(!pSameSignBit(d1, d2))
                     {
-                        fp frac = (w1 - z_near) / (w1 - w2);
+                        const fp frac = d1 / (d1 - d2);
 
-                        LerpVertex(tmpVx[vxCountOut], clipSpacePointsIn[i], clipSpacePointsIn[i2], frac);
-                        vxCountOut++;
+                        LerpVertex(pool[poolCount], pool[polygonIn[i]], pool[polygonIn[i2]], frac);
+                        polygonOut[vxCountOut++] = poolCount++;
                     }
                 }
 
-                FastCopy32(clipSpacePointsIn, tmpVx, sizeof(Vertex4d) * vxCountOut);
-
                 return vxCountOut;
             }
 
-            unsigned int no_inline ClipPolygonToPlane(const Vertex4d clipSpacePointsIn[], const int vxCount, Vertex4d clipSpacePointsOut[], ClipPlane clipPlane) const
+            fp GetClipDistance(const Vertex4d<render_flags>& vertex, const ClipPlane clipPlane) const
             {
-                unsigned int vxCountOut = 0;
+                if(clipPlane == W_Near)
+                    return vertex.pos.w - z_planes->z_near;
+
+                //Guard band planes. x/y are scaled down to compare against w.
+                const unsigned int shift = current_viewport->clip_guard_band_shift;
+
+                if(clipPlane == X_W_Left)
+                    return vertex.pos.w + pASR(vertex.pos.x, shift);
+                else if(clipPlane == X_W_Right)
+                    return vertex.pos.w - pASR(vertex.pos.x, shift);
+                else if(clipPlane == Y_W_Top)
+                    return vertex.pos.w - pASR(vertex.pos.y, shift);
+
+                return vertex.pos.w + pASR(vertex.pos.y, shift);
+            }
+
+            //The top and bottom verts split the outline into a left and a right chain.
+            //The vert furthest from the top to bottom line gives the widest span. widest_side is 0 if there's no area.
+            void no_inline GetPolygonExtents(const Vertex4d<render_flags> verts[], const unsigned char polygon[], const unsigned int vxCount, unsigned int& top, unsigned int& bottom, unsigned int& widest, fp& widest_side) const
+            {
+                top = 0, bottom = 0;
 
-                for(int i = 0; i < vxCount; i++)
+                for(unsigned int i = 1; i < vxCount; i++)
                 {
-                    int i2 = (i < (vxCount-1)) ? i+1 : 0;
+                    const fp y = verts[polygon[i]].pos.y;
 
-                    const fp b1 = GetClipPointForVertex(clipSpacePointsIn[i], clipPlane);
-                    const fp b2 = GetClipPointForVertex(clipSpacePointsIn[i2], clipPlane);
+                    if(y < verts[polygon[top]].pos.y)
+                        top = i;
 
-                    if(ClipW(clipSpacePointsIn[i].pos.w) >= b1)
-                    {
-                        FastCopy32(&clipSpacePointsOut[vxCountOut], &clipSpacePointsIn[i], sizeof(Vertex4d));
-                        vxCountOut++;
-                    }
+                    if(y > verts[polygon[bottom]].pos.y)
+                        bottom = i;
+                }
+
+                const V4<fp>& top_pos = verts[polygon[top]].pos;
+                const V4<fp>& bottom_pos = verts[polygon[bottom]].pos;
 
-                    fp frac = GetLineIntersectionFrac(ClipW(clipSpacePointsIn[i].pos.w), ClipW(clipSpacePointsIn[i2].pos.w), b1, b2);
+                widest = top;
+                widest_side = 0;
 
-                    if(frac >= 0)
+                for(unsigned int i = 0; i < vxCount; i++)
+                {
+                    const fp side = PointOnLineSide2d(top_pos, bottom_pos, verts[polygon[i]].pos);
+
+                    if(pAbs(side) > pAbs(widest_side))
                     {
-                        LerpVertex(clipSpacePointsOut[vxCountOut], clipSpacePointsIn[i], clipSpacePointsIn[i2], frac);
-                        vxCountOut++;
+                        widest = i;
+                        widest_side = side;
                     }
                 }
-
-                return vxCountOut;
             }
 
-            fp GetClipPointForVertex(const Vertex4d& vertex, const ClipPlane clipPlane) const
+            //Screen space gradients of the perspective corrected w, its smallest value and the polygon's screen size.
+            //False if the polygon has no area.
+            bool no_inline GetWGradients(const Vertex4d<render_flags> verts[], const unsigned char polygon[], const unsigned int vxCount, fp& dwdx, fp& dwdy, fp& w_min, fp& width, fp& height) const
             {
-                if(clipPlane == X_W_Left)
-                    return -vertex.pos.x;
-                else if(clipPlane == X_W_Right)
-                    return vertex.pos.x;
-                else if(clipPlane == Y_W_Top)
-                    return vertex.pos.y;
+                unsigned int top, bottom, widest;
+                fp widest_side;
 
-                return -vertex.pos.y;
-            }
+                GetPolygonExtents(verts, polygon, vxCount, top, bottom, widest, widest_side);
 
-            ClipOperation no_inline GetClipOperation(const Vertex4d vertexes[3], const ClipPlane plane) const
-            {
-                fp w0 = vertexes[0].pos.w;
-                fp w1 = vertexes[1].pos.w;
-                fp w2 = vertexes[2].pos.w;
+                if(widest_side == 0)
+                    return false;
 
-                fp p0 = GetClipPointForVertex(vertexes[0], plane);
-                fp p1 = GetClipPointForVertex(vertexes[1], plane);
-                fp p2 = GetClipPointForVertex(vertexes[2], plane);
+                const V4<fp>& t = verts[polygon[top]].pos;
+                const V4<fp>& b = verts[polygon[bottom]].pos;
 
-                fp d0 = w0 - p0;
-                fp d1 = w1 - p1;
-                fp d2 = w2 - p2;
+                if(HasFaceGradients())
+                {
+                    dwdx = face_x_delta.w;
+                    dwdy = face_y_delta.w;
+                }
+                else
+                {
+                    const V4<fp>& wd = verts[polygon[widest]].pos;
 
-                if(pAllLTZ3(d0, d1, d2))
-                    return Reject;
+                    const fp frac = (wd.y - t.y) / (b.y - t.y);
 
-                d0 = ClipW(w0) - p0;
-                d1 = ClipW(w1) - p1;
-                d2 = ClipW(w2) - p2;
+                    dwdx = (wd.w - pLerp(t.w, b.w, frac)) / (wd.x - pLerp(t.x, b.x, frac));
+                    dwdy = ((b.w - t.w) - ((b.x - t.x) * dwdx)) / (b.y - t.y);
+                }
 
-                if(pAllGTEqZ3(d0, d1, d2))
-                    return Accept;
+                fp x_min = t.x, x_max = t.x;
+                w_min = t.w;
 
-                return Clip;
-            }
+                for(unsigned int i = 0; i < vxCount; i++)
+                {
+                    const V4<fp>& p = verts[polygon[i]].pos;
 
-            fp no_inline GetLineIntersectionFrac(const fp a1, const fp a2, const fp b1, const fp b2) const
-            {
-                fp diff1 = a1 - b1;
-                fp diff2 = a2 - b2;
+                    w_min = pMin(w_min, p.w);
+                    x_min = pMin(x_min, p.x);
+                    x_max = pMax(x_max, p.x);
+                }
 
-                if(pSameSignBit(diff1, diff2))
-                    return -1;
+                width = pMin(x_max - x_min, fp((int)current_viewport->width));
+                height = pMin(b.y - t.y, fp((int)current_viewport->height));
 
-                fp cp = (diff1 - a2 + b2);
-                return (diff1 / cp);
+                return true;
             }
 
-            inline constexpr fp ClipW(const fp w) const
+            //Holding w constant over a run of len pixels misplaces texels by up to about (len^2 / 4) * |dw / w| pixels.
+            static constexpr bool IsConstantW(const fp dw, const fp w_min, const fp len)
             {
-                return pASL(w, CLIP_GUARD_BAND_SHIFT);
+                return pAbs(dw) <= (((w_min / len) * (SUBDIVIDE_MAX_ERROR * 4)) / len);
             }
 
-            void no_inline GetVertexYOrder(const Vertex4d screenSpacePoints[3], unsigned int vxOrder[3]) const
+            //With column_major the verts have x and y swapped. Scanlines are then screen columns.
+            //The last of the geometry phase. Finds the polygon's extents and gradients and copies it to the setup buffer.
+            template<bool column_major> void no_inline AddPolygonSetup(const Vertex4d<render_flags> verts[], const unsigned char polygon[], const unsigned int vxCount)
             {
-                if(screenSpacePoints[vxOrder[0]].pos.y > screenSpacePoints[vxOrder[2]].pos.y)
-                    std::swap(vxOrder[0], vxOrder[2]);
+                unsigned int top, bottom, widest;
+                fp widest_side;
 
-                if(screenSpacePoints[vxOrder[0]].pos.y > screenSpacePoints[vxOrder[1]].pos.y)
-                    std::swap(vxOrder[0], vxOrder[1]);
+                GetPolygonExtents(verts, polygon, vxCount, top, bottom, widest, widest_side);
 
-                if(screenSpacePoints[vxOrder[1]].pos.y > screenSpacePoints[vxOrder[2]].pos.y)
-                    std::swap(vxOrder[1], vxOrder[2]);
-            }
+                //No area.
+                if(widest_side == 0)
+                    return;
 
-            void no_inline TriangulatePolygon(Vertex4d clipSpacePoints[], const int vxCount) const
-            {
-                DrawTriangleEdge(clipSpacePoints);
+                PolygonSetup<render_flags>& setup = setup_polygons[setup_polygon_count++];
 
-                const int rounds = vxCount - 3;
+                const Vertex4d<render_flags>& vx_top = verts[polygon[top]];
+                const Vertex4d<render_flags>& vx_bottom = verts[polygon[bottom]];
+                const Vertex4d<render_flags>& vx_widest = verts[polygon[widest]];
 
-                for(int i = 0; i < rounds; i++)
+                setup.widest_is_right = widest_side > 0;
+
+                const fp frac = ((vx_widest.pos.y - vx_top.pos.y) / (vx_bottom.pos.y - vx_top.pos.y));
+
+                Vertex4d<render_flags> m;
+                LerpVertex(m, vx_top, vx_bottom, frac);
+
+                if(setup.widest_is_right)
                 {
-                    FastCopy32(&clipSpacePoints[i+1], &clipSpacePoints[0], sizeof(Vertex4d));
+                    GetTriangleLerpXDeltas(m, vx_widest, setup.x_delta);
+                }
+                else
+                {
+                    GetTriangleLerpXDeltas(vx_widest, m, setup.x_delta);
+                }
+
+                setup.first_vertex = setup_vertex_count;
+                setup.vertex_count = vxCount;
+                setup.top = top;
+                setup.bottom = bottom;
+                setup.widest = widest;
 
-                    DrawTriangleEdge(&clipSpacePoints[i+1]);
+                for(unsigned int i = 0; i < vxCount; i++)
+                {
+                    setup_vertexes[setup_vertex_count++] = verts[polygon[i]];
                 }
+
+                setup.texture = current_texture;
+                setup.alpha_skip = current_alpha_skip;
+                setup.color = current_color;
+                setup.column_major = column_major;
+                setup.subdivide_spans = subdivide_spans;
+                setup.constant_w_spans = constant_w_spans;
+                setup.face_gradients = face_gradients;
+                setup.face_y_delta = face_y_delta;
             }
 
-            void no_inline DrawTriangleEdge(const Vertex4d points[3]) const
+            //Raster phase for one polygon. Puts back the state the geometry phase left for it.
+            void no_inline DrawSetupPolygon(const PolygonSetup<render_flags>& setup, const Vertex4d<render_flags> vertexes[])
             {
-
-#ifdef RENDER_STATS
-                render_stats->triangles_drawn++;
+#ifdef DEFERRED_SPANS
+                if constexpr (defer_spans)
+                {
+                    //Make room for a span on every row of the viewport.
+                    if((deferred_span_count + pMax(current_viewport->width, current_viewport->height)) > DEFERRED_SPAN_MAX)
+                        FlushSpans();
+                }
 #endif
 
-                TriEdgeTrace pos;
-                TriDrawYDeltaZWUV y_delta_left, y_delta_right;
-                TriDrawXDeltaZWUV x_delta;
+                current_texture = setup.texture ? tex_cache->GetTexture(setup.texture) : nullptr;
+                current_color = setup.color;
+                current_alpha_skip = setup.alpha_skip;
+                subdivide_spans = setup.subdivide_spans;
+                constant_w_spans = setup.constant_w_spans;
+                face_gradients = setup.face_gradients;
 
-                unsigned int vxOrder[3] = {0,1,2};
+                //With face gradients x_delta holds the face's u, v and w gradients across x.
+                face_x_delta = setup.x_delta;
+                face_y_delta = setup.face_y_delta;
 
-                GetVertexYOrder(points, vxOrder);
+                const Vertex4d<render_flags>* verts = &vertexes[setup.first_vertex];
 
-                const Vertex4d& top     = points[vxOrder[0]];
-                const Vertex4d& middle  = points[vxOrder[1]];
-                const Vertex4d& bottom  = points[vxOrder[2]];
+                unsigned char polygon[CLIP_POLYGON_MAX_VERTS];
 
-                const bool left_is_long = PointOnLineSide2d(top.pos, bottom.pos, middle.pos) > 0;
+                for(unsigned int i = 0; i < setup.vertex_count; i++)
+                    polygon[i] = i;
 
-                if(top.pos.y == middle.pos.y) [[unlikely]]
+#ifdef WALL_COLUMNS
+                if constexpr (TriEdgeTrace<render_flags>::has_w)
                 {
-                    GetTriangleLerpXDeltas(top, middle, x_delta);
+                    if(setup.column_major)
+                    {
+                        DrawPolygonEdges<true>(verts, polygon, setup);
+                        return;
+                    }
                 }
-                else if(middle.pos.y == bottom.pos.y) [[unlikely]]
+#endif
+
+                DrawPolygonEdges<false>(verts, polygon, setup);
+            }
+
+            template<bool column_major> void no_inline DrawPolygonEdges(const Vertex4d<render_flags> verts[], const unsigned char polygon[], const PolygonSetup<render_flags>& setup) const
+            {
+                const unsigned int vxCount = setup.vertex_count;
+                const unsigned int top = setup.top, bottom = setup.bottom, widest = setup.widest;
+                const bool widest_is_right = setup.widest_is_right;
+                const TriDrawXDeltaZWUV<render_flags>& x_delta = setup.x_delta;
+
+#ifdef RENDER_STATS
+                render_stats->triangles_drawn += (vxCount - 2);
+                render_stats->polygons_drawn++;
+#endif
+
+                TriEdgeTrace<render_flags> pos;
+                TriEdgeDDA left_edge, right_edge;
+                TriDrawYDeltaZWUV<render_flags> y_delta_left;
+                HiZTileRow hi_z_row;
+
+                //Walking forwards from the top follows the chain the widest vert is on.
+                const bool widest_is_next = ((widest + vxCount - top) % vxCount) < ((bottom + vxCount - top) % vxCount);
+
+                const unsigned int right_step = (widest_is_next == widest_is_right) ? 1 : (vxCount - 1);
+                const unsigned int left_step = vxCount - right_step;
+
+                //Edges are stepped on sub-pixel ints. Polygons that share an edge step it identically
+                //so there are no gaps or overdraw along it.
+                int sx[CLIP_POLYGON_MAX_VERTS], sy[CLIP_POLYGON_MAX_VERTS];
+
+                for(unsigned int i = 0; i < vxCount; i++)
                 {
-                    GetTriangleLerpXDeltas(middle, bottom, x_delta);
+                    sx[i] = pToFixedInt<SUBPIXEL_BITS>(verts[polygon[i]].pos.x);
+                    sy[i] = pToFixedInt<SUBPIXEL_BITS>(verts[polygon[i]].pos.y);
                 }
-                else
+
+                const int fb_y = column_major ? current_viewport->width : current_viewport->height;
+
+                int y = pMax(SubPixelRow(sy[top]), 0);
+
+                if(y >= fb_y)
+                    return;
+
+                unsigned int left = top, right = top;
+
+                if(!FindChainEdge(sy, vxCount, left_step, bottom, y, left) || !FindChainEdge(sy, vxCount, right_step, bottom, y, right))
+                    return;
+
+                SetupLeftEdge<column_major>(verts, polygon, sx, sy, left, (left + left_step) % vxCount, y, pos, left_edge, y_delta_left, x_delta);
+                SetupEdgeDDA<column_major>(sx[right], sy[right], sx[(right + right_step) % vxCount], sy[(right + right_step) % vxCount], y, right_edge);
+
+                while(true)
                 {
-                    fp frac = ((middle.pos.y - top.pos.y) / (bottom.pos.y - top.pos.y));
+                    const int left_end = SubPixelRow(sy[(left + left_step) % vxCount]);
+                    const int right_end = SubPixelRow(sy[(right + right_step) % vxCount]);
+
+                    const int yEnd = pMin(pMin(left_end, right_end), fb_y);
+
+                    DrawTriangleSpans<column_major>(y, yEnd, pos, left_edge, right_edge, y_delta_left, x_delta, hi_z_row);
+                    y = yEnd;
 
-                    Vertex4d m;
-                    LerpVertex(m, top, bottom, frac);
+                    if(y >= fb_y)
+                        return;
 
-                    if(left_is_long)
+                    //Step onto the next edge of whichever chains just ended.
+                    if(left_end <= y)
                     {
-                        GetTriangleLerpXDeltas(m, middle, x_delta);
+                        if(!FindChainEdge(sy, vxCount, left_step, bottom, y, left))
+                            return;
+
+                        SetupLeftEdge<column_major>(verts, polygon, sx, sy, left, (left + left_step) % vxCount, y, pos, left_edge, y_delta_left, x_delta);
                     }
-                    else
+
+                    if(right_end <= y)
                     {
-                        GetTriangleLerpXDeltas(middle, m, x_delta);
+                        if(!FindChainEdge(sy, vxCount, right_step, bottom, y, right))
+                            return;
+
+                        SetupEdgeDDA<column_major>(sx[right], sy[right], sx[(right + right_step) % vxCount], sy[(right + right_step) % vxCount], y, right_edge);
                     }
                 }
+            }
 
-                TriDrawYDeltaZWUV& short_y_delta = left_is_long ? y_delta_right : y_delta_left;
-                TriDrawYDeltaZWUV& long_y_delta = left_is_long ? y_delta_left : y_delta_right;
+            //First row whose pixel centre is on or below sub-pixel y. Top-left fill rule.
+            static constexpr int SubPixelRow(const int y)
+            {
+                return (y - SUBPIXEL_HALF + (SUBPIXEL_ONE - 1)) >> SUBPIXEL_BITS;
+            }
 
-                const int fb_y = current_viewport->height;
+            //Walks a chain on from vert 'edge' to the edge that covers row y. False if the chain ends first.
+            static bool FindChainEdge(const int sy[], const unsigned int vxCount, const unsigned int step, const unsigned int bottom, const int y, unsigned int& edge)
+            {
+                while(edge != bottom)
+                {
+                    const unsigned int next = (edge + step) % vxCount;
 
-                fp pixelCentreTopY = PixelCentre(pMax(top.pos.y, fp(0)));
-                fp stepY = pixelCentreTopY - top.pos.y;
+                    if(SubPixelRow(sy[next]) > y)
+                        return true;
 
-                int yStart = pixelCentreTopY;
-                int yEnd = PixelCentre(pMin(middle.pos.y, fp(fb_y)));
+                    edge = next;
+                }
 
-                GetTriangleLerpYDeltas(top, bottom, long_y_delta);
-                GetTriangleLerpYDeltas(top, middle, short_y_delta);
+                return false;
+            }
 
-                //Draw top half of triangle.
-                PreStepYTriangleLeft(stepY, top, pos, y_delta_left);
-                PreStepYTriangleRight(stepY, top, pos, y_delta_right);
+            //Sets up the edge from (x0, y0) to (x1, y1) at the centre of row. The edge must cover row so y1 > y0.
+            template<bool column_major> static void no_inline SetupEdgeDDA(const int x0, const int y0, const int x1, const int y1, const int row, TriEdgeDDA& edge)
+            {
+                const int dx = x1 - x0;
+                const int dy = y1 - y0;
 
-                DrawTriangleSpans(yStart, yEnd, pos, y_delta_left, y_delta_right, x_delta);
+                edge.x_step = pFloorDiv(dx, dy);
+                edge.error_step = (dx - (edge.x_step * dy)) << SUBPIXEL_BITS;
+                edge.error_adjust = dy << SUBPIXEL_BITS;
 
-                //Draw bottom half.
-                pixelCentreTopY = fp(pMax(yEnd, 0)) + fp(0.5);
-                stepY = pixelCentreTopY - middle.pos.y;
+                //Edge x at the row centre, less half a pixel, scaled by error_adjust. Left edges are inclusive, right edges exclusive.
+                long long int n = ((long long int)(x0 - SUBPIXEL_HALF) * dy) + ((long long int)((row << SUBPIXEL_BITS) + SUBPIXEL_HALF - y0) * dx);
 
-                yStart = pixelCentreTopY;
-                yEnd = PixelCentre(pMin(bottom.pos.y, fp(fb_y)));
+                //Walking transposed, top and bottom become left and right. Centres exactly on an edge that slopes
+                //down the screen to the right then land on the other side of the rule, so move them back.
+                if constexpr (column_major)
+                {
+                    if(dx > 0)
+                        n++;
+                }
+                const long long int x = pCeilDiv(n, (long long int)edge.error_adjust);
 
-                if(yStart == yEnd)
-                    return;
+                edge.x = (int)x;
+                edge.error = (int)((x * edge.error_adjust) - n);
+            }
 
-                GetTriangleLerpYDeltas(middle, bottom, short_y_delta);
+            //Returns true when the edge carried into an extra column.
+            static constexpr bool StepEdgeDDA(TriEdgeDDA& edge)
+            {
+                edge.x += edge.x_step;
+                edge.error -= edge.error_step;
 
-                if(left_is_long)
+                if(edge.error < 0)
                 {
-                    PreStepYTriangleRight(stepY, middle, pos, y_delta_right);
+                    edge.x++;
+                    edge.error += edge.error_adjust;
+                    return true;
                 }
-                else
+
+                return false;
+            }
+
+            template<bool column_major> void no_inline SetupLeftEdge(const Vertex4d<render_flags> verts[], const unsigned char polygon[], const int sx[], const int sy[], const unsigned int a, const unsigned int b, const int y, TriEdgeTrace<render_flags>& pos, TriEdgeDDA& edge, TriDrawYDeltaZWUV<render_flags>& y_delta_left, const TriDrawXDeltaZWUV<render_flags>& x_delta) const
+            {
+                const Vertex4d<render_flags>& v = verts[polygon[a]];
+
+                SetupEdgeDDA<column_major>(sx[a], sy[a], sx[b], sy[b], y, edge);
+
+                GetTriangleLerpYDeltas(v, verts[polygon[b]], y_delta_left);
+
+                //Attributes are traced at the centre of the first pixel rather than on the edge.
+                const fp stepY = (fp(y) + fp(0.5)) - v.pos.y;
+                const fp stepX = (fp(edge.x) + fp(0.5)) - (v.pos.x + (stepY * y_delta_left.x));
+
+                PreStepYTriangleLeft(stepY, stepX, v, pos, y_delta_left, x_delta);
+
+                //Each scanline the edge moves x_step columns, plus one more on a carry.
+                //Step by the gradient across x_step columns here and add x_delta on a carry.
+                const fp frac = y_delta_left.x - fp(edge.x_step);
+
+                if(current_texture)
+                {
+                    y_delta_left.u -= (frac * x_delta.u);
+                    y_delta_left.v -= (frac * x_delta.v);
+
+                    if constexpr (render_flags & (FullPerspectiveMapping | SubdividePerspectiveMapping))
+                    {
+                        y_delta_left.w -= (frac * x_delta.w);
+                    }
+                }
+
+                if constexpr (render_flags & (ZTest | ZWrite))
                 {
-                    PreStepYTriangleLeft(stepY, middle, pos, y_delta_left);
+                    y_delta_left.z -= (frac * x_delta.z);
                 }
 
-                DrawTriangleSpans(yStart, yEnd, pos, y_delta_left, y_delta_right, x_delta);
+                if constexpr (render_flags & Fog)
+                {
+                    y_delta_left.f -= (frac * x_delta.f);
+                }
+
+                if constexpr (render_flags & VertexLight)
+                {
+                    y_delta_left.l -= (frac * x_delta.l);
+                }
             }
 
-            void no_inline PreStepYTriangleLeft(const fp stepY, const Vertex4d& left, TriEdgeTrace& pos, const TriDrawYDeltaZWUV& y_delta_left) const
+            void no_inline PreStepYTriangleLeft(const fp stepY, const fp stepX, const Vertex4d<render_flags>& left, TriEdgeTrace<render_flags>& pos, const TriDrawYDeltaZWUV<render_flags>& y_delta_left, const TriDrawXDeltaZWUV<render_flags>& x_delta) const
             {
                 if(current_texture)
                 {
-                    pos.u_left = left.uv.x + (stepY * y_delta_left.u);
-                    pos.v_left = left.uv.y + (stepY * y_delta_left.v);
+                    pos.u_left = left.uv.x + (stepY * y_delta_left.u) + (stepX * x_delta.u);
+                    pos.v_left = left.uv.y + (stepY * y_delta_left.v) + (stepX * x_delta.v);
 
                     if constexpr (render_flags & (FullPerspectiveMapping | SubdividePerspectiveMapping))
                     {
-                        pos.w_left = left.pos.w + (stepY * y_delta_left.w);
+                        pos.w_left = left.pos.w + (stepY * y_delta_left.w) + (stepX * x_delta.w);
                     }
                 }
 
-                pos.x_left = left.pos.x + (stepY * y_delta_left.x);
-
                 if constexpr (render_flags & (ZTest | ZWrite))
                 {
-                    pos.z_left = left.pos.z + (stepY * y_delta_left.z);
+                    pos.z_left = left.pos.z + current_viewport->z_bias + (stepY * y_delta_left.z) + (stepX * x_delta.z);
                 }
 
                 if constexpr (render_flags & Fog)
                 {
-                    pos.f_left = left.fog_factor + (stepY * y_delta_left.f);
+                    pos.f_left = left.fog_factor + (stepY * y_delta_left.f) + (stepX * x_delta.f);
                 }
 
                 if constexpr (render_flags & VertexLight)
                 {
-                    pos.l_left = left.light_factor + (stepY * y_delta_left.l);
+                    pos.l_left = left.light_factor + (stepY * y_delta_left.l) + (stepX * x_delta.l);
                 }
             }
 
-            void no_inline PreStepYTriangleRight(const fp stepY, const Vertex4d& right, TriEdgeTrace& pos, const TriDrawYDeltaZWUV& y_delta_right) const
+            template<class TDelta> void StepLeftAttributes(TriEdgeTrace<render_flags>& pos, const TDelta& delta) const
             {
-                pos.x_right = right.pos.x + (stepY * y_delta_right.x);
+                if constexpr (render_flags & (ZTest | ZWrite))
+                {
+                    pos.z_left += delta.z;
+                }
+
+                if(current_texture)
+                {
+                    pos.u_left += delta.u;
+                    pos.v_left += delta.v;
+
+                    if constexpr (render_flags & (FullPerspectiveMapping | SubdividePerspectiveMapping))
+                    {
+                        pos.w_left += delta.w;
+                    }
+                }
+
+                if constexpr (render_flags & Fog)
+                {
+                    pos.f_left += delta.f;
+                }
+
+                if constexpr (render_flags & VertexLight)
+                {
+                    pos.l_left += delta.l;
+                }
             }
 
-            void no_inline DrawTriangleSpans(const int yStart, const int yEnd, TriEdgeTrace& pos, const TriDrawYDeltaZWUV& y_delta_left, const TriDrawYDeltaZWUV& y_delta_right, const TriDrawXDeltaZWUV x_delta) const
+            template<bool column_major> void no_inline DrawTriangleSpans(const int yStart, const int yEnd, TriEdgeTrace<render_flags>& pos, TriEdgeDDA& left_edge, TriEdgeDDA& right_edge, const TriDrawYDeltaZWUV<render_flags>& y_delta_left, const TriDrawXDeltaZWUV<render_flags> x_delta, HiZTileRow& hi_z_row) const
             {
-                pos.fb_ypos = &current_viewport->start[yStart * current_viewport->y_pitch];
+                //Start of the scanline, or the top of the column.
+                const unsigned int fb_step = column_major ? 1 : current_viewport->y_pitch;
+                const unsigned int zb_step = column_major ? 1 : current_viewport->z_y_pitch;
+
+                pos.fb_ypos = &current_viewport->start[yStart * fb_step];
 
                 if constexpr (render_flags & (ZTest | ZWrite))
                 {
-                    pos.zb_ypos = &current_viewport->z_start[yStart * current_viewport->z_y_pitch];
+                    pos.zb_ypos = &current_viewport->z_start[yStart * zb_step];
                 }
 
                 for (int y = yStart; y < yEnd; y++)
                 {
-                    DrawSpan(pos, x_delta);
+                    if constexpr (column_major)
+                        DrawColumn(pos, y, left_edge.x, right_edge.x, x_delta);
+                    else
+                        DrawSpan(pos, y, left_edge.x, right_edge.x, x_delta);
+
+#ifdef HI_Z
+                    if constexpr (render_flags & ZWrite)
+                    {
+                        if(current_viewport->hi_z)
+                            UpdateHiZ<column_major>(y, pos, left_edge.x, right_edge.x, x_delta, hi_z_row);
+                    }
+#else
+                    (void)hi_z_row;
+#endif
 
-                    pos.x_left += y_delta_left.x;
-                    pos.x_right += y_delta_right.x;
-                    pos.fb_ypos += current_viewport->y_pitch;
+                    pos.fb_ypos += fb_step;
 
                     if constexpr (render_flags & (ZTest | ZWrite))
                     {
-                        pos.zb_ypos += current_viewport->z_y_pitch;
-                        pos.z_left += y_delta_left.z;
+                        pos.zb_ypos += zb_step;
                     }
 
-                    if(current_texture)
+                    StepLeftAttributes(pos, y_delta_left);
+
+                    if(StepEdgeDDA(left_edge))
+                        StepLeftAttributes(pos, x_delta);
+
+                    StepEdgeDDA(right_edge);
+                }
+            }
+
+            void no_inline DrawSpan(const TriEdgeTrace<render_flags>& pos, const int y, const int x_left, const int x_right, const TriDrawXDeltaZWUV<render_flags>& delta) const
+            {
+                const int x_start = pMax(x_left, 0);
+                const int x_end = pMin(x_right, (int)current_viewport->width);
+
+                if(x_start >= x_end) [[unlikely]]
+                    return;
+
+                TriEdgeTrace<render_flags> span_pos = pos;
+
+                //Left edge is past the viewport in the guard band. Scissor it.
+                if(x_left < 0) [[unlikely]]
+                {
+                    StepLeftAttributes(span_pos, ScaleXDelta(delta, fp(-x_left)));
+                }
+
+                span_pos.x_left = x_start;
+                span_pos.x_right = x_end;
+
+#ifdef HI_Z
+                if constexpr (render_flags & ZTest)
+                {
+                    if(current_viewport->hi_z)
                     {
-                        pos.u_left += y_delta_left.u;
+                        DrawHiZVisible<false>(span_pos, y, delta);
+                        return;
+                    }
+                }
+#else
+                (void)y;
+#endif
 
-                        pos.v_left += y_delta_left.v;
+                EmitSpan<false>(span_pos, delta);
+            }
 
-                        if constexpr (render_flags & (FullPerspectiveMapping | SubdividePerspectiveMapping))
+            //Draws a span or column now, or holds it back to draw grouped by texture.
+            template<bool column_major> void EmitSpan(TriEdgeTrace<render_flags>& span_pos, const TriDrawXDeltaZWUV<render_flags>& delta) const
+            {
+#ifdef DEFERRED_SPANS
+                //Z buffered pixels come out the same whatever order they are drawn in. Bar ties in depth.
+                //A polygon that fills the rest of the list draws its other spans straight away.
+                if constexpr (defer_spans)
+                {
+                    if(deferred_span_count < DEFERRED_SPAN_MAX)
+                    {
+                        DeferredSpan<render_flags>& span = deferred_spans[deferred_span_count++];
+
+                        span.pos = span_pos;
+                        span.delta = delta;
+                        span.texture = current_texture;
+                        span.alpha_skip = current_alpha_skip;
+                        span.color = current_color;
+                        span.column = column_major;
+                        span.subdivide_spans = subdivide_spans;
+                        span.constant_w_spans = constant_w_spans;
+
+#ifdef RENDER_STATS
+                        render_stats->spans_deferred++;
+#endif
+                        return;
+                    }
+                }
+#endif
+
+                if constexpr (column_major)
+                    DrawColumnPixels(span_pos, delta);
+                else
+                    DrawSpanPixels(span_pos, delta);
+            }
+
+            void DrawSpanPixels(TriEdgeTrace<render_flags>& span_pos, const TriDrawXDeltaZWUV<render_flags>& delta) const
+            {
+                if(current_texture)
+                {
+                    if constexpr (render_flags & FullPerspectiveMapping)
+                    {
+                        if(constant_w_spans)
+                            DrawTriangleScanlineConstantW(span_pos, delta, current_texture);
+                        else
+                            DrawTriangleScanlinePerspectiveCorrect(span_pos, delta, current_texture);
+                    }
+                    else
+                    {
+                        if constexpr (render_flags & SubdividePerspectiveMapping)
                         {
-                            pos.w_left += y_delta_left.w;
+                            if(!subdivide_spans)
+                                DrawTriangleScanlineAffine(span_pos, delta, current_texture);
+                            else if(constant_w_spans)
+                                DrawTriangleScanlineConstantW(span_pos, delta, current_texture);
+                            else
+                                SubdivideSpan(span_pos, delta, current_texture);
+                        }
+                        else
+                        {
+                            DrawTriangleScanlineAffine(span_pos, delta, current_texture);
                         }
                     }
+                }
+                else
+                {
+                    DrawTriangleScanlineFlat(span_pos, delta, current_color);
+                }
 
-                    if constexpr (render_flags & Fog)
+#ifdef RENDER_STATS
+                render_stats->scanlines_drawn++;
+                CountTextureSwitch();
+#endif
+            }
+
+#ifdef RENDER_STATS
+            void CountTextureSwitch() const
+            {
+                if(current_texture && (current_texture != render_stats->last_texture))
+                {
+                    render_stats->texture_switches++;
+                    render_stats->last_texture = current_texture;
+                }
+            }
+#endif
+
+            //Shaders that lay fog_light_map out in 256 byte rows, one per fog and light level, provide FogLightRow().
+            static constexpr bool HasFogLightRows()
+            {
+                if constexpr (render_flags & (Fog | VertexLight))
+                    return requires { TPixelShader::FogLightRow(fp(), fp(), (const unsigned char*)nullptr); };
+                else
+                    return false;
+            }
+
+            //The remap row for a span whose fog and light stay in one level from end to end, else nullptr.
+            //Both are linear along the span so its ends are enough to check.
+            const unsigned char* GetFogLightRow(const TriEdgeTrace<render_flags>& pos, const TriDrawXDeltaZWUV<render_flags>& delta) const
+            {
+                const int last = (int)(pos.x_right - pos.x_left) - 1;
+
+                const fp f = pos.f_left, df = delta.f;
+                const fp l = pos.l_left, dl = delta.l;
+
+                const unsigned char* row = TPixelShader::FogLightRow(f, l, fog_light_map);
+
+                if(row != TPixelShader::FogLightRow(f + (df * last), l + (dl * last), fog_light_map))
+                    return nullptr;
+
+                return row;
+            }
+
+            void no_inline DrawTriangleScanlineConstantW(const TriEdgeTrace<render_flags>& pos, const TriDrawXDeltaZWUV<render_flags>& delta, const pixel* texture) const
+            {
+                const int count = (int)(pos.x_right - pos.x_left);
+
+                //w is held at its value half way along the span so u and v are affine.
+                const fp invw = pReciprocal(pos.w_left + (delta.w * (count >> 1)));
+
+                TriEdgeTrace<render_flags> pos2 = pos;
+                TriDrawXDeltaZWUV<render_flags> delta2 = delta;
+
+                pos2.u_left = pos.u_left * invw;
+                pos2.v_left = pos.v_left * invw;
+                delta2.u = delta.u * invw;
+                delta2.v = delta.v * invw;
+
+#ifdef RENDER_STATS
+                render_stats->perspective_pixels += count;
+                render_stats->perspective_reciprocals++;
+#endif
+
+                DrawTriangleScanlineAffine(pos2, delta2, texture);
+            }
+
+            //Polygons walked column major step down screen column x from row y_top to y_bottom.
+            void no_inline DrawColumn(const TriEdgeTrace<render_flags>& pos, const int x, const int y_top, const int y_bottom, const TriDrawXDeltaZWUV<render_flags>& delta) const
+            {
+                const int y_start = pMax(y_top, 0);
+                const int y_end = pMin(y_bottom, (int)current_viewport->height);
+
+                if(y_start >= y_end) [[unlikely]]
+                    return;
+
+                TriEdgeTrace<render_flags> col_pos = pos;
+
+                if(y_top < 0) [[unlikely]]
+                {
+                    StepLeftAttributes(col_pos, ScaleXDelta(delta, fp(-y_top)));
+                }
+
+                col_pos.x_left = y_start;
+                col_pos.x_right = y_end;
+
+#ifdef HI_Z
+                if constexpr (render_flags & ZTest)
+                {
+                    if(current_viewport->hi_z)
+                    {
+                        DrawHiZVisible<true>(col_pos, x, delta);
+                        return;
+                    }
+                }
+#else
+                (void)x;
+#endif
+
+                EmitSpan<true>(col_pos, delta);
+            }
+
+            void DrawColumnPixels(TriEdgeTrace<render_flags>& col_pos, const TriDrawXDeltaZWUV<render_flags>& delta) const
+            {
+                DrawTriangleColumnPerspectiveCorrect(col_pos, delta, current_texture);
+
+#ifdef RENDER_STATS
+                render_stats->scanlines_drawn++;
+                CountTextureSwitch();
+#endif
+            }
+
+#ifdef HI_Z
+            //Hi-Z tile holding pixel (x, y) of the viewport. Walked column major x and y are swapped.
+            template<bool column_major> z_val& HiZTile(const int y, const int x) const
+            {
+                const int tx = ((column_major ? y : x) + current_viewport->x) >> HI_Z_TILE_SHIFT;
+                const int ty = ((column_major ? x : y) + current_viewport->y) >> HI_Z_TILE_SHIFT;
+
+                return current_viewport->hi_z[(ty * current_viewport->hi_z_y_pitch) + tx];
+            }
+
+            //Viewport column of the left edge of the tile holding viewport column x. May be negative.
+            template<bool column_major> int HiZTileLeft(const int x) const
+            {
+                const int offset = column_major ? current_viewport->y : current_viewport->x;
+
+                return (((x + offset) >> HI_Z_TILE_SHIFT) << HI_Z_TILE_SHIFT) - offset;
+            }
+
+            //Walks the span a tile at a time and draws only the runs of tiles it isn't wholly behind.
+            //z is linear along the span so it is nearest at one end of each tile.
+            template<bool column_major> void no_inline DrawHiZVisible(TriEdgeTrace<render_flags>& span_pos, const int y, const TriDrawXDeltaZWUV<render_flags>& delta) const
+            {
+                const int x_start = (int)span_pos.x_left;
+                const int x_end = (int)span_pos.x_right;
+
+                const fp z = span_pos.z_left;
+                const fp dz = delta.z;
+
+                int run_start = x_start;
+
+                for(int x = x_start; x < x_end;)
+                {
+                    const int tile_end = pMin(HiZTileLeft<column_major>(x) + HI_Z_TILE_SIZE, x_end);
+
+                    const fp z_near = z + (dz * ((dz < 0 ? tile_end - 1 : x) - x_start));
+
+                    if(z_val(z_near) >= HiZTile<column_major>(y, x))
                     {
-                        pos.f_left += y_delta_left.f;
+                        DrawHiZRun<column_major>(span_pos, run_start, x, delta);
+
+#ifdef RENDER_STATS
+                        render_stats->hi_z_pixels_rejected += (tile_end - x);
+#endif
+                        run_start = tile_end;
+                    }
+
+                    x = tile_end;
+                }
+
+                DrawHiZRun<column_major>(span_pos, run_start, x_end, delta);
+            }
+
+            template<bool column_major> void DrawHiZRun(const TriEdgeTrace<render_flags>& span_pos, const int x_start, const int x_end, const TriDrawXDeltaZWUV<render_flags>& delta) const
+            {
+                if(x_start >= x_end)
+                    return;
+
+                TriEdgeTrace<render_flags> run_pos = span_pos;
+
+                if(x_start != (int)span_pos.x_left)
+                    StepLeftAttributes(run_pos, ScaleXDelta(delta, fp(x_start - (int)span_pos.x_left)));
+
+                run_pos.x_left = x_start;
+                run_pos.x_right = x_end;
+
+                EmitSpan<column_major>(run_pos, delta);
+            }
+
+            //Keeps each tile's depth at or beyond the furthest pixel in it after a scanline is written.
+            //Z tested pixels only get nearer so a tile is lowered once a polygon covers all of it.
+            //Without ZTest a write may push pixels further so tiles the scanline touches are raised to it.
+            template<bool column_major> void no_inline UpdateHiZ(const int y, const TriEdgeTrace<render_flags>& pos, const int x_left, const int x_right, const TriDrawXDeltaZWUV<render_flags>& delta, HiZTileRow& tile_row) const
+            {
+                const int x_start = pMax(x_left, 0);
+                const int x_end = pMin(x_right, column_major ? (int)current_viewport->height : (int)current_viewport->width);
+
+                const fp dz = delta.z;
+                const fp z0 = pos.z_left - (dz * x_left);
+
+                const int row = (y + (column_major ? current_viewport->x : current_viewport->y)) >> HI_Z_TILE_SHIFT;
+
+                if(row != tile_row.tile_row)
+                {
+                    tile_row.tile_row = row;
+                    tile_row.rows = 0;
+                    tile_row.x_left = x_start;
+                    tile_row.x_right = x_end;
+                    tile_row.z0_max = z0;
+                }
+                else
+                {
+                    tile_row.x_left = pMax(tile_row.x_left, x_start);
+                    tile_row.x_right = pMin(tile_row.x_right, x_end);
+                    tile_row.z0_max = pMax(tile_row.z0_max, z0);
+                }
+
+                tile_row.rows++;
+
+                if constexpr (!(render_flags & ZTest))
+                {
+                    for(int x = x_start; x < x_end;)
+                    {
+                        const int tile_end = pMin(HiZTileLeft<column_major>(x) + HI_Z_TILE_SIZE, x_end);
+
+                        z_val& tile = HiZTile<column_major>(y, x);
+                        tile = pMax(tile, z_val(z0 + (dz * (dz < 0 ? x : tile_end - 1))));
+
+                        x = tile_end;
+                    }
+                }
+
+                //Alpha tested pixels may not be written at all.
+                if constexpr (!(render_flags & AlphaTest))
+                {
+                    if(tile_row.rows != HI_Z_TILE_SIZE)
+                        return;
+
+                    for(int x = HiZTileLeft<column_major>(tile_row.x_left + HI_Z_TILE_SIZE - 1); (x + HI_Z_TILE_SIZE) <= tile_row.x_right; x += HI_Z_TILE_SIZE)
+                    {
+                        const z_val z_far = tile_row.z0_max + (dz * (dz < 0 ? x : x + HI_Z_TILE_SIZE - 1));
+
+                        z_val& tile = HiZTile<column_major>(y, x);
+
+                        if constexpr (render_flags & ZTest)
+                            tile = pMin(tile, z_far);
+                        else
+                            tile = z_far;
                     }
+                }
+            }
+#endif
 
-                    if constexpr (render_flags & VertexLight)
+            void DrawTriangleColumnPerspectiveCorrect(const TriEdgeTrace<render_flags>& pos, const TriDrawXDeltaZWUV<render_flags>& delta, const pixel* texture) const
+            {
+                if constexpr (HasFogLightRows())
+                {
+                    if(const unsigned char* row = GetFogLightRow(pos, delta))
                     {
-                        pos.l_left += y_delta_left.l;
+                        DrawTriangleColumnPerspectiveCorrect<true>(pos, delta, texture, row);
+                        return;
                     }
                 }
+
+                DrawTriangleColumnPerspectiveCorrect<false>(pos, delta, texture, fog_light_map);
             }
 
-            void no_inline DrawSpan(const TriEdgeTrace& pos, const TriDrawXDeltaZWUV& delta) const
+            template<bool fog_light_row> void no_inline DrawTriangleColumnPerspectiveCorrect(const TriEdgeTrace<render_flags>& pos, const TriDrawXDeltaZWUV<render_flags>& delta, const pixel* texture, const unsigned char* remap) const
             {
-                TriEdgeTrace span_pos;
+                const int y_start = (int)pos.x_left;
+                const int y_end = (int)pos.x_right;
 
-                const int fb_width = current_viewport->width;
+                unsigned int count = (y_end - y_start);
 
-                const fp pixelCentreLeftX = PixelCentre(pMax(pos.x_left, fp(0)));
-                const fp stepX = pixelCentreLeftX - pos.x_left;
+                const unsigned int fb_pitch = current_viewport->y_pitch;
+                const unsigned int zb_pitch = current_viewport->z_y_pitch;
 
-                const int x_start = pixelCentreLeftX;
-                const int x_end = PixelCentre(pMin(pos.x_right, fp(fb_width)));
+                pixel* fb = pos.fb_ypos + (y_start * fb_pitch);
+                z_val* zb = nullptr;
 
-                if(x_start >= x_end) [[unlikely]]
-                    return;
+                if constexpr (TriEdgeTrace<render_flags>::has_z)
+                    zb = pos.zb_ypos + (y_start * zb_pitch);
 
-                if(x_start >= fb_width) [[unlikely]]
-                    return;
+                //w is held at its value half way down the column so u and v step linearly.
+                const fp invw = pReciprocal(pos.w_left + (delta.w * (int)(count >> 1)));
 
-                span_pos.x_left = x_start;
-                span_pos.x_right = x_end;
-                span_pos.fb_ypos = pos.fb_ypos;
+                fp u = pos.u_left * invw, v = pos.v_left * invw;
+                const fp du = delta.u * invw, dv = delta.v * invw;
 
-                if constexpr (render_flags & (ZTest | ZWrite))
-                {
-                    span_pos.zb_ypos = pos.zb_ypos;
-                    span_pos.z_left = pos.z_left + (delta.z * stepX);
-                }
+                fp z = pos.z_left;
+                const fp dz = delta.z;
 
-                if constexpr (render_flags & Fog)
-                {
-                    span_pos.f_left = pos.f_left + (delta.f * stepX);
-                }
+                fp f = pos.f_left, df = delta.f;
+                fp l = pos.l_left, dl = delta.l;
 
-                if constexpr (render_flags & VertexLight)
-                {
-                    span_pos.l_left = pos.l_left + (delta.l * stepX);
-                }
+                const pixel fog_color = fog_params->fog_color;
 
-                if(current_texture)
-                {
-                    span_pos.u_left = pos.u_left + (delta.u * stepX);
-                    span_pos.v_left = pos.v_left + (delta.v * stepX);
+#ifdef RENDER_STATS
+                render_stats->perspective_pixels += count;
+                render_stats->perspective_reciprocals++;
+#endif
 
-                    if constexpr (render_flags & (FullPerspectiveMapping | SubdividePerspectiveMapping))
+                if constexpr (render_flags & AlphaTest)
+                {
+                    if(current_alpha_skip)
                     {
-                        span_pos.w_left = pos.w_left + (delta.w * stepX);
+                        DrawAlphaSkipRun<fog_light_row>(fb, zb, fb_pitch, zb_pitch, count, z, dz, u, du, v, dv, f, df, l, dl, texture, remap);
+                        return;
                     }
+                }
 
-                    if constexpr (render_flags & FullPerspectiveMapping)
-                    {
-                        DrawTriangleScanlinePerspectiveCorrect(span_pos, delta, current_texture);
-                    }
-                    else
+                //Every pixel down a column has the same alignment in the 16 bit framebuffer.
+                if((size_t)fb & 1)
+                {
+                    while(count--)
                     {
-                        if constexpr (render_flags & SubdividePerspectiveMapping)
-                        {
-                            if(subdivide_spans)
-                                SubdivideSpan(span_pos, delta, current_texture);
-                            else
-                                DrawTriangleScanlineAffine(span_pos, delta, current_texture);
-                        }
-                        else
-                        {
-                            DrawTriangleScanlineAffine(span_pos, delta, current_texture);
-                        }
+                        TPixelShader::template DrawScanlinePixelHigh<fog_light_row>(fb, zb, z, texture, u, v, f, l, fog_color, remap); fb += fb_pitch, zb += zb_pitch, z += dz, u += du, v += dv, f += df, l += dl;
                     }
                 }
                 else
                 {
-                    DrawTriangleScanlineFlat(span_pos, delta, current_color);
+                    while(count--)
+                    {
+                        TPixelShader::template DrawScanlinePixelLow<fog_light_row>(fb, zb, z, texture, u, v, f, l, fog_color, remap); fb += fb_pitch, zb += zb_pitch, z += dz, u += du, v += dv, f += df, l += dl;
+                    }
                 }
-
-#ifdef RENDER_STATS
-                render_stats->scanlines_drawn++;
-#endif
             }
 
-
-            void no_inline SubdivideSpan(TriEdgeTrace& pos, const TriDrawXDeltaZWUV& delta, const pixel* texture) const
+            void no_inline SubdivideSpan(TriEdgeTrace<render_flags>& pos, const TriDrawXDeltaZWUV<render_flags>& delta, const pixel* texture) const
             {
-                TriDrawXDeltaZWUV delta2;
+                TriDrawXDeltaZWUV<render_flags> delta2;
 
                 fp span_right = pos.x_right;
                 fp u = pos.u_left, v = pos.v_left, w = pos.w_left;
 
+#ifdef SUBDIVIDE_ADAPTIVE
+                const int shift = GetSubdivideSpanShift(pos, delta);
+#else
+                constexpr int shift = SUBDIVIDE_SPAN_SHIFT;
+#endif
+
+                const int span_len = (1 << shift);
+
+                if constexpr(render_flags & (ZTest | ZWrite))
+                {
+                    delta2.z = delta.z;
+                }
+
                 if constexpr(render_flags & Fog)
                 {
                     delta2.f = delta.f;
@@ -699,45 +1607,148 @@ namespace P3D
                     delta2.l = delta.l;
                 }
 
+                //The end of each sub-span is the start of the next so its reciprocal is reused.
+                fp invw_0 = pReciprocal(w);
+
+#ifdef RENDER_STATS
+                render_stats->perspective_pixels += (int)(span_right - pos.x_left);
+                render_stats->perspective_reciprocals++;
+#endif
+
                 do
                 {
-                    pos.x_right = pMin(span_right, pos.x_left + SUBDIVIDE_SPAN_LEN);
+                    pos.x_right = pMin(span_right, pos.x_left + span_len);
 
-                    fp invw_0 = pReciprocal(w);
-                    fp invw_15 = pReciprocal(w += pASL(delta.w, SUBDIVIDE_SPAN_SHIFT));
+                    const fp invw_1 = pReciprocal(w += pASL(delta.w, shift));
 
                     fp u0 = pos.u_left = u * invw_0;
-                    fp u15 = (u += pASL(delta.u, SUBDIVIDE_SPAN_SHIFT)) * invw_15;
-                    delta2.u = pASR(u15-u0, SUBDIVIDE_SPAN_SHIFT);
+                    fp u1 = (u += pASL(delta.u, shift)) * invw_1;
+                    delta2.u = pASR(u1-u0, shift);
 
                     fp v0 = pos.v_left = v * invw_0;
-                    fp v15 = (v += pASL(delta.v, SUBDIVIDE_SPAN_SHIFT)) * invw_15;
-                    delta2.v = pASR(v15-v0, SUBDIVIDE_SPAN_SHIFT);
+                    fp v1 = (v += pASL(delta.v, shift)) * invw_1;
+                    delta2.v = pASR(v1-v0, shift);
 
                     DrawTriangleScanlineAffine(pos, delta2, texture);
 
-                    pos.x_left += SUBDIVIDE_SPAN_LEN;
+                    pos.x_left += span_len;
+
+                    if constexpr(render_flags & (ZTest | ZWrite))
+                    {
+                        pos.z_left += pASL(delta.z, shift);
+                    }
 
                     if constexpr(render_flags & Fog)
                     {
-                        pos.f_left += pASL(delta.f, SUBDIVIDE_SPAN_SHIFT);
+                        pos.f_left += pASL(delta.f, shift);
                     }
 
                     if constexpr(render_flags & VertexLight)
                     {
-                        pos.l_left += pASL(delta.l, SUBDIVIDE_SPAN_SHIFT);
+                        pos.l_left += pASL(delta.l, shift);
                     }
 
+                    invw_0 = invw_1;
+
+#ifdef RENDER_STATS
+                    render_stats->perspective_reciprocals++;
+#endif
+
                 } while(pos.x_left < span_right);
             }
 
-            void no_inline DrawTriangleScanlineAffine(const TriEdgeTrace& pos, const TriDrawXDeltaZWUV& delta, const pixel* texture) const
+            int no_inline GetSubdivideSpanShift(const TriEdgeTrace<render_flags>& pos, const TriDrawXDeltaZWUV<render_flags>& delta) const
+            {
+                //Drawing a sub-span of length L affine puts texels up to about (L^2 / 4) * |dw / w| pixels
+                //from where they should be. w is smallest, and the error largest, at one end of the span.
+                const int len = (int)(pos.x_right - pos.x_left);
+
+                const fp w_end = pos.w_left + (delta.w * len);
+                const fp limit = pMin(pos.w_left, w_end) * (SUBDIVIDE_MAX_ERROR * 4);
+                const fp dw = pAbs(delta.w);
+
+                int shift = SUBDIVIDE_SPAN_MAX_SHIFT;
+
+                //Don't step further past the end of the span than needed. w may not stay positive out there.
+                while((shift > SUBDIVIDE_SPAN_MIN_SHIFT) && ((len <= (1 << (shift - 1))) || (dw > pASR(limit, shift * 2))))
+                    shift--;
+
+                return shift;
+            }
+
+            void DrawTriangleScanlineAffine(const TriEdgeTrace<render_flags>& pos, const TriDrawXDeltaZWUV<render_flags>& delta, const pixel* texture) const
+            {
+                if constexpr (HasFogLightRows())
+                {
+                    if(const unsigned char* row = GetFogLightRow(pos, delta))
+                    {
+                        DrawTriangleScanlineAffine<true>(pos, delta, texture, row);
+                        return;
+                    }
+                }
+
+                DrawTriangleScanlineAffine<false>(pos, delta, texture, fog_light_map);
+            }
+
+            //Alpha tested pixels pitch apart with u and v linear along the run.
+            //A transparent texel steps straight past the pixels that current_alpha_skip says can't reach an opaque one.
+            template<bool fog_light_row> void no_inline DrawAlphaSkipRun(pixel* fb, z_val* zb, const unsigned int fb_pitch, const unsigned int zb_pitch, int count, fp z, const fp dz, fp u, const fp du, fp v, const fp dv, fp f, const fp df, fp l, const fp dl, const pixel* texture, const unsigned char* remap) const
+            {
+                const pixel fog_color = fog_params->fog_color;
+
+                //Pixels per texel moved in u or v. Capped so (skip * inv_step) can't overflow.
+                //Found on the first transparent run. Spans that have none don't pay for the divide.
+                fp inv_step = -1;
+
+                while(count > 0)
+                {
+                    const unsigned int texel = (((int)v & TEX_MASK) << TEX_SHIFT) + ((int)u & TEX_MASK);
+                    const unsigned int skip = current_alpha_skip[texel];
+
+                    int n = 1;
+
+                    if(skip == 0)
+                    {
+                        if((size_t)fb & 1)
+                            TPixelShader::template DrawScanlinePixelHigh<fog_light_row>(fb, zb, z, texture, u, v, f, l, fog_color, remap);
+                        else if((fb_pitch == 1) && (count > 1))
+                        {
+                            TPixelShader::template DrawScanlinePixelPair<fog_light_row>(fb, zb, z, z+dz, texture, u, v, u+du, v+dv, f, f+df, l, l+dl, fog_color, remap);
+                            n = 2;
+                        }
+                        else
+                            TPixelShader::template DrawScanlinePixelLow<fog_light_row>(fb, zb, z, texture, u, v, f, l, fog_color, remap);
+                    }
+                    else
+                    {
+                        if(inv_step < 0)
+                        {
+                            const fp step = pMax(pAbs(du), pAbs(dv));
+                            inv_step = (step > fp(1.0 / 128)) ? (fp(1) / step) : fp(128);
+                        }
+
+                        //Moving k pixels moves at most k * step texels so (skip - 1) texels are known transparent.
+                        n += (int)(fp((int)skip - 1) * inv_step);
+
+                        if(n >= count)
+                            return;
+                    }
+
+                    fb += (fb_pitch * n), zb += (zb_pitch * n), count -= n;
+                    z += (dz * n), u += (du * n), v += (dv * n), f += (df * n), l += (dl * n);
+                }
+            }
+
+            template<bool fog_light_row> void no_inline DrawTriangleScanlineAffine(const TriEdgeTrace<render_flags>& pos, const TriDrawXDeltaZWUV<render_flags>& delta, const pixel* texture, const unsigned char* remap) const
             {
                 const int x_start = (int)pos.x_left;
                 const int x_end = (int)pos.x_right;
 
                 pixel* fb = pos.fb_ypos + x_start;
-                z_val* zb = pos.zb_ypos + x_start;
+                z_val* zb = nullptr;
+
+                if constexpr (TriEdgeTrace<render_flags>::has_z)
+                    zb = pos.zb_ypos + x_start;
 
                 unsigned int count = (x_end - x_start);
 
@@ -750,6 +1761,15 @@ namespace P3D
                 fp f = pos.f_left, df = delta.f;
                 fp l = pos.l_left, dl = delta.l;
 
+                if constexpr (render_flags & AlphaTest)
+                {
+                    if(current_alpha_skip)
+                    {
+                        DrawAlphaSkipRun<fog_light_row>(fb, zb, 1, 1, count, z, dz, pos.u_left, delta.u, pos.v_left, delta.v, f, df, l, dl, texture, remap);
+                        return;
+                    }
+                }
+
                 //Should be fracbits.
                 constexpr int uv_shift = 16-TEX_SHIFT;
 
@@ -760,45 +1780,67 @@ namespace P3D
 
                 if((size_t)fb & 1)
                 {
-                    TPixelShader::DrawScanlinePixelHigh(fb, zb, z, texture, pASR(u, uv_shift), pASR(v, uv_shift), f, l, fog_color, fog_light_map); fb++, zb++, z += dz, u += du, v+= dv, f += df, l += dl, count--;
+                    TPixelShader::template DrawScanlinePixelHigh<fog_light_row>(fb, zb, z, texture, pASR(u, uv_shift), pASR(v, uv_shift), f, l, fog_color, remap); fb++, zb++, z += dz, u += du, v+= dv, f += df, l += dl, count--;
                 }
 
                 unsigned int q = count >> 3;
 
                 while(q--)
                 {
-                    TPixelShader::DrawScanlinePixelPair(fb, zb, z, z+dz, texture, pASR(u, uv_shift), pASR(v, uv_shift), pASR((u+du), uv_shift), pASR((v+dv), uv_shift), f, f + df, l, l + dl, fog_color, fog_light_map); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), f += (df * 2), l += (dl * 2);
-                    TPixelShader::DrawScanlinePixelPair(fb, zb, z, z+dz, texture, pASR(u, uv_shift), pASR(v, uv_shift), pASR((u+du), uv_shift), pASR((v+dv), uv_shift), f, f + df, l, l + dl, fog_color, fog_light_map); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), f += (df * 2), l += (dl * 2);
-                    TPixelShader::DrawScanlinePixelPair(fb, zb, z, z+dz, texture, pASR(u, uv_shift), pASR(v, uv_shift), pASR((u+du), uv_shift), pASR((v+dv), uv_shift), f, f + df, l, l + dl, fog_color, fog_light_map); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), f += (df * 2), l += (dl * 2);
-                    TPixelShader::DrawScanlinePixelPair(fb, zb, z, z+dz, texture, pASR(u, uv_shift), pASR(v, uv_shift), pASR((u+du), uv_shift), pASR((v+dv), uv_shift), f, f + df, l, l + dl, fog_color, fog_light_map); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), f += (df * 2), l += (dl * 2);
+                    TPixelShader::template DrawScanlinePixelPair<fog_light_row>(fb, zb, z, z+dz, texture, pASR(u, uv_shift), pASR(v, uv_shift), pASR((u+du), uv_shift), pASR((v+dv), uv_shift), f, f + df, l, l + dl, fog_color, remap); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), f += (df * 2), l += (dl * 2);
+                    TPixelShader::template DrawScanlinePixelPair<fog_light_row>(fb, zb, z, z+dz, texture, pASR(u, uv_shift), pASR(v, uv_shift), pASR((u+du), uv_shift), pASR((v+dv), uv_shift), f, f + df, l, l + dl, fog_color, remap); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), f += (df * 2), l += (dl * 2);
+                    TPixelShader::template DrawScanlinePixelPair<fog_light_row>(fb, zb, z, z+dz, texture, pASR(u, uv_shift), pASR(v, uv_shift), pASR((u+du), uv_shift), pASR((v+dv), uv_shift), f, f + df, l, l + dl, fog_color, remap); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), f += (df * 2), l += (dl * 2);
+                    TPixelShader::template DrawScanlinePixelPair<fog_light_row>(fb, zb, z, z+dz, texture, pASR(u, uv_shift), pASR(v, uv_shift), pASR((u+du), uv_shift), pASR((v+dv), uv_shift), f, f + df, l, l + dl, fog_color, remap); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), f += (df * 2), l += (dl * 2);
                 }
 
                 const unsigned int r = ((count & 7) >> 1);
 
                 switch(r)
                 {
-                case 3: TPixelShader::DrawScanlinePixelPair(fb, zb, z, z+dz, texture, pASR(u, uv_shift), pASR(v, uv_shift), pASR((u+du), uv_shift), pASR((v+dv), uv_shift), f, f + df, l, l + dl, fog_color, fog_light_map); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), f += (df * 2), l += (dl * 2); [[fallthrough]];
-                case 2: TPixelShader::DrawScanlinePixelPair(fb, zb, z, z+dz, texture, pASR(u, uv_shift), pASR(v, uv_shift), pASR((u+du), uv_shift), pASR((v+dv), uv_shift), f, f + df, l, l + dl, fog_color, fog_light_map); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), f += (df * 2), l += (dl * 2); [[fallthrough]];
-                case 1: TPixelShader::DrawScanlinePixelPair(fb, zb, z, z+dz, texture, pASR(u, uv_shift), pASR(v, uv_shift), pASR((u+du), uv_shift), pASR((v+dv), uv_shift), f, f + df, l, l + dl, fog_color, fog_light_map); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), f += (df * 2), l += (dl * 2);
+                case 3: TPixelShader::template DrawScanlinePixelPair<fog_light_row>(fb, zb, z, z+dz, texture, pASR(u, uv_shift), pASR(v, uv_shift), pASR((u+du), uv_shift), pASR((v+dv), uv_shift), f, f + df, l, l + dl, fog_color, remap); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), f += (df * 2), l += (dl * 2); [[fallthrough]];
+                case 2: TPixelShader::template DrawScanlinePixelPair<fog_light_row>(fb, zb, z, z+dz, texture, pASR(u, uv_shift), pASR(v, uv_shift), pASR((u+du), uv_shift), pASR((v+dv), uv_shift), f, f + df, l, l + dl, fog_color, remap); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), f += (df * 2), l += (dl * 2); [[fallthrough]];
+                case 1: TPixelShader::template DrawScanlinePixelPair<fog_light_row>(fb, zb, z, z+dz, texture, pASR(u, uv_shift), pASR(v, uv_shift), pASR((u+du), uv_shift), pASR((v+dv), uv_shift), f, f + df, l, l + dl, fog_color, remap); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), f += (df * 2), l += (dl * 2);
                 }
 
                 if(count & 1)
-                    TPixelShader::DrawScanlinePixelLow(fb, zb, z, texture, pASR(u, uv_shift), pASR(v, uv_shift), f, l, fog_color, fog_light_map);
+                    TPixelShader::template DrawScanlinePixelLow<fog_light_row>(fb, zb, z, texture, pASR(u, uv_shift), pASR(v, uv_shift), f, l, fog_color, remap);
             }
 
 
-            void no_inline DrawTriangleScanlinePerspectiveCorrect(const TriEdgeTrace& pos, const TriDrawXDeltaZWUV& delta, const pixel* texture) const
+            void DrawTriangleScanlinePerspectiveCorrect(const TriEdgeTrace<render_flags>& pos, const TriDrawXDeltaZWUV<render_flags>& delta, const pixel* texture) const
+            {
+                if constexpr (HasFogLightRows())
+                {
+                    if(const unsigned char* row = GetFogLightRow(pos, delta))
+                    {
+                        DrawTriangleScanlinePerspectiveCorrect<true>(pos, delta, texture, row);
+                        return;
+                    }
+                }
+
+                DrawTriangleScanlinePerspectiveCorrect<false>(pos, delta, texture, fog_light_map);
+            }
+
+            template<bool fog_light_row> void no_inline DrawTriangleScanlinePerspectiveCorrect(const TriEdgeTrace<render_flags>& pos, const TriDrawXDeltaZWUV<render_flags>& delta, const pixel* texture, const unsigned char* remap) const
             {
                 const int x_start = (int)pos.x_left;
                 const int x_end = (int)pos.x_right;
 
                 unsigned int count = (x_end - x_start);
 
+#ifdef RENDER_STATS
+                render_stats->perspective_pixels += count;
+                render_stats->perspective_reciprocals += count;
+#endif
+
                 fp u = pos.u_left, v = pos.v_left, w = pos.w_left;
                 const fp du = delta.u, dv = delta.v, dw = delta.w;
 
                 pixel* fb = pos.fb_ypos + x_start;
-                z_val* zb = pos.zb_ypos + x_start;
+                z_val* zb = nullptr;
+
+                if constexpr (TriEdgeTrace<render_flags>::has_z)
+                    zb = pos.zb_ypos + x_start;
 
                 fp z = pos.z_left;
                 const fp dz = delta.z;
@@ -812,41 +1854,64 @@ namespace P3D
 
                 if((size_t)fb & 1)
                 {
-                    TPixelShader::DrawScanlinePixelHigh(fb, zb, z, texture, u * pReciprocal(w), v * pReciprocal(w), f, l, fog_color, fog_light_map); fb++, zb++, z += dz, u += du, v += dv, w += dw, f += df, l += dl, count--;
+                    TPixelShader::template DrawScanlinePixelHigh<fog_light_row>(fb, zb, z, texture, u * pReciprocal(w), v * pReciprocal(w), f, l, fog_color, remap); fb++, zb++, z += dz, u += du, v += dv, w += dw, f += df, l += dl, count--;
                 }
 
                 unsigned int s = count >> 3;
 
                 while(s--)
                 {
-                    TPixelShader::DrawScanlinePixelPair(fb, zb, z, z+dz, texture, u * pReciprocal(w), v * pReciprocal(w), (u+du) * pReciprocal(w+dw), (v+dv) * pReciprocal(w+dw), f, f+df, l, l+dl, fog_color, fog_light_map); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), w += (dw * 2), f += (df * 2), l += (dl * 2);
-                    TPixelShader::DrawScanlinePixelPair(fb, zb, z, z+dz, texture, u * pReciprocal(w), v * pReciprocal(w), (u+du) * pReciprocal(w+dw), (v+dv) * pReciprocal(w+dw), f, f+df, l, l+dl, fog_color, fog_light_map); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), w += (dw * 2), f += (df * 2), l += (dl * 2);
-                    TPixelShader::DrawScanlinePixelPair(fb, zb, z, z+dz, texture, u * pReciprocal(w), v * pReciprocal(w), (u+du) * pReciprocal(w+dw), (v+dv) * pReciprocal(w+dw), f, f+df, l, l+dl, fog_color, fog_light_map); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), w += (dw * 2), f += (df * 2), l += (dl * 2);
-                    TPixelShader::DrawScanlinePixelPair(fb, zb, z, z+dz, texture, u * pReciprocal(w), v * pReciprocal(w), (u+du) * pReciprocal(w+dw), (v+dv) * pReciprocal(w+dw), f, f+df, l, l+dl, fog_color, fog_light_map); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), w += (dw * 2), f += (df * 2), l += (dl * 2);
+                    TPixelShader::template DrawScanlinePixelPair<fog_light_row>(fb, zb, z, z+dz, texture, u * pReciprocal(w), v * pReciprocal(w), (u+du) * pReciprocal(w+dw), (v+dv) * pReciprocal(w+dw), f, f+df, l, l+dl, fog_color, remap); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), w += (dw * 2), f += (df * 2), l += (dl * 2);
+                    TPixelShader::template DrawScanlinePixelPair<fog_light_row>(fb, zb, z, z+dz, texture, u * pReciprocal(w), v * pReciprocal(w), (u+du) * pReciprocal(w+dw), (v+dv) * pReciprocal(w+dw), f, f+df, l, l+dl, fog_color, remap); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), w += (dw * 2), f += (df * 2), l += (dl * 2);
+                    TPixelShader::template DrawScanlinePixelPair<fog_light_row>(fb, zb, z, z+dz, texture, u * pReciprocal(w), v * pReciprocal(w), (u+du) * pReciprocal(w+dw), (v+dv) * pReciprocal(w+dw), f, f+df, l, l+dl, fog_color, remap); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), w += (dw * 2), f += (df * 2), l += (dl * 2);
+                    TPixelShader::template DrawScanlinePixelPair<fog_light_row>(fb, zb, z, z+dz, texture, u * pReciprocal(w), v * pReciprocal(w), (u+du) * pReciprocal(w+dw), (v+dv) * pReciprocal(w+dw), f, f+df, l, l+dl, fog_color, remap); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), w += (dw * 2), f += (df * 2), l += (dl * 2);
                 }
 
                 unsigned int t = ((count & 7) >> 1);
 
                 switch(t)
                 {
-                    case 3: TPixelShader::DrawScanlinePixelPair(fb, zb, z, z+dz, texture, u * pReciprocal(w), v * pReciprocal(w), (u+du) * pReciprocal(w+dw), (v+dv) * pReciprocal(w+dw), f, f+df, l, l+dl, fog_color, fog_light_map); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), w += (dw * 2), f += (df * 2), l += (dl * 2);
-                    case 2: TPixelShader::DrawScanlinePixelPair(fb, zb, z, z+dz, texture, u * pReciprocal(w), v * pReciprocal(w), (u+du) * pReciprocal(w+dw), (v+dv) * pReciprocal(w+dw), f, f+df, l, l+dl, fog_color, fog_light_map); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), w += (dw * 2), f += (df * 2), l += (dl * 2);
-                    case 1: TPixelShader::DrawScanlinePixelPair(fb, zb, z, z+dz, texture, u * pReciprocal(w), v * pReciprocal(w), (u+du) * pReciprocal(w+dw), (v+dv) * pReciprocal(w+dw), f, f+df, l, l+dl, fog_color, fog_light_map); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), w += (dw * 2), f += (df * 2), l += (dl * 2);
+                    case 3: TPixelShader::template DrawScanlinePixelPair<fog_light_row>(fb, zb, z, z+dz, texture, u * pReciprocal(w), v * pReciprocal(w), (u+du) * pReciprocal(w+dw), (v+dv) * pReciprocal(w+dw), f, f+df, l, l+dl, fog_color, remap); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), w += (dw * 2), f += (df * 2), l += (dl * 2); [[fallthrough]];
+                    case 2: TPixelShader::template DrawScanlinePixelPair<fog_light_row>(fb, zb, z, z+dz, texture, u * pReciprocal(w), v * pReciprocal(w), (u+du) * pReciprocal(w+dw), (v+dv) * pReciprocal(w+dw), f, f+df, l, l+dl, fog_color, remap); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), w += (dw * 2), f += (df * 2), l += (dl * 2); [[fallthrough]];
+                    case 1: TPixelShader::template DrawScanlinePixelPair<fog_light_row>(fb, zb, z, z+dz, texture, u * pReciprocal(w), v * pReciprocal(w), (u+du) * pReciprocal(w+dw), (v+dv) * pReciprocal(w+dw), f, f+df, l, l+dl, fog_color, remap); fb+=2, zb+=2, z += (dz * 2), u += (du * 2), v += (dv * 2), w += (dw * 2), f += (df * 2), l += (dl * 2);
                 }
 
                 if(count & 1)
-                    TPixelShader::DrawScanlinePixelLow(fb, zb, z, texture, u * pReciprocal(w), v * pReciprocal(w), f, l, fog_color, fog_light_map);
+                    TPixelShader::template DrawScanlinePixelLow<fog_light_row>(fb, zb, z, texture, u * pReciprocal(w), v * pReciprocal(w), f, l, fog_color, remap);
+            }
+
+            void DrawTriangleScanlineFlat(const TriEdgeTrace<render_flags>& pos, const TriDrawXDeltaZWUV<render_flags>& delta, const pixel color) const
+            {
+                if constexpr (HasFogLightRows())
+                {
+                    if(const unsigned char* row = GetFogLightRow(pos, delta))
+                    {
+                        DrawTriangleScanlineFlat<true>(pos, delta, color, row);
+                        return;
+                    }
+                }
+
+                DrawTriangleScanlineFlat<false>(pos, delta, color, fog_light_map);
             }
 
-            void no_inline DrawTriangleScanlineFlat(const TriEdgeTrace& pos, const TriDrawXDeltaZWUV& delta,  const pixel color) const
+            template<bool fog_light_row> void no_inline DrawTriangleScanlineFlat(const TriEdgeTrace<render_flags>& pos, const TriDrawXDeltaZWUV<render_flags>& delta, const pixel color, const unsigned char* remap) const
             {
+                if constexpr (render_flags & AlphaTest)
+                {
+                    if(color == 0)
+                        return;
+                }
+
                 const int x_start = (int)pos.x_left;
                 const int x_end = (int)pos.x_right;
 
                 unsigned int count = (x_end - x_start);
 
                 pixel* fb = pos.fb_ypos + x_start;
-                z_val* zb = pos.zb_ypos + x_start;
+                z_val* zb = nullptr;
+
+                if constexpr (TriEdgeTrace<render_flags>::has_z)
+                    zb = pos.zb_ypos + x_start;
 
                 fp z = pos.z_left;
                 const fp dz = delta.z;
@@ -861,7 +1926,7 @@ namespace P3D
 
                 if((size_t)fb & 1)
                 {
-                    TPixelShader::DrawScanlinePixelHigh(fb, zb, z, &color, 0, 0, f, l, fog_color, fog_light_map); fb++, zb++, z += dz, f += df, l += dl, count--;
+                    TPixelShader::template DrawScanlinePixelHigh<fog_light_row>(fb, zb, z, &color, 0, 0, f, l, fog_color, remap); fb++, zb++, z += dz, f += df, l += dl, count--;
                 }
 
                 if constexpr (render_flags & (ZBuffer | Fog | VertexLight))
@@ -870,19 +1935,19 @@ namespace P3D
 
                     while(s--)
                     {
-                        TPixelShader::DrawScanlinePixelPair(fb, zb, z, z+dz, &color, 0, 0, 0, 0, f, f+df, l, l+dl, fog_color, fog_light_map); fb+=2, zb+=2, z += (dz * 2), f += (df * 2), l += (dl * 2);
-                        TPixelShader::DrawScanlinePixelPair(fb, zb, z, z+dz, &color, 0, 0, 0, 0, f, f+df, l, l+dl, fog_color, fog_light_map); fb+=2, zb+=2, z += (dz * 2), f += (df * 2), l += (dl * 2);
-                        TPixelShader::DrawScanlinePixelPair(fb, zb, z, z+dz, &color, 0, 0, 0, 0, f, f+df, l, l+dl, fog_color, fog_light_map); fb+=2, zb+=2, z += (dz * 2), f += (df * 2), l += (dl * 2);
-                        TPixelShader::DrawScanlinePixelPair(fb, zb, z, z+dz, &color, 0, 0, 0, 0, f, f+df, l, l+dl, fog_color, fog_light_map); fb+=2, zb+=2, z += (dz * 2), f += (df * 2), l += (dl * 2);
+                        TPixelShader::template DrawScanlinePixelPair<fog_light_row>(fb, zb, z, z+dz, &color, 0, 0, 0, 0, f, f+df, l, l+dl, fog_color, remap); fb+=2, zb+=2, z += (dz * 2), f += (df * 2), l += (dl * 2);
+                        TPixelShader::template DrawScanlinePixelPair<fog_light_row>(fb, zb, z, z+dz, &color, 0, 0, 0, 0, f, f+df, l, l+dl, fog_color, remap); fb+=2, zb+=2, z += (dz * 2), f += (df * 2), l += (dl * 2);
+                        TPixelShader::template DrawScanlinePixelPair<fog_light_row>(fb, zb, z, z+dz, &color, 0, 0, 0, 0, f, f+df, l, l+dl, fog_color, remap); fb+=2, zb+=2, z += (dz * 2), f += (df * 2), l += (dl * 2);
+                        TPixelShader::template DrawScanlinePixelPair<fog_light_row>(fb, zb, z, z+dz, &color, 0, 0, 0, 0, f, f+df, l, l+dl, fog_color, remap); fb+=2, zb+=2, z += (dz * 2), f += (df * 2), l += (dl * 2);
                     }
 
                     const unsigned int t = ((count & 7) >> 1);
 
                     switch(t)
                     {
-                        case 3: TPixelShader::DrawScanlinePixelPair(fb, zb, z, z+dz, &color, 0, 0, 0, 0, f, f+df, l, l+dl, fog_color, fog_light_map); fb+=2; zb+=2, z += (dz * 2), f += (df * 2), l += (dl*2);
-                        case 2: TPixelShader::DrawScanlinePixelPair(fb, zb, z, z+dz, &color, 0, 0, 0, 0, f, f+df, l, l+dl, fog_color, fog_light_map); fb+=2; zb+=2, z += (dz * 2), f += (df * 2), l += (dl*2);
-                        case 1: TPixelShader::DrawScanlinePixelPair(fb, zb, z, z+dz, &color, 0, 0, 0, 0, f, f+df, l, l+dl, fog_color, fog_light_map); fb+=2; zb+=2, z += (dz * 2), f += (df * 2), l += (dl*2);
+                        case 3: TPixelShader::template DrawScanlinePixelPair<fog_light_row>(fb, zb, z, z+dz, &color, 0, 0, 0, 0, f, f+df, l, l+dl, fog_color, remap); fb+=2; zb+=2, z += (dz * 2), f += (df * 2), l += (dl*2); [[fallthrough]];
+                        case 2: TPixelShader::template DrawScanlinePixelPair<fog_light_row>(fb, zb, z, z+dz, &color, 0, 0, 0, 0, f, f+df, l, l+dl, fog_color, remap); fb+=2; zb+=2, z += (dz * 2), f += (df * 2), l += (dl*2); [[fallthrough]];
+                        case 1: TPixelShader::template DrawScanlinePixelPair<fog_light_row>(fb, zb, z, z+dz, &color, 0, 0, 0, 0, f, f+df, l, l+dl, fog_color, remap); fb+=2; zb+=2, z += (dz * 2), f += (df * 2), l += (dl*2);
                     }
                 }
                 else
@@ -894,32 +1959,55 @@ namespace P3D
                 }
 
                 if(count & 1)
-                    TPixelShader::DrawScanlinePixelLow(fb, zb, z, &color, 0, 0, f, l, fog_color, fog_light_map);
+                    TPixelShader::template DrawScanlinePixelLow<fog_light_row>(fb, zb, z, &color, 0, 0, f, l, fog_color, remap);
             }
 
-            constexpr bool no_inline IsTriangleFrontface(const Vertex4d screenSpacePoints[]) const
+            constexpr bool no_inline IsPolygonFrontface(const Vertex4d<render_flags> verts[], const unsigned char polygon[], const unsigned int vxCount) const
             {
-                const fp x1 = (screenSpacePoints[0].pos.x - screenSpacePoints[1].pos.x);
-                const fp y1 = (screenSpacePoints[1].pos.y - screenSpacePoints[0].pos.y);
+                //Winding of the whole fan. Clipping and merging can leave colinear or near colinear
+                //verts so a single fan triangle may have no area or only rounding error.
+                //On the same sub-pixel ints as the edge walk. Guard band polygons have areas
+                //far outside fp so the sum is 64 bit.
+                const int x0 = pToFixedInt<SUBPIXEL_BITS>(verts[polygon[0]].pos.x);
+                const int y0 = pToFixedInt<SUBPIXEL_BITS>(verts[polygon[0]].pos.y);
 
-                const fp x2 = (screenSpacePoints[1].pos.x - screenSpacePoints[2].pos.x);
-                const fp y2 = (screenSpacePoints[2].pos.y - screenSpacePoints[1].pos.y);
+                long long int area = 0;
 
-                return ((x1 * y2) >= (y1 * x2));
+                for(unsigned int i = 1; i < (vxCount - 1); i++)
+                {
+                    const int x1 = pToFixedInt<SUBPIXEL_BITS>(verts[polygon[i]].pos.x);
+                    const int y1 = pToFixedInt<SUBPIXEL_BITS>(verts[polygon[i]].pos.y);
+
+                    const int x2 = pToFixedInt<SUBPIXEL_BITS>(verts[polygon[i+1]].pos.x);
+                    const int y2 = pToFixedInt<SUBPIXEL_BITS>(verts[polygon[i+1]].pos.y);
+
+                    area += ((long long int)(x0 - x1) * (y2 - y1)) - ((long long int)(y1 - y0) * (x1 - x2));
+                }
+
+                return (area >= 0);
             }
 
-            constexpr void no_inline GetTriangleLerpXDeltas(const Vertex4d& left, const Vertex4d& right, TriDrawXDeltaZWUV& x_delta) const
+            constexpr void no_inline GetTriangleLerpXDeltas(const Vertex4d<render_flags>& left, const Vertex4d<render_flags>& right, TriDrawXDeltaZWUV<render_flags>& x_delta) const
             {
                 const fp dx = (right.pos.x != left.pos.x) ? (right.pos.x - left.pos.x) : fp(1);
 
                 if(current_texture)
                 {
-                    x_delta.u = (right.uv.x - left.uv.x) / dx;
-                    x_delta.v = (right.uv.y - left.uv.y) / dx;
-
-                    if constexpr (render_flags & (FullPerspectiveMapping | SubdividePerspectiveMapping))
+                    if(HasFaceGradients())
+                    {
+                        x_delta.u = face_x_delta.u;
+                        x_delta.v = face_x_delta.v;
+                        x_delta.w = face_x_delta.w;
+                    }
+                    else
                     {
-                        x_delta.w = (right.pos.w - left.pos.w) / dx;
+                        x_delta.u = (right.uv.x - left.uv.x) / dx;
+                        x_delta.v = (right.uv.y - left.uv.y) / dx;
+
+                        if constexpr (render_flags & (FullPerspectiveMapping | SubdividePerspectiveMapping))
+                        {
+                            x_delta.w = (right.pos.w - left.pos.w) / dx;
+                        }
                     }
                 }
 
@@ -939,7 +2027,40 @@ namespace P3D
                 }
             }
 
-            constexpr void no_inline GetTriangleLerpYDeltas(const Vertex4d& a, const Vertex4d& b, TriDrawYDeltaZWUV& y_delta) const
+            constexpr TriDrawXDeltaZWUV<render_flags> ScaleXDelta(const TriDrawXDeltaZWUV<render_flags>& delta, const fp scale) const
+            {
+                TriDrawXDeltaZWUV<render_flags> out;
+
+                if(current_texture)
+                {
+                    out.u = delta.u * scale;
+                    out.v = delta.v * scale;
+
+                    if constexpr (render_flags & (FullPerspectiveMapping | SubdividePerspectiveMapping))
+                    {
+                        out.w = delta.w * scale;
+                    }
+                }
+
+                if constexpr (render_flags & (ZTest | ZWrite))
+                {
+                    out.z = delta.z * scale;
+                }
+
+                if constexpr (render_flags & Fog)
+                {
+                    out.f = delta.f * scale;
+                }
+
+                if constexpr (render_flags & VertexLight)
+                {
+                    out.l = delta.l * scale;
+                }
+
+                return out;
+            }
+
+            constexpr void no_inline GetTriangleLerpYDeltas(const Vertex4d<render_flags>& a, const Vertex4d<render_flags>& b, TriDrawYDeltaZWUV<render_flags>& y_delta) const
             {
                 const fp dy = (a.pos.y != b.pos.y) ? (a.pos.y - b.pos.y) : fp(1);
 
@@ -947,12 +2068,26 @@ namespace P3D
 
                 if(current_texture)
                 {
-                    y_delta.u = (a.uv.x - b.uv.x) / dy;
-                    y_delta.v = (a.uv.y - b.uv.y) / dy;
+                    if(HasFaceGradients())
+                    {
+                        //Step along the edge. d/dy + (dx/dy * d/dx)
+                        y_delta.u = face_y_delta.u + (y_delta.x * face_x_delta.u);
+                        y_delta.v = face_y_delta.v + (y_delta.x * face_x_delta.v);
 
-                    if constexpr (render_flags & (FullPerspectiveMapping | SubdividePerspectiveMapping))
+                        if constexpr (render_flags & (FullPerspectiveMapping | SubdividePerspectiveMapping))
+                        {
+                            y_delta.w = face_y_delta.w + (y_delta.x * face_x_delta.w);
+                        }
+                    }
+                    else
                     {
-                        y_delta.w = (a.pos.w - b.pos.w) / dy;
+                        y_delta.u = (a.uv.x - b.uv.x) / dy;
+                        y_delta.v = (a.uv.y - b.uv.y) / dy;
+
+                        if constexpr (render_flags & (FullPerspectiveMapping | SubdividePerspectiveMapping))
+                        {
+                            y_delta.w = (a.pos.w - b.pos.w) / dy;
+                        }
                     }
                 }
 
@@ -972,7 +2107,7 @@ namespace P3D
                 }
             }
 
-            constexpr void no_inline LerpVertex(Vertex4d& out, const Vertex4d& left, const Vertex4d& right, const fp frac) const
+            constexpr void no_inline LerpVertex(Vertex4d<render_flags>& out, const Vertex4d<render_flags>& left, const Vertex4d<render_flags>& right, const fp frac) const
             {
                 out.pos.x = pLerp(left.pos.x, right.pos.x, frac);
                 out.pos.y = pLerp(left.pos.y, right.pos.y, frac);
@@ -1000,6 +2135,86 @@ namespace P3D
                 }
             }
 
+            constexpr bool HasFaceGradients() const
+            {
+                if constexpr (render_flags & (FullPerspectiveMapping | SubdividePerspectiveMapping))
+                    return face_gradients;
+                else
+                    return false;
+            }
+
+            //Screen space gradients of the perspective corrected u, v and w across a planar face.
+            //Verts are in NDC with their clip space w and un-corrected uvs.
+            bool no_inline GetFaceTextureGradients(const Vertex4d<render_flags> verts[], const unsigned char polygon[], const unsigned int vxCount, const V3<fp> texture_axes[2])
+            {
+                //The vert nearest the centre of the screen keeps the maths in range.
+                const Vertex4d<render_flags>* ref = &verts[polygon[0]];
+
+                for(unsigned int i = 1; i < vxCount; i++)
+                {
+                    const Vertex4d<render_flags>& v = verts[polygon[i]];
+
+                    if((pAbs(v.pos.x) + pAbs(v.pos.y)) < (pAbs(ref->pos.x) + pAbs(ref->pos.y)))
+                        ref = &v;
+                }
+
+                if((pAbs(ref->pos.x) + pAbs(ref->pos.y)) > fp(4))
+                    return false;
+
+                //Columns a, b and c map (du, dv, w_ref) to clip space (x, y, w) of a point on the face.
+                //The rows of the inverse give (du/w, dv/w, w_ref/w) at any NDC point as cross products.
+                const V4<fp> a = transform_matrix->mapVector(texture_axes[0]);
+                const V4<fp> b = transform_matrix->mapVector(texture_axes[1]);
+                const fp cx = ref->pos.x, cy = ref->pos.y;
+
+                const fp bc_x = b.y - (b.w * cy);
+                const fp bc_y = (b.w * cx) - b.x;
+                const fp bc_w = (b.x * cy) - (b.y * cx);
+
+                const fp det = (a.x * bc_x) + (a.y * bc_y) + (a.w * bc_w);
+
+                if(det == 0)
+                    return false;
+
+                const fp ca_x = (cy * a.w) - a.y;
+                const fp ca_y = a.x - (cx * a.w);
+
+                const fp ab_x = (a.y * b.w) - (a.w * b.y);
+                const fp ab_y = (a.w * b.x) - (a.x * b.w);
+
+                //NDC to screen. y is flipped.
+                const fp halfFbX = pASR(current_viewport->width, 1);
+                const fp halfFbY = pASR(current_viewport->height, 1);
+
+                const fp w_ref = max_w_tex_scale / ref->pos.w;
+
+                face_x_delta.w = (w_ref * (ab_x / det)) / halfFbX;
+                face_y_delta.w = -(w_ref * (ab_y / det)) / halfFbY;
+
+                face_x_delta.u = (ref->uv.x * face_x_delta.w) + ((max_w_tex_scale * (bc_x / det)) / halfFbX);
+                face_y_delta.u = (ref->uv.x * face_y_delta.w) - ((max_w_tex_scale * (bc_y / det)) / halfFbY);
+
+                face_x_delta.v = (ref->uv.y * face_x_delta.w) + ((max_w_tex_scale * (ca_x / det)) / halfFbX);
+                face_y_delta.v = (ref->uv.y * face_y_delta.w) - ((max_w_tex_scale * (ca_y / det)) / halfFbY);
+
+                return true;
+            }
+
+            constexpr void ToScreenSpace(V4<fp>& pos) const
+            {
+                //z is only needed for the depth buffer.
+                if(pos.w != fp(1))
+                {
+                    pos.x = pos.x / pos.w;
+                    pos.y = pos.y / pos.w;
+
+                    if constexpr (render_flags & (ZTest | ZWrite))
+                    {
+                        pos.z = pos.z / pos.w;
+                    }
+                }
+            }
+
             constexpr fp fracToY(const fp frac) const
             {
                 const fp halfFbY = pASR(current_viewport->height, 1);
@@ -1012,11 +2227,6 @@ namespace P3D
                 return (halfFbX * frac) + halfFbX;
             }
 
-            constexpr fp PixelCentre(const fp x) const
-            {                
-                return pCeil(x - fp(0.5)) + fp(0.5);
-            }
-
             constexpr fp no_inline PointOnLineSide2d(const V4<fp>& l1, const V4<fp>& l2, const V4<fp>& p) const
             {
                 //Left < 0
@@ -1048,17 +2258,20 @@ namespace P3D
                 return fp(1) - ((w - near) * z_planes->z_ratio_3);
             }
 
-            constexpr fp no_inline GetZDelta(const Vertex4d verts[3]) const
+            constexpr fp no_inline GetZDelta(const Vertex4d<render_flags> verts[], const unsigned int vxCount) const
             {
-                fp z0 = WtoZ(verts[0].pos.w);
-                fp z1 = WtoZ(verts[1].pos.w);
-                fp z2 = WtoZ(verts[2].pos.w);
+                fp z_min = WtoZ(verts[0].pos.w);
+                fp z_max = z_min;
 
-                fp d1 = pAbs(z0 - z1);
-                fp d2 = pAbs(z0 - z2);
-                fp d3 = pAbs(z1 - z2);
+                for(unsigned int i = 1; i < vxCount; i++)
+                {
+                    const fp z = WtoZ(verts[i].pos.w);
+
+                    z_min = pMin(z_min, z);
+                    z_max = pMax(z_max, z);
+                }
 
-                fp maxd = pMin(fp(1), pMax(d1, pMax(d2, d3)));
+                fp maxd = pMin(fp(1), z_max - z_min);
 
                 return maxd * fp(256); //Scale to 0..256 range.
             }
@@ -1125,18 +2338,80 @@ namespace P3D
             const RenderTargetViewport* current_viewport = nullptr;
             const RenderDeviceNearFarPlanes* z_planes = nullptr;
             const RenderDeviceFogParameters* fog_params = nullptr;
+            const M4<fp>* transform_matrix = nullptr;
             fp max_w_tex_scale = 0;
 
             const pixel* current_texture = nullptr;
             pixel current_color = 0;
             bool subdivide_spans = false;
 
+            //w is near constant along each scanline of the current polygon. Spans are drawn affine with one reciprocal.
+            bool constant_w_spans = false;
+
+            //Texture gradients of the current face from its texture axes.
+            bool face_gradients = false;
+            TriDrawXDeltaZWUV<render_flags> face_x_delta;
+            TriDrawXDeltaZWUV<render_flags> face_y_delta;
+
             const unsigned char* fog_light_map = nullptr;
 
+            const unsigned char* current_alpha_skip = nullptr;
+
 #ifdef RENDER_STATS
             RenderStats* render_stats = nullptr;
 #endif
 
+            static_assert(SETUP_BUFFER_VERTS >= CLIP_POLYGON_MAX_VERTS, "Setup buffer must hold a clipped polygon.");
+
+            PolygonSetup<render_flags> setup_polygons[SETUP_BUFFER_POLYGONS];
+            Vertex4d<render_flags> setup_vertexes[SETUP_BUFFER_VERTS];
+            unsigned int setup_polygon_count = 0;
+            unsigned int setup_vertex_count = 0;
+
+#ifdef SETUP_BATCH
+            //Moves the setup buffer to the end of the batch.
+            void RecordSetupPolygons()
+            {
+                if(setup_polygon_count)
+                {
+                    std::unique_ptr<SetupBatchModeBase>& recorded = setup_batch->modes[setup_batch_mode];
+
+                    //The batch was last recorded with other modes.
+                    if(!recorded || (recorded->render_flags != render_flags))
+                        recorded.reset(new SetupBatchMode<render_flags>());
+
+                    SetupBatchMode<render_flags>* storage = static_cast<SetupBatchMode<render_flags>*>(recorded.get());
+
+                    SetupBatchRun run;
+                    run.mode = setup_batch_mode;
+                    run.polygon_offset = storage->polygons.size();
+                    run.polygon_count = setup_polygon_count;
+                    run.vertex_offset = storage->vertexes.size();
+
+                    setup_batch->runs.push_back(run);
+
+                    storage->polygons.insert(storage->polygons.end(), setup_polygons, setup_polygons + setup_polygon_count);
+                    storage->vertexes.insert(storage->vertexes.end(), setup_vertexes, setup_vertexes + setup_vertex_count);
+                }
+
+                setup_polygon_count = 0;
+                setup_vertex_count = 0;
+            }
+
+            SetupBatch* setup_batch = nullptr;
+            unsigned int setup_batch_mode = 0; //Index of this mode in the device that made it.
+#endif
+
+#ifdef DEFERRED_SPANS
+            //Only Z buffered modes. Without both a test and a write the order spans are drawn in shows.
+            static constexpr bool defer_spans = ((render_flags & ZBuffer) == ZBuffer);
+            static constexpr unsigned int deferred_span_max = defer_spans ? DEFERRED_SPAN_MAX : 1;
+
+            mutable DeferredSpan<render_flags> deferred_spans[deferred_span_max];
+            unsigned short deferred_order[deferred_span_max];
+            mutable unsigned int deferred_span_count = 0;
+#endif
+
         };
     };
 };
@@ -4,26 +4,62 @@
 
 namespace P3D
 {
-    Stack<unsigned int> BspModel::stack;
-    List<unsigned int> BspModel::node_list;
+    void BspModel::Sort(const V3<fp>& p, const AABB<fp>& frustrum, std::vector<const BspModelTriangle *> &out, bool backface_cull, BspQueryContext& context) const
+    {
+        out.clear();
+        context.stack.Clear();
+        context.node_list.Clear();
 
-    void BspModel::Sort(const V3<fp>& p, const AABB<fp>& frustrum, std::vector<const BspModelTriangle *> &out, bool backface_cull) const
+        SortBackToFront(p, frustrum, context);
+        OutputTris(frustrum, out, backface_cull, context);
+    }
+
+    void BspModel::Sort(const V3<fp>& p, const Plane<fp> frustrum[6], std::vector<const BspModelPolygon *> &out, bool backface_cull, BspQueryContext& context) const
     {
         out.clear();
-        node_list.Clear();
+        context.stack.Clear();
+        context.node_list.Clear();
 
-        SortBackToFront(p, frustrum);
-        OutputTris(frustrum, out, backface_cull);
+        SortBackToFront(p, frustrum, context);
+        OutputPolygons(frustrum, out, backface_cull, context);
     }
 
     constexpr unsigned int BACK_BIT = 1 << 31;
     constexpr unsigned int POST_BIT = 1 << 30;
 
-    constexpr unsigned int NODE_MASK = ~(BACK_BIT | POST_BIT);
+    //Bit n set = node is fully inside frustrum plane n.
+    constexpr unsigned int INSIDE_SHIFT = 24;
+    constexpr unsigned int INSIDE_ALL = 0x3f;
+    constexpr unsigned int INSIDE_BITS = INSIDE_ALL << INSIDE_SHIFT;
+
+    constexpr unsigned int NODE_MASK = ~(BACK_BIT | POST_BIT | INSIDE_BITS);
+
+    static_assert(NODE_MASK + 1 == BSP_MAX_NODES, "Node indexes must fit below the traversal flags.");
+
+    bool BspModel::CheckLimits() const
+    {
+        if(header.node_count > BSP_MAX_NODES)
+            return false;
+
+        //CheckSortCache() bounds how far the eye has moved from every plane by the sum of its axis moves.
+        //That only holds while no normal component is over 1, as with unit normals.
+        for(unsigned int i = 0; i < header.node_count; i++)
+        {
+            const V3<fp> normal = GetNode(i)->plane.Normal();
+
+            if((pAbs(normal.x) > 1) || (pAbs(normal.y) > 1) || (pAbs(normal.z) > 1))
+                return false;
+        }
 
-    void BspModel::SortBackToFront(const V3<fp>& p, const AABB<fp>& frustrum) const
+        return true;
+    }
+
+    void BspModel::SortBackToFront(const V3<fp>& p, const AABB<fp>& frustrum, BspQueryContext& context, unsigned int root) const
     {
-        stack.Push(0);
+        Stack<unsigned int>& stack = context.stack;
+        List<unsigned int>& node_list = context.node_list;
+
+        stack.Push(root);
 
         while(!stack.Empty())
         {
@@ -70,8 +106,10 @@ namespace P3D
         }
     }
 
-    void BspModel::OutputTris(const AABB<fp>& frustrum, std::vector<const BspModelTriangle *> &out, bool backface_cull) const
+    void BspModel::OutputTris(const AABB<fp>& frustrum, std::vector<const BspModelTriangle *> &out, bool backface_cull, const BspQueryContext& context) const
     {
+        const List<unsigned int>& node_list = context.node_list;
+
         for(unsigned int i = 0; i < node_list.Size(); i++)
         {
             const unsigned int node = node_list.At(i);
@@ -102,4 +140,587 @@ namespace P3D
             }
         }
     }
+
+    void BspModel::SortBackToFront(const V3<fp>& p, const Plane<fp> frustrum[6], BspQueryContext& context, unsigned int root) const
+    {
+        Stack<unsigned int>& stack = context.stack;
+        List<unsigned int>& node_list = context.node_list;
+
+        stack.Push(root);
+
+        while(!stack.Empty())
+        {
+            const unsigned int item = stack.Pop();
+
+            const BspModelNode* n = GetNode(item & NODE_MASK);
+
+            //Planes the parent was already fully inside of are not tested again.
+            unsigned int inside_mask = (item & INSIDE_BITS) >> INSIDE_SHIFT;
+
+            if (!FrustrumCullAABB(n->child_bb, frustrum, inside_mask))
+                continue;
+
+            const unsigned int inside_bits = inside_mask << INSIDE_SHIFT;
+
+            if (item & POST_BIT)
+            {
+                if (FrustrumCullAABB(n->node_bb, frustrum, inside_mask))
+                {
+                    const unsigned int node = (item & NODE_MASK) | (inside_mask << INSIDE_SHIFT);
+
+                    if (item & BACK_BIT)
+                        node_list.Add(node);
+                    else
+                        node_list.Add(node | BACK_BIT);
+                }
+            }
+            else
+            {
+                const unsigned int node = (item & NODE_MASK) | inside_bits;
+
+                if(Distance(n->plane, p) >= 0)
+                {
+                    if (n->front_node)
+                        stack.Push(n->front_node | inside_bits);
+
+                    stack.Push(node | POST_BIT);
+
+                    if (n->back_node)
+                        stack.Push(n->back_node | inside_bits);
+                }
+                else
+                {
+                    if (n->back_node)
+                        stack.Push(n->back_node | inside_bits);
+
+                    stack.Push(node | POST_BIT | BACK_BIT);
+
+                    if (n->front_node)
+                        stack.Push(n->front_node | inside_bits);
+                }
+            }
+        }
+    }
+
+    void BspModel::OutputPolygons(const Plane<fp> frustrum[6], std::vector<const BspModelPolygon *> &out, bool backface_cull, const BspQueryContext& context) const
+    {
+        const List<unsigned int>& node_list = context.node_list;
+
+        for(unsigned int i = 0; i < node_list.Size(); i++)
+        {
+            const unsigned int node = node_list.At(i);
+
+            const BspModelNode* n = GetNode(node & NODE_MASK);
+
+            const unsigned int inside_mask = (node & INSIDE_BITS) >> INSIDE_SHIFT;
+
+            OutputPolygonList((node & BACK_BIT) ? &n->back_polys : &n->front_polys, frustrum, inside_mask, out);
+
+            if(!backface_cull)
+                OutputPolygonList((node & BACK_BIT) ? &n->front_polys : &n->back_polys, frustrum, inside_mask, out);
+        }
+    }
+
+    bool BspModel::SortCoherent(const V3<fp>& p, const Plane<fp> frustrum[6], std::vector<const BspModelPolygon *> &out, bool backface_cull, BspSortCache& cache, BspQueryContext& context) const
+    {
+        out.clear();
+        context.stack.Clear();
+        context.node_list.Clear();
+
+        const bool hit = CheckSortCache(p, cache);
+
+        if(!hit)
+            BuildSortCache(p, cache);
+
+        ReplaySortCache(frustrum, cache, context);
+        OutputPolygons(frustrum, out, backface_cull, context);
+
+        return hit;
+    }
+
+    constexpr unsigned int NO_PARENT = ~0u;
+
+    bool BspModel::CheckSortCache(const V3<fp>& p, BspSortCache& cache) const
+    {
+        if(cache.model != this)
+            return false;
+
+        //Can't have crossed any plane if we moved less than the distance to the nearest one.
+        const V3<fp> d = p - cache.eye;
+
+        if((pAbs(d.x) + pAbs(d.y) + pAbs(d.z)) < cache.safe_distance)
+            return true;
+
+        fp safe_distance = std::numeric_limits<fp>::max();
+
+        for(unsigned int i = 0; i < cache.items.size(); i++)
+        {
+            const unsigned int item = cache.items[i].item;
+
+            if(!(item & POST_BIT))
+                continue;
+
+            const fp dist = Distance(GetNode(item & NODE_MASK)->plane, p);
+
+            //Eye has changed side. Order is stale.
+            if((dist >= 0) == bool(item & BACK_BIT))
+                return false;
+
+            safe_distance = pMin(safe_distance, pAbs(dist));
+        }
+
+        cache.eye = p;
+        cache.safe_distance = safe_distance;
+
+        return true;
+    }
+
+    void BspModel::BuildSortCache(const V3<fp>& p, BspSortCache& cache) const
+    {
+        fp safe_distance = std::numeric_limits<fp>::max();
+
+        cache.items.clear();
+        cache.stack.clear();
+
+        //Same traversal as SortBackToFront, minus the culling. Stack holds item, parent pairs.
+        cache.stack.push_back(NO_PARENT);
+        cache.stack.push_back(0);
+
+        while(!cache.stack.empty())
+        {
+            const unsigned int item = cache.stack.back(); cache.stack.pop_back();
+            const unsigned int parent = cache.stack.back(); cache.stack.pop_back();
+
+            const unsigned int index = cache.items.size();
+
+            cache.items.push_back({item, index + 1, parent});
+
+            if(item & POST_BIT)
+                continue;
+
+            const BspModelNode* n = GetNode(item);
+
+            const fp dist = Distance(n->plane, p);
+
+            safe_distance = pMin(safe_distance, pAbs(dist));
+
+            if(dist >= 0)
+            {
+                if (n->front_node)
+                    cache.stack.push_back(index), cache.stack.push_back(n->front_node);
+
+                cache.stack.push_back(index), cache.stack.push_back(item | POST_BIT);
+
+                if (n->back_node)
+                    cache.stack.push_back(index), cache.stack.push_back(n->back_node);
+            }
+            else
+            {
+                if (n->back_node)
+                    cache.stack.push_back(index), cache.stack.push_back(n->back_node);
+
+                cache.stack.push_back(index), cache.stack.push_back(item | POST_BIT | BACK_BIT);
+
+                if (n->front_node)
+                    cache.stack.push_back(index), cache.stack.push_back(n->front_node);
+            }
+        }
+
+        //Children always follow their parent, so walking backwards pushes
+        //the end of each subtree up to its root.
+        for(unsigned int i = cache.items.size() - 1; i > 0; i--)
+        {
+            BspSortCacheItem& parent = cache.items[cache.items[i].parent];
+
+            parent.skip = pMax(parent.skip, cache.items[i].skip);
+        }
+
+        cache.masks.resize(cache.items.size());
+
+        cache.model = this;
+        cache.eye = p;
+        cache.safe_distance = safe_distance;
+    }
+
+    void BspModel::ReplaySortCache(const Plane<fp> frustrum[6], BspSortCache& cache, BspQueryContext& context) const
+    {
+        List<unsigned int>& node_list = context.node_list;
+
+        unsigned int i = 0;
+
+        while(i < cache.items.size())
+        {
+            const BspSortCacheItem& ci = cache.items[i];
+
+            const BspModelNode* n = GetNode(ci.item & NODE_MASK);
+
+            unsigned int inside_mask = (ci.parent == NO_PARENT) ? 0 : cache.masks[ci.parent];
+
+            if (ci.item & POST_BIT)
+            {
+                if (FrustrumCullAABB(n->node_bb, frustrum, inside_mask))
+                {
+                    const unsigned int node = (ci.item & NODE_MASK) | (inside_mask << INSIDE_SHIFT);
+
+                    if (ci.item & BACK_BIT)
+                        node_list.Add(node);
+                    else
+                        node_list.Add(node | BACK_BIT);
+                }
+            }
+            else
+            {
+                //Skip whole subtree.
+                if (!FrustrumCullAABB(n->child_bb, frustrum, inside_mask))
+                {
+                    i = ci.skip;
+                    continue;
+                }
+
+                cache.masks[i] = inside_mask;
+            }
+
+            i++;
+        }
+    }
+
+    void BspModel::OutputPolygonList(const TriIndexList* list, const Plane<fp> frustrum[6], const unsigned int inside_mask, std::vector<const BspModelPolygon *> &out) const
+    {
+        if(inside_mask == INSIDE_ALL)
+        {
+            //Whole node is inside the frustrum. No per-polygon tests needed.
+            for(unsigned int i = 0; i < list->count; i++)
+                out.push_back(GetPolygon(list->offset + i));
+
+            return;
+        }
+
+        for(unsigned int i = 0; i < list->count; i++)
+        {
+            const BspModelPolygon* poly = GetPolygon(list->offset + i);
+
+            if(FrustrumCullPolygon(poly, frustrum, inside_mask))
+                out.push_back(poly);
+        }
+    }
+
+    bool BspModel::FrustrumCullAABB(const AABB<fp>& bb, const Plane<fp> frustrum[6], unsigned int& inside_mask) const
+    {
+        for(unsigned int i = Left; i <= Near; i++)
+        {
+            const unsigned int bit = (1 << i);
+
+            if(inside_mask & bit)
+                continue;
+
+            const int side = bb.PlaneSide(frustrum[i]);
+
+            if(side < 0)
+                return false;
+
+            if(side > 0)
+                inside_mask |= bit;
+        }
+
+        return true;
+    }
+
+    bool BspModel::FrustrumCullPolygon(const BspModelPolygon* poly, const Plane<fp> frustrum[6], const unsigned int inside_mask) const
+    {
+        for(unsigned int i = Left; i <= Near; i++)
+        {
+            if(inside_mask & (1 << i))
+                continue;
+
+            //Rejected only if every vert is behind the plane.
+            unsigned int v = 0;
+
+            while((v < poly->vertex_count) && (frustrum[i].DistanceToPoint(poly->verts[v].pos) < 0))
+                v++;
+
+            if(v == poly->vertex_count)
+                return false;
+        }
+
+        return true;
+    }
+
+#ifdef BSP_PARALLEL_SORT
+    void BspModel::SortParallel(const V3<fp>& p, const AABB<fp>& frustrum, std::vector<const BspModelTriangle *> &out, bool backface_cull, BspSortPool& pool, unsigned int split_depth) const
+    {
+        out.clear();
+
+        pool.Reserve(GetQueryCapacity());
+
+        pool.segments.clear();
+        SplitBackToFront(p, frustrum, 0, split_depth, pool.segments);
+
+        std::vector<std::vector<const BspModelTriangle*>>& lists = pool.tri_lists;
+
+        if(lists.size() < pool.segments.size())
+            lists.resize(pool.segments.size());
+
+        pool.Run([&](unsigned int i, BspQueryContext& context)
+        {
+            const BspSortSegment& segment = pool.segments[i];
+
+            context.stack.Clear();
+            context.node_list.Clear();
+
+            if(segment.subtree)
+                SortBackToFront(p, frustrum, context, segment.item);
+            else
+                context.node_list.Add(segment.item);
+
+            lists[i].clear();
+            OutputTris(frustrum, lists[i], backface_cull, context);
+        });
+
+        for(unsigned int i = 0; i < pool.segments.size(); i++)
+            out.insert(out.end(), lists[i].begin(), lists[i].end());
+    }
+
+    void BspModel::SortParallel(const V3<fp>& p, const Plane<fp> frustrum[6], std::vector<const BspModelPolygon *> &out, bool backface_cull, BspSortPool& pool, unsigned int split_depth) const
+    {
+        out.clear();
+
+        pool.Reserve(GetQueryCapacity());
+
+        pool.segments.clear();
+        SplitBackToFront(p, frustrum, 0, split_depth, pool.segments);
+
+        std::vector<std::vector<const BspModelPolygon*>>& lists = pool.poly_lists;
+
+        if(lists.size() < pool.segments.size())
+            lists.resize(pool.segments.size());
+
+        pool.Run([&](unsigned int i, BspQueryContext& context)
+        {
+            const BspSortSegment& segment = pool.segments[i];
+
+            context.stack.Clear();
+            context.node_list.Clear();
+
+            if(segment.subtree)
+                SortBackToFront(p, frustrum, context, segment.item);
+            else
+                context.node_list.Add(segment.item);
+
+            lists[i].clear();
+            OutputPolygons(frustrum, lists[i], backface_cull, context);
+        });
+
+        for(unsigned int i = 0; i < pool.segments.size(); i++)
+            out.insert(out.end(), lists[i].begin(), lists[i].end());
+    }
+
+    //The first depth levels of SortBackToFront, recursively. Each node is one segment and each subtree below is another.
+    void BspModel::SplitBackToFront(const V3<fp>& p, const AABB<fp>& frustrum, unsigned int item, unsigned int depth, std::vector<BspSortSegment>& segments) const
+    {
+        //The subtree's task does its own culling.
+        if(depth == 0)
+        {
+            segments.push_back({item, true});
+            return;
+        }
+
+        const BspModelNode* n = GetNode(item);
+
+        if (!frustrum.Intersect(n->child_bb))
+            return;
+
+        const bool front = Distance(n->plane, p) >= 0;
+
+        const unsigned int far_node = front ? n->back_node : n->front_node;
+        const unsigned int near_node = front ? n->front_node : n->back_node;
+
+        if (far_node)
+            SplitBackToFront(p, frustrum, far_node, depth - 1, segments);
+
+        if (frustrum.Intersect(n->node_bb))
+            segments.push_back({front ? (item | BACK_BIT) : item, false});
+
+        if (near_node)
+            SplitBackToFront(p, frustrum, near_node, depth - 1, segments);
+    }
+
+    void BspModel::SplitBackToFront(const V3<fp>& p, const Plane<fp> frustrum[6], unsigned int item, unsigned int depth, std::vector<BspSortSegment>& segments) const
+    {
+        if(depth == 0)
+        {
+            segments.push_back({item, true});
+            return;
+        }
+
+        const BspModelNode* n = GetNode(item & NODE_MASK);
+
+        unsigned int inside_mask = (item & INSIDE_BITS) >> INSIDE_SHIFT;
+
+        if (!FrustrumCullAABB(n->child_bb, frustrum, inside_mask))
+            return;
+
+        const unsigned int inside_bits = inside_mask << INSIDE_SHIFT;
+
+        const bool front = Distance(n->plane, p) >= 0;
+
+        const unsigned int far_node = front ? n->back_node : n->front_node;
+        const unsigned int near_node = front ? n->front_node : n->back_node;
+
+        if (far_node)
+            SplitBackToFront(p, frustrum, far_node | inside_bits, depth - 1, segments);
+
+        if (FrustrumCullAABB(n->node_bb, frustrum, inside_mask))
+        {
+            const unsigned int node = (item & NODE_MASK) | (inside_mask << INSIDE_SHIFT);
+
+            segments.push_back({front ? (node | BACK_BIT) : node, false});
+        }
+
+        if (near_node)
+            SplitBackToFront(p, frustrum, near_node | inside_bits, depth - 1, segments);
+    }
+
+    BspSortPool::BspSortPool(unsigned int threads)
+    {
+        const unsigned int count = pMax(threads, 1u);
+
+        for(unsigned int i = 0; i < count; i++)
+            workers.push_back(std::make_unique<Worker>());
+
+        for(unsigned int i = 1; i < count; i++)
+            this->threads.emplace_back(&BspSortPool::WorkerThread, this, i);
+    }
+
+    BspSortPool::~BspSortPool()
+    {
+        {
+            std::lock_guard<std::mutex> l(wake_lock);
+            quit = true;
+        }
+
+        wake.notify_all();
+
+        for(std::thread& t : threads)
+            t.join();
+    }
+
+    void BspSortPool::Reserve(unsigned int capacity)
+    {
+        if(capacity <= this->capacity)
+            return;
+
+        for(std::unique_ptr<Worker>& w : workers)
+            w->context.Reserve(capacity);
+
+        this->capacity = capacity;
+    }
+
+    void BspSortPool::Run(Task task, const void* data)
+    {
+        const unsigned int count = segments.size();
+
+        overflow.store(false, std::memory_order_relaxed);
+
+        if(!count)
+            return;
+
+        this->task = task;
+        task_data = data;
+        pending.store(count, std::memory_order_relaxed);
+
+        //Neighbouring segments go to different workers so no one queue holds all of a big part of the tree.
+        for(unsigned int i = 0; i < count; i++)
+        {
+            Worker& w = *workers[i % workers.size()];
+
+            std::lock_guard<std::mutex> l(w.lock);
+            w.segments.push_back(i);
+        }
+
+        {
+            std::lock_guard<std::mutex> l(wake_lock);
+            generation++;
+        }
+
+        wake.notify_all();
+
+        while(RunOne(0)) {}
+
+        //Segments are only queued above, so what's left is running on other workers.
+        unsigned int left;
+
+        while((left = pending.load(std::memory_order_acquire)) != 0)
+            pending.wait(left, std::memory_order_acquire);
+    }
+
+    bool BspSortPool::RunOne(unsigned int worker)
+    {
+        const unsigned int count = workers.size();
+
+        unsigned int segment = 0;
+        bool found = false;
+
+        {
+            Worker& w = *workers[worker];
+
+            std::lock_guard<std::mutex> l(w.lock);
+
+            if(!w.segments.empty())
+            {
+                segment = w.segments.back();
+                w.segments.pop_back();
+                found = true;
+            }
+        }
+
+        for(unsigned int i = 1; (i < count) && !found; i++)
+        {
+            Worker& w = *workers[(worker + i) % count];
+
+            std::lock_guard<std::mutex> l(w.lock);
+
+            if(!w.segments.empty())
+            {
+                segment = w.segments.front();
+                w.segments.pop_front();
+                found = true;
+            }
+        }
+
+        if(!found)
+            return false;
+
+        task(task_data, segment, workers[worker]->context);
+
+        if(workers[worker]->context.Overflowed())
+            overflow.store(true, std::memory_order_relaxed);
+
+        if(pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            pending.notify_one();
+
+        return true;
+    }
+
+    void BspSortPool::WorkerThread(unsigned int worker)
+    {
+        unsigned int seen = 0;
+
+        while(true)
+        {
+            {
+                std::unique_lock<std::mutex> l(wake_lock);
+
+                wake.wait(l, [&]{ return quit || (generation != seen); });
+
+                if(quit)
+                    return;
+
+                seen = generation;
+            }
+
+            //Nothing is queued once this finds no segment, so it sleeps until the next Run().
+            while(RunOne(worker)) {}
+        }
+    }
+#endif
 }
@@ -3,47 +3,235 @@
 
 #include <vector>
 #include <stack>
+#include <cassert>
+#include "Config.h"
 #include "BspModelDefs.h"
 
+#ifdef BSP_PARALLEL_SORT
+    #include <thread>
+    #include <mutex>
+    #include <condition_variable>
+    #include <atomic>
+    #include <deque>
+    #include <memory>
+#endif
+
 namespace P3D
 {
-    //Bare minimum monday stack.
+    //Nodes a BspQueryContext holds room for unless told otherwise.
+    inline constexpr unsigned int BSP_QUERY_CAPACITY = 2048;
+
+    //Bare minimum monday stack. Items pushed when full are dropped and Overflowed() is set.
     template <class T> class Stack
     {
     public:
-        Stack(unsigned int size = 2048) { pos = mem = (T*)new char[sizeof(T) * size]; }
-        ~Stack()                        { delete[] mem; }
-        void Push(T item)               { *pos = item; pos++; }
-        T Pop()                         { pos--; return *pos; }
+        Stack(unsigned int size = BSP_QUERY_CAPACITY) { Allocate(size); }
+        ~Stack()                        { delete[] (char*)mem; }
+        Stack(const Stack&) = delete;
+        Stack& operator=(const Stack&) = delete;
+        void Push(T item)               { if(pos == end) { overflow = true; return; } *pos = item; pos++; }
+        T Pop()                         { assert(pos != mem); pos--; return *pos; }
         bool Empty() const              { return pos == mem; }
-        void Clear()                    { pos = mem; }
+        void Clear()                    { pos = mem; overflow = false; }
+        bool Overflowed() const         { return overflow; }
+        void Reserve(unsigned int size) { delete[] (char*)mem; Allocate(size); }
 
     private:
-        T* mem; T* pos;
+        void Allocate(unsigned int size) { pos = mem = (T*)new char[sizeof(T) * size]; end = mem + size; overflow = false; }
+
+        T* mem; T* pos; T* end;
+        bool overflow;
     };
 
-    //Fuck it friday list.
+    //Fuck it friday list. Items added when full are dropped and Overflowed() is set.
     template <class T> class List
     {
     public:
-        List(unsigned int size = 2048) { pos = mem = (T*)new char[sizeof(T) * size]; }
-        ~List()                        { delete[] mem; }
-        void Add(T item)               { *pos = item; pos++; }
+        List(unsigned int size = BSP_QUERY_CAPACITY) { Allocate(size); }
+        ~List()                        { delete[] (char*)mem; }
+        List(const List&) = delete;
+        List& operator=(const List&) = delete;
+        void Add(T item)               { if(pos == end) { overflow = true; return; } *pos = item; pos++; }
         T At(unsigned int index) const { return mem[index]; }
         unsigned int Size() const      { return pos - mem; }
-        void Clear()                   { pos = mem; }
+        void Clear()                   { pos = mem; overflow = false; }
+        bool Overflowed() const        { return overflow; }
+        void Reserve(unsigned int size) { delete[] (char*)mem; Allocate(size); }
+
+    private:
+        void Allocate(unsigned int size) { pos = mem = (T*)new char[sizeof(T) * size]; end = mem + size; overflow = false; }
+
+        T* mem; T* pos; T* end;
+        bool overflow;
+    };
+
+
+    class BspModel;
+
+    typedef struct BspSortCacheItem
+    {
+        unsigned int item;
+        unsigned int skip; //Index of the first item after this nodes subtree.
+        unsigned int parent; //Index of the parent nodes item.
+    } BspSortCacheItem;
+
+    //Caller owned traversal state for BspModel queries. Queries sharing a context must not run at the same time,
+    //so give each thread its own. Capacity is in nodes. BspModel::GetQueryCapacity() is enough for any query on that model.
+    class BspQueryContext
+    {
+    public:
+        explicit BspQueryContext(unsigned int capacity = BSP_QUERY_CAPACITY) : stack(capacity), node_list(capacity) {}
+
+        void Reserve(unsigned int capacity) { stack.Reserve(capacity); node_list.Reserve(capacity); }
+
+        //The last query ran out of room and its output is missing nodes.
+        bool Overflowed() const { return stack.Overflowed() || node_list.Overflowed(); }
+
+    private:
+        friend class BspModel;
+
+        Stack<unsigned int> stack;
+        List<unsigned int> node_list;
+    };
+
+#ifdef BSP_PARALLEL_SORT
+    //Levels of the tree BspModel::SortParallel() walks itself before handing the subtrees below to the pool.
+    inline constexpr unsigned int BSP_SPLIT_DEPTH = 4;
+
+    //Piece of a parallel sort. One node above the split, or a whole subtree below it.
+    typedef struct BspSortSegment
+    {
+        unsigned int item;
+        bool subtree;
+    } BspSortSegment;
+
+    //Work stealing threads for BspModel::SortParallel().
+    //Each worker has a queue of segments and its own BspQueryContext. Workers take from the back
+    //of their own queue and steal from the front of the others. The thread calling SortParallel() is worker 0.
+    //One sort at a time per pool.
+    class BspSortPool
+    {
+    public:
+        explicit BspSortPool(unsigned int threads = std::thread::hardware_concurrency());
+        ~BspSortPool();
+
+        BspSortPool(const BspSortPool&) = delete;
+        BspSortPool& operator=(const BspSortPool&) = delete;
+
+        //Including the calling thread.
+        unsigned int GetThreadCount() const { return workers.size(); }
+
+        //A worker's context ran out of room in the last sort and its output is missing nodes.
+        bool Overflowed() const { return overflow.load(std::memory_order_relaxed); }
 
     private:
-        T* mem; T* pos;
+        friend class BspModel;
+
+        //Called with the data given to Run().
+        typedef void (*Task)(const void* data, unsigned int segment, BspQueryContext& context);
+
+        class Worker
+        {
+        public:
+            std::mutex lock;
+            std::deque<unsigned int> segments;
+            BspQueryContext context;
+        };
+
+        //Runs task for every segment and returns once all are done.
+        void Run(Task task, const void* data);
+
+        //As above, for a callable taking (segment, context).
+        template<class TTask> void Run(const TTask& task)
+        {
+            Run([](const void* data, unsigned int segment, BspQueryContext& context)
+            {
+                (*static_cast<const TTask*>(data))(segment, context);
+            }, &task);
+        }
+
+        bool RunOne(unsigned int worker);
+        void WorkerThread(unsigned int worker);
+        void Reserve(unsigned int capacity);
+
+        std::vector<std::unique_ptr<Worker>> workers;
+        std::vector<std::thread> threads;
+
+        std::mutex wake_lock;
+        std::condition_variable wake;
+        unsigned int generation = 0;
+        bool quit = false;
+
+        Task task = nullptr;
+        const void* task_data = nullptr;
+
+        //Segments not yet finished. Run() sleeps on it.
+        std::atomic<unsigned int> pending = 0;
+
+        //Set by any segment that overflowed. Read once pending has reached 0.
+        std::atomic<bool> overflow = false;
+
+        unsigned int capacity = 0;
+
+        //Back to front. Each segment's output goes to the list of the same index.
+        std::vector<BspSortSegment> segments;
+        std::vector<std::vector<const BspModelTriangle*>> tri_lists;
+        std::vector<std::vector<const BspModelPolygon*>> poly_lists;
     };
+#endif
+
+    //Caller owned state for BspModel::SortCoherent.
+    //Holds the back-to-front traversal of the whole tree for the last eye position.
+    class BspSortCache
+    {
+    public:
+        void Invalidate()   { model = nullptr; }
+
+    private:
+        friend class BspModel;
+
+        const BspModel* model = nullptr;
+
+        V3<fp> eye;
+        fp safe_distance = 0; //Distance to the nearest splitting plane from eye.
 
+        std::vector<BspSortCacheItem> items;
+        std::vector<unsigned int> masks;
+        std::vector<unsigned int> stack;
+    };
 
     class BspModel
     {
     public:
         BspModelHeader header;
 
-        void Sort(const V3<fp>& p, const AABB<fp>& frustrum, std::vector<const BspModelTriangle *> &out, bool backface_cull) const;
+        //Triangles, for collision.
+        void Sort(const V3<fp>& p, const AABB<fp>& frustrum, std::vector<const BspModelTriangle *> &out, bool backface_cull, BspQueryContext& context) const;
+
+        //Polygons, for drawing. Culls against the frustrum planes directly. Returned polygons have already been plane tested.
+        void Sort(const V3<fp>& p, const Plane<fp> frustrum[6], std::vector<const BspModelPolygon *> &out, bool backface_cull, BspQueryContext& context) const;
+
+        //As above, but reuses the traversal order in cache while the eye stays on the same side of every splitting plane.
+        //Only frustrum rejection is re-run on a hit. Returns true if the cache was hit.
+        //Needs unit plane normals, as CheckLimits() tests for.
+        bool SortCoherent(const V3<fp>& p, const Plane<fp> frustrum[6], std::vector<const BspModelPolygon *> &out, bool backface_cull, BspSortCache& cache, BspQueryContext& context) const;
+
+#ifdef BSP_PARALLEL_SORT
+        //As Sort, but the tree is split split_depth levels down and the subtrees below are traversed,
+        //frustrum culled and output by the pool's threads. Their lists are joined back to front.
+        void SortParallel(const V3<fp>& p, const AABB<fp>& frustrum, std::vector<const BspModelTriangle *> &out, bool backface_cull, BspSortPool& pool, unsigned int split_depth = BSP_SPLIT_DEPTH) const;
+        void SortParallel(const V3<fp>& p, const Plane<fp> frustrum[6], std::vector<const BspModelPolygon *> &out, bool backface_cull, BspSortPool& pool, unsigned int split_depth = BSP_SPLIT_DEPTH) const;
+#endif
+
+        //False if the model breaks a limit the sorts rely on. Worth checking once when a model is loaded.
+        bool CheckLimits() const;
+
+        //Capacity a BspQueryContext needs so no query on this model can overflow it.
+        //The stack holds at most two items per level of the tree plus the one being expanded.
+        unsigned int GetQueryCapacity() const
+        {
+            return (header.node_count * 2) + 1;
+        }
 
         const BspNodeTexture* GetTexture(int n) const
         {
@@ -58,6 +246,11 @@ namespace P3D
             return &((const pixel*)(GetBasePtr() + header.texture_pixels_offset))[n];
         }
 
+        const unsigned char* GetTextureAlphaSkip(unsigned int n) const
+        {
+            return (const unsigned char*)GetTexturePixels(n);
+        }
+
         unsigned int GetColorMapColor(unsigned int n) const
         {
             return GetColorMap()[n];
@@ -75,11 +268,24 @@ namespace P3D
 
     private:
 
-        static Stack<unsigned int> stack;
-        static List<unsigned int> node_list;
+        void OutputTris(const AABB<P3D::fp> &frustrum, std::vector<const BspModelTriangle *> &out, bool backface_cull, const BspQueryContext& context) const;
+        void SortBackToFront(const V3<P3D::fp> &p, const AABB<fp>& frustrum, BspQueryContext& context, unsigned int root = 0) const;
+
+        void OutputPolygons(const Plane<fp> frustrum[6], std::vector<const BspModelPolygon *> &out, bool backface_cull, const BspQueryContext& context) const;
+        void SortBackToFront(const V3<P3D::fp> &p, const Plane<fp> frustrum[6], BspQueryContext& context, unsigned int root = 0) const;
+
+#ifdef BSP_PARALLEL_SORT
+        void SplitBackToFront(const V3<P3D::fp> &p, const AABB<fp>& frustrum, unsigned int item, unsigned int depth, std::vector<BspSortSegment>& segments) const;
+        void SplitBackToFront(const V3<P3D::fp> &p, const Plane<fp> frustrum[6], unsigned int item, unsigned int depth, std::vector<BspSortSegment>& segments) const;
+#endif
 
-        void OutputTris(const AABB<P3D::fp> &frustrum, std::vector<const BspModelTriangle *> &out, bool backface_cull) const;
-        void SortBackToFront(const V3<P3D::fp> &p, const AABB<fp>& frustrum) const;
+        bool CheckSortCache(const V3<fp>& p, BspSortCache& cache) const;
+        void BuildSortCache(const V3<fp>& p, BspSortCache& cache) const;
+        void ReplaySortCache(const Plane<fp> frustrum[6], BspSortCache& cache, BspQueryContext& context) const;
+
+        bool FrustrumCullAABB(const AABB<fp>& bb, const Plane<fp> frustrum[6], unsigned int& inside_mask) const;
+        bool FrustrumCullPolygon(const BspModelPolygon* poly, const Plane<fp> frustrum[6], const unsigned int inside_mask) const;
+        void OutputPolygonList(const TriIndexList* list, const Plane<fp> frustrum[6], const unsigned int inside_mask, std::vector<const BspModelPolygon *> &out) const;
 
         const unsigned char* GetBasePtr() const
         {
@@ -98,6 +304,11 @@ namespace P3D
             return &((const BspModelTriangle*)(GetBasePtr() + header.triangle_offset))[n];
         }
 
+        const BspModelPolygon* GetPolygon(unsigned int n) const
+        {
+            return &((const BspModelPolygon*)(GetBasePtr() + header.polygon_offset))[n];
+        }
+
         const BspModelNode* GetNode(unsigned int n) const
         {
             return &((const BspModelNode*)(GetBasePtr() + header.node_offset))[n];